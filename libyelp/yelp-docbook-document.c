@@ -24,10 +24,12 @@
 
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <libxml/parser.h>
 #include <libxml/parserInternals.h>
 #include <libxml/xinclude.h>
+#include <libxml/xmlreader.h>
 
 #include "yelp-docbook-document.h"
 #include "yelp-error.h"
@@ -40,6 +42,16 @@
 #define DEFAULT_CATALOG "file:///etc/xml/catalog"
 #define YELP_CATALOG "file://"DATADIR"/yelp/dtd/catalog"
 
+/* Files bigger than this are never loaded as a whole. We stream them with
+ * xmlTextReader instead and only build a tree for one page at a time.
+ */
+#define STREAM_THRESHOLD (8 * 1024 * 1024)
+/* How many extracted pages may wait for the transform */
+#define STREAM_QUEUE_MAX 2
+#define STREAM_PARSE_FLAGS (XML_PARSE_DTDLOAD | XML_PARSE_NOCDATA | \
+                            XML_PARSE_NOENT   | XML_PARSE_NONET   | \
+                            XML_PARSE_XINCLUDE | XML_PARSE_NOXINCNODE)
+
 typedef enum {
     DOCBOOK_STATE_BLANK,   /* Brand new, run transform as needed */
     DOCBOOK_STATE_PARSING, /* Parsing/transforming document, please wait */
@@ -52,10 +64,29 @@ enum {
     DOCBOOK_COLUMN_TITLE
 };
 
+/* The parsed and walked document tree is shared between the transform
+ * and the indexer, so searching right after opening a document doesn't
+ * parse the whole book a second time. Whoever drops the last reference
+ * frees the tree.
+ */
+typedef struct _DocbookTree DocbookTree;
+struct _DocbookTree {
+    xmlDocPtr doc;
+    gint      ref_count;
+};
+
+/* A page pulled out of a streamed file, waiting for the transform */
+typedef struct {
+    gchar       *id;
+    DocbookTree *tree;
+} DocbookStreamPage;
+
 static void           yelp_docbook_document_dispose         (GObject                  *object);
 static void           yelp_docbook_document_finalize        (GObject                  *object);
 
 static void           docbook_index             (YelpDocument         *document);
+static void           docbook_index_start       (YelpDocbookDocument  *docbook,
+                                                 DocbookTree          *tree);
 static gboolean       docbook_request_page      (YelpDocument         *document,
                                                  const gchar          *page_id,
                                                  GCancellable         *cancellable,
@@ -79,6 +110,7 @@ static gboolean       docbook_walk_chunkQ       (YelpDocbookDocument  *docbook,
                                                  gint                  max_depth);
 static gboolean       docbook_walk_divisionQ    (YelpDocbookDocument  *docbook,
                                                  xmlNodePtr            cur);
+static gboolean       docbook_name_divisionQ    (const xmlChar        *name);
 static gchar *        docbook_walk_get_title    (YelpDocbookDocument  *docbook,
                                                  xmlNodePtr            cur);
 
@@ -89,9 +121,20 @@ static void           transform_finished        (YelpTransform        *transform
                                                  YelpDocbookDocument  *docbook);
 static void           transform_error           (YelpTransform        *transform,
                                                  YelpDocbookDocument  *docbook);
-static void           transform_finalized       (YelpDocbookDocument  *docbook,
+static void           transform_finalized       (DocbookTree          *tree,
                                                  gpointer              transform);
 
+static gboolean       docbook_stream_process    (YelpDocbookDocument  *docbook,
+                                                 const gchar          *filepath);
+static gboolean       docbook_stream_request    (YelpDocbookDocument  *docbook,
+                                                 const gchar          *page_id);
+static gboolean       docbook_stream_next       (YelpDocbookDocument  *docbook);
+static void           docbook_stream_page_free  (DocbookStreamPage    *page);
+
+static DocbookTree *  docbook_tree_new          (xmlDocPtr             doc);
+static DocbookTree *  docbook_tree_ref          (DocbookTree          *tree);
+static void           docbook_tree_unref        (DocbookTree          *tree);
+
 G_DEFINE_TYPE (YelpDocbookDocument, yelp_docbook_document, YELP_TYPE_DOCUMENT)
 #define GET_PRIV(object) (G_TYPE_INSTANCE_GET_PRIVATE ((object), YELP_TYPE_DOCBOOK_DOCUMENT, YelpDocbookDocumentPrivate))
 
@@ -104,6 +147,7 @@ struct _YelpDocbookDocumentPrivate {
 
     GThread       *index;
     gboolean       index_running;
+    gboolean       index_pending;
 
     gboolean       process_running;
     gboolean       transform_running;
@@ -113,13 +157,28 @@ struct _YelpDocbookDocumentPrivate {
     guint          finished;
     guint          error;
 
-    xmlDocPtr     xmldoc;
+    DocbookTree  *tree;
     xmlNodePtr    xmlcur;
+    gint          divisions;  /* Divisions walked so far, for autoids */
     gint          max_depth;
     gint          cur_depth;
     gchar        *cur_page_id;
     gchar        *cur_prev_id;
     gchar        *root_id;
+    YelpDocumentBatch *batch;
+
+    /* Streaming mode, for files above STREAM_THRESHOLD */
+    gboolean       streaming;
+    gboolean       stream_running;
+    gboolean       stream_done;     /* The reader has handed over every page */
+    gboolean       stream_found;
+    gchar         *stream_file;
+    gchar         *stream_page;     /* Page being transformed */
+    xmlDocPtr      stream_outline;  /* Every page, with just its titles */
+    GHashTable    *stream_nodes;    /* Page IDs to their stubs in the outline */
+    GHashTable    *stream_pending;  /* Page IDs not transformed yet */
+    GQueue        *stream_queue;    /* Extracted pages waiting to be transformed */
+    GCond          stream_cond;
 
     GFileMonitor **monitors;
     gint64         reload_time;
@@ -161,8 +220,12 @@ yelp_docbook_document_init (YelpDocbookDocument *docbook)
     YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
 
     priv->state = DOCBOOK_STATE_BLANK;
+    priv->stream_queue = g_queue_new ();
+    priv->stream_nodes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    priv->stream_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
     g_mutex_init (&priv->mutex);
+    g_cond_init (&priv->stream_cond);
 }
 
 static void
@@ -171,6 +234,12 @@ yelp_docbook_document_dispose (GObject *object)
     gint i;
     YelpDocbookDocumentPrivate *priv = GET_PRIV (object);
 
+    /* Still set if the transform never got to finish */
+    if (priv->tree) {
+        docbook_tree_unref (priv->tree);
+        priv->tree = NULL;
+    }
+
     if (priv->monitors != NULL) {
         for (i = 0; priv->monitors[i]; i++) {
             g_object_unref (priv->monitors[i]);
@@ -187,14 +256,20 @@ yelp_docbook_document_finalize (GObject *object)
 {
     YelpDocbookDocumentPrivate *priv = GET_PRIV (object);
 
-    if (priv->xmldoc)
-        xmlFreeDoc (priv->xmldoc);
-
     g_free (priv->cur_page_id);
     g_free (priv->cur_prev_id);
     g_free (priv->root_id);
 
+    g_free (priv->stream_file);
+    g_free (priv->stream_page);
+    g_queue_free_full (priv->stream_queue, (GDestroyNotify) docbook_stream_page_free);
+    g_hash_table_destroy (priv->stream_nodes);
+    g_hash_table_destroy (priv->stream_pending);
+    if (priv->stream_outline)
+        xmlFreeDoc (priv->stream_outline);
+
     g_mutex_clear (&priv->mutex);
+    g_cond_clear (&priv->stream_cond);
 
     G_OBJECT_CLASS (yelp_docbook_document_parent_class)->finalize (object);
 }
@@ -279,6 +354,9 @@ docbook_request_page (YelpDocument         *document,
     case DOCBOOK_STATE_PARSING:
         break;
     case DOCBOOK_STATE_PARSED:
+        if (priv->streaming && docbook_stream_request (YELP_DOCBOOK_DOCUMENT (document), page_id))
+            break;
+        /* fall through */
     case DOCBOOK_STATE_STOP:
         docuri = yelp_uri_get_document_uri (yelp_document_get_uri (document));
         error = g_error_new (YELP_ERROR, YELP_ERROR_NOT_FOUND,
@@ -314,6 +392,7 @@ docbook_process (YelpDocbookDocument *docbook)
     GError *error;
     gint  params_i = 0;
     gchar **params = NULL;
+    GStatBuf statbuf;
 
     debug_print (DB_FUNCTION, "entering\n");
 
@@ -337,6 +416,12 @@ docbook_process (YelpDocbookDocument *docbook)
         goto done;
     }
 
+    priv->streaming = FALSE;
+    if (g_stat (filepath, &statbuf) == 0 && statbuf.st_size > STREAM_THRESHOLD) {
+        docbook_stream_process (docbook, filepath);
+        goto done;
+    }
+
     parserCtxt = xmlNewParserCtxt ();
     xmldoc = xmlCtxtReadFile (parserCtxt,
                               filepath, NULL,
@@ -373,8 +458,11 @@ docbook_process (YelpDocbookDocument *docbook)
     else
         priv->max_depth = 1;
 
-    priv->xmldoc = xmldoc;
+    if (priv->tree)
+        docbook_tree_unref (priv->tree);
+    priv->tree = docbook_tree_new (xmldoc);
     priv->xmlcur = xmlDocGetRootElement (xmldoc);
+    priv->batch = yelp_document_batch_new ();
 
     id = xmlGetProp (priv->xmlcur, BAD_CAST "id");
     if (!id)
@@ -382,12 +470,12 @@ docbook_process (YelpDocbookDocument *docbook)
 
     if (id) {
         priv->root_id = g_strdup ((const gchar *) id);
-        yelp_document_set_page_id (document, NULL, (gchar *) id);
-        yelp_document_set_page_id (document, "//index", (gchar *) id);
+        yelp_document_batch_set_page_id (priv->batch, NULL, (gchar *) id);
+        yelp_document_batch_set_page_id (priv->batch, "//index", (gchar *) id);
     }
     else {
         priv->root_id = g_strdup ("//index");
-        yelp_document_set_page_id (document, NULL, "//index");
+        yelp_document_batch_set_page_id (priv->batch, NULL, "//index");
         /* add the id attribute to the root element with value "index"
          * so when we try to load the document later, it doesn't fail */
         if (priv->xmlcur->ns)
@@ -397,7 +485,7 @@ docbook_process (YelpDocbookDocument *docbook)
         else
             xmlNewProp (priv->xmlcur, BAD_CAST "id", BAD_CAST "//index");
     }
-    yelp_document_set_root_id (document, priv->root_id, priv->root_id);
+    yelp_document_batch_set_root_id (priv->batch, priv->root_id, priv->root_id);
     g_mutex_unlock (&priv->mutex);
 
     g_mutex_lock (&priv->mutex);
@@ -407,8 +495,13 @@ docbook_process (YelpDocbookDocument *docbook)
     }
     g_mutex_unlock (&priv->mutex);
 
+    priv->divisions = 0;
     docbook_walk (docbook);
 
+    /* Publish the whole page structure at once */
+    yelp_document_commit_batch (document, priv->batch);
+    priv->batch = NULL;
+
     g_mutex_lock (&priv->mutex);
     if (priv->state == DOCBOOK_STATE_STOP) {
         g_mutex_unlock (&priv->mutex);
@@ -417,7 +510,21 @@ docbook_process (YelpDocbookDocument *docbook)
 
     priv->state = DOCBOOK_STATE_PARSED;
 
+    /* The walk is done, so the tree won't change under the indexer */
+    if (priv->index_pending) {
+        priv->index_pending = FALSE;
+        docbook_index_start (docbook, docbook_tree_ref (priv->tree));
+    }
+
     priv->transform = yelp_transform_new (STYLESHEET);
+    /* The transform may outlive priv->tree, if the document is reloaded
+       or disposed. We can't free the tree before the transform is
+       finalized, or we could crash when YelpTransform frees its libxslt
+       resources, so the transform holds its own reference.
+     */
+    g_object_weak_ref ((GObject *) priv->transform,
+                       (GWeakNotify) transform_finalized,
+                       docbook_tree_ref (priv->tree));
     priv->chunk_ready =
         g_signal_connect (priv->transform, "chunk-ready",
                           (GCallback) transform_chunk_ready,
@@ -438,7 +545,7 @@ docbook_process (YelpDocbookDocument *docbook)
 
     priv->transform_running = TRUE;
     yelp_transform_start (priv->transform,
-                          priv->xmldoc,
+                          priv->tree->doc,
                           NULL,
 			  (const gchar * const *) params);
     g_strfreev (params);
@@ -450,8 +557,20 @@ docbook_process (YelpDocbookDocument *docbook)
         xmlFree (id);
     if (parserCtxt)
         xmlFreeParserCtxt (parserCtxt);
+    if (priv->batch) {
+        yelp_document_batch_free (priv->batch);
+        priv->batch = NULL;
+    }
 
+    g_mutex_lock (&priv->mutex);
+    if (priv->index_pending) {
+        /* We never got a usable tree, let the indexer try on its own */
+        priv->index_pending = FALSE;
+        docbook_index_start (docbook, NULL);
+    }
     priv->process_running = FALSE;
+    g_mutex_unlock (&priv->mutex);
+
     g_object_unref (docbook);
 }
 
@@ -475,6 +594,17 @@ docbook_disconnect (YelpDocbookDocument *docbook)
     g_object_unref (priv->transform);
     priv->transform = NULL;
     priv->transform_running = FALSE;
+
+    /* The tree is only kept while the transform runs, so that an index
+     * run asked for meanwhile can share it. A running index holds its own
+     * reference, and a later one parses the file itself.
+     */
+    g_mutex_lock (&priv->mutex);
+    if (priv->tree) {
+        docbook_tree_unref (priv->tree);
+        priv->tree = NULL;
+    }
+    g_mutex_unlock (&priv->mutex);
 }
 
 static gboolean
@@ -482,7 +612,8 @@ docbook_reload (YelpDocbookDocument *docbook)
 {
     YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
 
-    if (priv->index_running || priv->process_running || priv->transform_running)
+    if (priv->index_running || priv->process_running ||
+        priv->transform_running || priv->stream_running)
         return TRUE;
 
     g_mutex_lock (&priv->mutex);
@@ -515,7 +646,8 @@ docbook_monitor_changed   (GFileMonitor         *monitor,
     if (g_get_monotonic_time() - priv->reload_time < 1000)
         return;
 
-    if (priv->index_running || priv->process_running || priv->transform_running) {
+    if (priv->index_running || priv->process_running ||
+        priv->transform_running || priv->stream_running) {
         g_timeout_add_seconds (1, (GSourceFunc) docbook_reload, docbook);
         return;
     }
@@ -528,14 +660,11 @@ docbook_monitor_changed   (GFileMonitor         *monitor,
 static void
 docbook_walk (YelpDocbookDocument *docbook)
 {
-    static       gint autoid = 0;
     gchar        autoidstr[20];
     xmlChar     *id = NULL;
     xmlChar     *title = NULL;
     xmlNodePtr   cur, old_cur;
-    gboolean chunkQ;
     YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
-    YelpDocument *document = YELP_DOCUMENT (docbook);
 
     debug_print (DB_FUNCTION, "entering\n");
     debug_print (DB_DEBUG, "  priv->xmlcur->name: %s\n", priv->xmlcur->name);
@@ -555,10 +684,15 @@ docbook_walk (YelpDocbookDocument *docbook)
     if (!id)
         id = xmlGetNsProp (priv->xmlcur, XML_XML_NAMESPACE, BAD_CAST "id");
 
+    if (docbook_walk_divisionQ (docbook, priv->xmlcur))
+        priv->divisions++;
+
     if (docbook_walk_divisionQ (docbook, priv->xmlcur) && !id) {
-        /* If id attribute is not present, autogenerate a
-         * unique value, and insert it into the in-memory tree */
-        g_snprintf (autoidstr, 20, "//autoid-%d", ++autoid);
+        /* If id attribute is not present, autogenerate one from the
+         * division's position in the document, and insert it into the
+         * in-memory tree. The streaming code numbers divisions the same
+         * way, so these stay stable across runs and reloads. */
+        g_snprintf (autoidstr, 20, "//autoid-%d", priv->divisions);
         if (priv->xmlcur->ns) {
             xmlNewNsProp (priv->xmlcur,
                           xmlNewNs (priv->xmlcur, XML_XML_NAMESPACE, BAD_CAST "xml"),
@@ -577,34 +711,27 @@ docbook_walk (YelpDocbookDocument *docbook)
         debug_print (DB_DEBUG, "  id: \"%s\"\n", id);
         debug_print (DB_DEBUG, "  title: \"%s\"\n", title);
 
-        yelp_document_set_page_title (document, (gchar *) id, (gchar *) title);
+        yelp_document_batch_set_page_title (priv->batch, (gchar *) id, (gchar *) title);
 
         if (priv->cur_prev_id) {
-            yelp_document_set_prev_id (document, (gchar *) id, priv->cur_prev_id);
-            yelp_document_set_next_id (document, priv->cur_prev_id, (gchar *) id);
+            yelp_document_batch_set_prev_id (priv->batch, (gchar *) id, priv->cur_prev_id);
+            yelp_document_batch_set_next_id (priv->batch, priv->cur_prev_id, (gchar *) id);
             g_free (priv->cur_prev_id);
         }
         priv->cur_prev_id = g_strdup ((gchar *) id);
 
         if (priv->cur_page_id)
-            yelp_document_set_up_id (document, (gchar *) id, priv->cur_page_id);
+            yelp_document_batch_set_up_id (priv->batch, (gchar *) id, priv->cur_page_id);
         priv->cur_page_id = g_strdup ((gchar *) id);
     }
 
     old_cur = priv->xmlcur;
     priv->cur_depth++;
     if (id) {
-        yelp_document_set_root_id (document, (gchar *) id, priv->root_id);
-        yelp_document_set_page_id (document, (gchar *) id, priv->cur_page_id);
+        yelp_document_batch_set_root_id (priv->batch, (gchar *) id, priv->root_id);
+        yelp_document_batch_set_page_id (priv->batch, (gchar *) id, priv->cur_page_id);
     }
 
-    chunkQ = docbook_walk_chunkQ (docbook, priv->xmlcur, priv->cur_depth, priv->max_depth);
-    if (chunkQ)
-        yelp_document_signal (YELP_DOCUMENT (docbook),
-                              priv->cur_page_id,
-                              YELP_DOCUMENT_SIGNAL_INFO,
-                              NULL);
-
     for (cur = priv->xmlcur->children; cur; cur = cur->next) {
         if (cur->type == XML_ELEMENT_NODE) {
             priv->xmlcur = cur;
@@ -643,32 +770,38 @@ docbook_walk_chunkQ (YelpDocbookDocument *docbook,
 static gboolean
 docbook_walk_divisionQ (YelpDocbookDocument *docbook, xmlNodePtr node)
 {
-    return (!xmlStrcmp (node->name, (const xmlChar *) "appendix")     ||
-            !xmlStrcmp (node->name, (const xmlChar *) "article")      ||
-            !xmlStrcmp (node->name, (const xmlChar *) "book")         ||
-            !xmlStrcmp (node->name, (const xmlChar *) "bibliography") ||
-            !xmlStrcmp (node->name, (const xmlChar *) "bibliodiv")    ||
-            !xmlStrcmp (node->name, (const xmlChar *) "chapter")      ||
-            !xmlStrcmp (node->name, (const xmlChar *) "colophon")     ||
-            !xmlStrcmp (node->name, (const xmlChar *) "dedication")   ||
-            !xmlStrcmp (node->name, (const xmlChar *) "glossary")     ||
-            !xmlStrcmp (node->name, (const xmlChar *) "glossdiv")     ||
-            !xmlStrcmp (node->name, (const xmlChar *) "lot")          ||
-            !xmlStrcmp (node->name, (const xmlChar *) "index")        ||
-            !xmlStrcmp (node->name, (const xmlChar *) "part")         ||
-            !xmlStrcmp (node->name, (const xmlChar *) "preface")      ||
-            !xmlStrcmp (node->name, (const xmlChar *) "reference")    ||
-            !xmlStrcmp (node->name, (const xmlChar *) "refentry")     ||
-            !xmlStrcmp (node->name, (const xmlChar *) "sect1")        ||
-            !xmlStrcmp (node->name, (const xmlChar *) "sect2")        ||
-            !xmlStrcmp (node->name, (const xmlChar *) "sect3")        ||
-            !xmlStrcmp (node->name, (const xmlChar *) "sect4")        ||
-            !xmlStrcmp (node->name, (const xmlChar *) "sect5")        ||
-            !xmlStrcmp (node->name, (const xmlChar *) "section")      ||
-            !xmlStrcmp (node->name, (const xmlChar *) "set")          ||
-            !xmlStrcmp (node->name, (const xmlChar *) "setindex")     ||
-            !xmlStrcmp (node->name, (const xmlChar *) "simplesect")   ||
-            !xmlStrcmp (node->name, (const xmlChar *) "toc")          );
+    return docbook_name_divisionQ (node->name);
+}
+
+static gboolean
+docbook_name_divisionQ (const xmlChar *name)
+{
+    return (!xmlStrcmp (name, (const xmlChar *) "appendix")     ||
+            !xmlStrcmp (name, (const xmlChar *) "article")      ||
+            !xmlStrcmp (name, (const xmlChar *) "book")         ||
+            !xmlStrcmp (name, (const xmlChar *) "bibliography") ||
+            !xmlStrcmp (name, (const xmlChar *) "bibliodiv")    ||
+            !xmlStrcmp (name, (const xmlChar *) "chapter")      ||
+            !xmlStrcmp (name, (const xmlChar *) "colophon")     ||
+            !xmlStrcmp (name, (const xmlChar *) "dedication")   ||
+            !xmlStrcmp (name, (const xmlChar *) "glossary")     ||
+            !xmlStrcmp (name, (const xmlChar *) "glossdiv")     ||
+            !xmlStrcmp (name, (const xmlChar *) "lot")          ||
+            !xmlStrcmp (name, (const xmlChar *) "index")        ||
+            !xmlStrcmp (name, (const xmlChar *) "part")         ||
+            !xmlStrcmp (name, (const xmlChar *) "preface")      ||
+            !xmlStrcmp (name, (const xmlChar *) "reference")    ||
+            !xmlStrcmp (name, (const xmlChar *) "refentry")     ||
+            !xmlStrcmp (name, (const xmlChar *) "sect1")        ||
+            !xmlStrcmp (name, (const xmlChar *) "sect2")        ||
+            !xmlStrcmp (name, (const xmlChar *) "sect3")        ||
+            !xmlStrcmp (name, (const xmlChar *) "sect4")        ||
+            !xmlStrcmp (name, (const xmlChar *) "sect5")        ||
+            !xmlStrcmp (name, (const xmlChar *) "section")      ||
+            !xmlStrcmp (name, (const xmlChar *) "set")          ||
+            !xmlStrcmp (name, (const xmlChar *) "setindex")     ||
+            !xmlStrcmp (name, (const xmlChar *) "simplesect")   ||
+            !xmlStrcmp (name, (const xmlChar *) "toc")          );
 }
 
 static gchar *
@@ -793,6 +926,796 @@ docbook_walk_get_title (YelpDocbookDocument *docbook,
 
 /******************************************************************************/
 
+typedef struct {
+    const xmlChar *name;
+    gchar         *id;
+    gint           depth;
+    gchar         *title;
+    gint           title_rank;
+    GString       *str;
+    xmlDocPtr      doc;     /* The page's own tree, until it is handed over */
+    xmlNodePtr     node;    /* The page's element in doc or in the outline */
+} DocbookStreamFrame;
+
+typedef struct {
+    xmlTextReaderPtr  reader;
+    gint              divisions;  /* Divisions seen so far, for autoids */
+    gint              max_depth;
+    GArray           *frames;     /* Open pages, innermost last */
+    GPtrArray        *names;      /* Element names above the reader */
+} DocbookStream;
+
+static DocbookStream *
+docbook_stream_new (const gchar *filepath,
+                    gint         max_depth)
+{
+    DocbookStream *stream;
+    xmlTextReaderPtr reader;
+
+    reader = xmlReaderForFile (filepath, NULL, STREAM_PARSE_FLAGS);
+    if (reader == NULL)
+        return NULL;
+
+    stream = g_new0 (DocbookStream, 1);
+    stream->reader = reader;
+    stream->max_depth = max_depth;
+    stream->frames = g_array_new (FALSE, TRUE, sizeof (DocbookStreamFrame));
+    stream->names = g_ptr_array_new ();
+    return stream;
+}
+
+static void
+docbook_stream_pop (DocbookStream *stream)
+{
+    DocbookStreamFrame *frame;
+
+    frame = &g_array_index (stream->frames, DocbookStreamFrame, stream->frames->len - 1);
+    g_free (frame->id);
+    g_free (frame->title);
+    if (frame->str)
+        g_string_free (frame->str, TRUE);
+    if (frame->doc)
+        xmlFreeDoc (frame->doc);
+    g_array_set_size (stream->frames, stream->frames->len - 1);
+}
+
+static void
+docbook_stream_free (DocbookStream *stream)
+{
+    while (stream->frames->len > 0)
+        docbook_stream_pop (stream);
+    g_array_free (stream->frames, TRUE);
+    g_ptr_array_free (stream->names, TRUE);
+    xmlFreeTextReader (stream->reader);
+    g_free (stream);
+}
+
+static DocbookStreamFrame *
+docbook_stream_top (DocbookStream *stream)
+{
+    if (stream->frames->len == 0)
+        return NULL;
+    return &g_array_index (stream->frames, DocbookStreamFrame, stream->frames->len - 1);
+}
+
+static DocbookStreamFrame *
+docbook_stream_push (DocbookStream *stream,
+                     const gchar   *id)
+{
+    DocbookStreamFrame frame = { 0, };
+
+    frame.name = xmlTextReaderConstLocalName (stream->reader);
+    frame.id = g_strdup (id);
+    frame.depth = xmlTextReaderDepth (stream->reader);
+    frame.title_rank = G_MAXINT;
+    g_array_append_val (stream->frames, frame);
+
+    return docbook_stream_top (stream);
+}
+
+/* Advances the reader, keeping track of the element names above it */
+static gint
+docbook_stream_read (DocbookStream *stream)
+{
+    gint ret, depth;
+
+    ret = xmlTextReaderRead (stream->reader);
+    if (ret == 1 && xmlTextReaderNodeType (stream->reader) == XML_READER_TYPE_ELEMENT) {
+        depth = xmlTextReaderDepth (stream->reader);
+        g_ptr_array_set_size (stream->names, depth + 1);
+        g_ptr_array_index (stream->names, depth) =
+            (gpointer) xmlTextReaderConstLocalName (stream->reader);
+    }
+    return ret;
+}
+
+/* Moves the reader to the end of the current element. Divisions are still
+ * counted on the way, so autogenerated IDs match between passes.
+ */
+static gboolean
+docbook_stream_skip (DocbookStream *stream)
+{
+    gint depth = xmlTextReaderDepth (stream->reader);
+
+    if (xmlTextReaderIsEmptyElement (stream->reader))
+        return TRUE;
+
+    while (xmlTextReaderRead (stream->reader) == 1) {
+        gint type = xmlTextReaderNodeType (stream->reader);
+        if (type == XML_READER_TYPE_END_ELEMENT && xmlTextReaderDepth (stream->reader) == depth)
+            return TRUE;
+        if (type == XML_READER_TYPE_ELEMENT &&
+            docbook_name_divisionQ (xmlTextReaderConstLocalName (stream->reader)))
+            stream->divisions++;
+    }
+    return FALSE;
+}
+
+/* Returns the ID of the element under the reader, making one up for the
+ * root element and for divisions without one. Has to be called for every
+ * division in document order.
+ */
+static gchar *
+docbook_stream_get_id (DocbookStream *stream,
+                       gboolean      *generated)
+{
+    xmlChar *id;
+    gchar *ret = NULL;
+    gboolean division;
+
+    division = docbook_name_divisionQ (xmlTextReaderConstLocalName (stream->reader));
+    if (division)
+        stream->divisions++;
+
+    id = xmlTextReaderGetAttribute (stream->reader, BAD_CAST "id");
+    if (!id)
+        id = xmlTextReaderGetAttributeNs (stream->reader, BAD_CAST "id", XML_XML_NAMESPACE);
+
+    if (generated)
+        *generated = (id == NULL);
+
+    if (id) {
+        ret = g_strdup ((const gchar *) id);
+        xmlFree (id);
+    }
+    else if (xmlTextReaderDepth (stream->reader) == 0)
+        ret = g_strdup ("//index");
+    else if (division)
+        ret = g_strdup_printf ("//autoid-%d", stream->divisions);
+
+    return ret;
+}
+
+static void
+docbook_stream_set_id (xmlNodePtr   node,
+                       const gchar *id)
+{
+    if (node->ns)
+        xmlNewNsProp (node,
+                      xmlNewNs (node, XML_XML_NAMESPACE, BAD_CAST "xml"),
+                      BAD_CAST "id", BAD_CAST id);
+    else
+        xmlNewProp (node, BAD_CAST "id", BAD_CAST id);
+}
+
+/* Gives copied divisions the same IDs docbook_stream_get_id gave them */
+static void
+docbook_stream_fix_ids (DocbookStream *stream,
+                        xmlNodePtr     node)
+{
+    xmlNodePtr child;
+
+    if (node->type != XML_ELEMENT_NODE)
+        return;
+
+    if (docbook_name_divisionQ (node->name)) {
+        stream->divisions++;
+        if (!xmlHasProp (node, BAD_CAST "id")) {
+            gchar *id = g_strdup_printf ("//autoid-%d", stream->divisions);
+            docbook_stream_set_id (node, id);
+            g_free (id);
+        }
+    }
+
+    for (child = node->children; child; child = child->next)
+        docbook_stream_fix_ids (stream, child);
+}
+
+/* Elements stubs keep, so the transform can still title and link pages */
+static gboolean
+docbook_stream_titleQ (const xmlChar *name)
+{
+    return (!xmlStrcmp (name, BAD_CAST "title")       ||
+            !xmlStrcmp (name, BAD_CAST "titleabbrev") ||
+            !xmlStrcmp (name, BAD_CAST "subtitle")    ||
+            !xmlStrcmp (name, BAD_CAST "refmeta")     ||
+            !xmlStrcmp (name, BAD_CAST "refnamediv")  ||
+            g_str_has_suffix ((const gchar *) name, "info"));
+}
+
+/* Ranks title candidates for the page in frame the way docbook_walk_get_title
+ * does. Lower is better, G_MAXINT means the element isn't a candidate.
+ */
+static gint
+docbook_stream_title_rank (DocbookStream      *stream,
+                           DocbookStreamFrame *frame)
+{
+    const xmlChar *name = xmlTextReaderConstLocalName (stream->reader);
+    gint depth = xmlTextReaderDepth (stream->reader);
+    gboolean refentry = !xmlStrcmp (frame->name, BAD_CAST "refentry");
+    const xmlChar *parent;
+
+    if (depth == frame->depth + 1) {
+        if (refentry)
+            return G_MAXINT;
+        if (!xmlStrcmp (name, BAD_CAST "titleabbrev"))
+            return 0;
+        if (!xmlStrcmp (name, BAD_CAST "title"))
+            return 1;
+        return G_MAXINT;
+    }
+    if (depth != frame->depth + 2)
+        return G_MAXINT;
+
+    parent = g_ptr_array_index (stream->names, depth - 1);
+    if (refentry) {
+        if (!xmlStrcmp (parent, BAD_CAST "refmeta") &&
+            !xmlStrcmp (name, BAD_CAST "refentrytitle"))
+            return 0;
+        if (!xmlStrcmp (parent, BAD_CAST "refentryinfo")) {
+            if (!xmlStrcmp (name, BAD_CAST "titleabbrev"))
+                return 1;
+            if (!xmlStrcmp (name, BAD_CAST "title"))
+                return 2;
+        }
+        if (!xmlStrcmp (parent, BAD_CAST "refnamediv") &&
+            !xmlStrcmp (name, BAD_CAST "refname"))
+            return 3;
+        return G_MAXINT;
+    }
+
+    if (!g_str_has_suffix ((const gchar *) parent, "info"))
+        return G_MAXINT;
+    if (!xmlStrcmp (name, BAD_CAST "titleabbrev"))
+        return 2;
+    if (!xmlStrcmp (name, BAD_CAST "title"))
+        return 3;
+    return G_MAXINT;
+}
+
+static void
+docbook_stream_walk_pop (YelpDocbookDocument *docbook,
+                         DocbookStream       *stream)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    DocbookStreamFrame *top = docbook_stream_top (stream);
+
+    yelp_document_batch_set_page_title (priv->batch, top->id,
+                                        top->title ? top->title : _("Unknown"));
+    docbook_stream_pop (stream);
+}
+
+/* Does what docbook_walk does, without ever holding more than the reader's
+ * current node in memory. Along the way, it builds an outline of the book
+ * holding each page with only its titles, for docbook_stream_extract.
+ */
+static gboolean
+docbook_stream_walk (YelpDocbookDocument *docbook,
+                     DocbookStream       *stream)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    gchar *prev_id = NULL;
+    gint pi_max = 0;
+    gint ret;
+
+    while ((ret = docbook_stream_read (stream)) == 1) {
+        DocbookStreamFrame *top = docbook_stream_top (stream);
+        gint type = xmlTextReaderNodeType (stream->reader);
+        gint depth = xmlTextReaderDepth (stream->reader);
+        const xmlChar *name = xmlTextReaderConstLocalName (stream->reader);
+        xmlNodePtr node;
+        gboolean generated;
+        gchar *id;
+
+        if (type == XML_READER_TYPE_PROCESSING_INSTRUCTION) {
+            /* Check for the db.chunk.max_depth PI before the root element */
+            if (priv->root_id == NULL &&
+                !xmlStrcmp (name, BAD_CAST "db.chunk.max_depth"))
+                pi_max = atoi ((const gchar *) xmlTextReaderConstValue (stream->reader));
+            continue;
+        }
+        if (type == XML_READER_TYPE_END_ELEMENT) {
+            if (top && top->depth == depth)
+                docbook_stream_walk_pop (docbook, stream);
+            continue;
+        }
+        if (type != XML_READER_TYPE_ELEMENT)
+            continue;
+
+        if (top) {
+            gint rank = docbook_stream_title_rank (stream, top);
+            if (rank < top->title_rank) {
+                xmlChar *title = xmlTextReaderReadString (stream->reader);
+                g_free (top->title);
+                top->title = g_strdup ((const gchar *) title);
+                top->title_rank = rank;
+                xmlFree (title);
+            }
+            if (depth == top->depth + 1 && docbook_stream_titleQ (name)) {
+                xmlNodePtr info = xmlTextReaderExpand (stream->reader);
+                if (info == NULL)
+                    break;
+                xmlAddChild (top->node, xmlDocCopyNode (info, priv->stream_outline, 1));
+            }
+        }
+
+        id = docbook_stream_get_id (stream, &generated);
+
+        if (depth == 0) {
+            if (pi_max)
+                stream->max_depth = pi_max;
+            else if (!xmlStrcmp (name, BAD_CAST "book"))
+                stream->max_depth = 2;
+            else
+                stream->max_depth = 1;
+            priv->root_id = g_strdup (id);
+            yelp_document_batch_set_page_id (priv->batch, NULL, id);
+            yelp_document_batch_set_page_id (priv->batch, "//index", id);
+        }
+
+        if (id && depth <= stream->max_depth && docbook_name_divisionQ (name)) {
+            if (prev_id) {
+                yelp_document_batch_set_prev_id (priv->batch, id, prev_id);
+                yelp_document_batch_set_next_id (priv->batch, prev_id, id);
+                g_free (prev_id);
+            }
+            prev_id = g_strdup (id);
+
+            node = xmlDocCopyNode (xmlTextReaderCurrentNode (stream->reader),
+                                   priv->stream_outline, 2);
+            if (generated)
+                docbook_stream_set_id (node, id);
+            if (top) {
+                yelp_document_batch_set_up_id (priv->batch, id, top->id);
+                xmlAddChild (top->node, node);
+            }
+            else
+                xmlDocSetRootElement (priv->stream_outline, node);
+            g_hash_table_replace (priv->stream_nodes, g_strdup (id), node);
+            g_hash_table_add (priv->stream_pending, g_strdup (id));
+            top = docbook_stream_push (stream, id);
+            top->node = node;
+        }
+
+        if (id) {
+            yelp_document_batch_set_root_id (priv->batch, id, priv->root_id);
+            yelp_document_batch_set_page_id (priv->batch, id,
+                                             top ? top->id : priv->root_id);
+        }
+        g_free (id);
+
+        if (top && top->depth == depth && xmlTextReaderIsEmptyElement (stream->reader))
+            docbook_stream_walk_pop (docbook, stream);
+    }
+
+    g_free (prev_id);
+    return ret == 0;
+}
+
+/* Copies a page from the outline with its titles, and with its subpages
+ * too if subpages is set.
+ */
+static xmlNodePtr
+docbook_stream_stub (xmlNodePtr  node,
+                     xmlDocPtr   doc,
+                     gboolean    subpages)
+{
+    xmlNodePtr copy, child;
+
+    copy = xmlDocCopyNode (node, doc, 2);
+    for (child = node->children; child; child = child->next) {
+        if (child->type != XML_ELEMENT_NODE)
+            continue;
+        if (!docbook_name_divisionQ (child->name))
+            xmlAddChild (copy, xmlDocCopyNode (child, doc, 1));
+        else if (subpages)
+            xmlAddChild (copy, docbook_stream_stub (child, doc, TRUE));
+    }
+    return copy;
+}
+
+/* Copies the stubs around a page of the outline into doc: its ancestors,
+ * the pages right before and after it, and the pages after each ancestor.
+ * That is all the transform needs to work out chunk IDs and the links to
+ * the pages around this one. Returns a bare copy of the page itself.
+ */
+static xmlNodePtr
+docbook_stream_context (xmlNodePtr  node,
+                        xmlDocPtr   doc,
+                        gboolean    page)
+{
+    xmlNodePtr copy, parent, sib;
+
+    copy = page ? xmlDocCopyNode (node, doc, 2) : docbook_stream_stub (node, doc, FALSE);
+
+    if (node->parent == NULL || node->parent->type != XML_ELEMENT_NODE) {
+        xmlDocSetRootElement (doc, copy);
+        return copy;
+    }
+
+    parent = docbook_stream_context (node->parent, doc, FALSE);
+    if (page) {
+        for (sib = node->prev; sib; sib = sib->prev)
+            if (sib->type == XML_ELEMENT_NODE && docbook_name_divisionQ (sib->name))
+                break;
+        if (sib)
+            xmlAddChild (parent, docbook_stream_stub (sib, doc, TRUE));
+    }
+    xmlAddChild (parent, copy);
+    for (sib = node->next; sib; sib = sib->next)
+        if (sib->type == XML_ELEMENT_NODE)
+            break;
+    if (sib)
+        xmlAddChild (parent, docbook_stream_stub (sib, doc, FALSE));
+
+    return copy;
+}
+
+static void
+docbook_stream_page_free (DocbookStreamPage *page)
+{
+    g_free (page->id);
+    docbook_tree_unref (page->tree);
+    g_free (page);
+}
+
+/* Hands the page in frame over to docbook_stream_next, waiting while the
+ * transform is too far behind.
+ */
+static void
+docbook_stream_give (YelpDocbookDocument *docbook,
+                     DocbookStreamFrame  *frame)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    DocbookStreamPage *page;
+
+    page = g_new0 (DocbookStreamPage, 1);
+    page->id = g_strdup (frame->id);
+    page->tree = docbook_tree_new (frame->doc);
+    frame->doc = NULL;
+    frame->node = NULL;
+
+    g_mutex_lock (&priv->mutex);
+    while (g_queue_get_length (priv->stream_queue) >= STREAM_QUEUE_MAX &&
+           priv->state != DOCBOOK_STATE_STOP)
+        g_cond_wait (&priv->stream_cond, &priv->mutex);
+    g_queue_push_tail (priv->stream_queue, page);
+    g_mutex_unlock (&priv->mutex);
+
+    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                     (GSourceFunc) docbook_stream_next,
+                     g_object_ref (docbook),
+                     g_object_unref);
+}
+
+static void
+docbook_stream_extract_pop (YelpDocbookDocument *docbook,
+                            DocbookStream       *stream)
+{
+    DocbookStreamFrame *top = docbook_stream_top (stream);
+
+    if (top->doc)
+        docbook_stream_give (docbook, top);
+    docbook_stream_pop (stream);
+}
+
+/* Reads the file once, building a small tree for every page as it goes.
+ * Each tree holds the page's own content, stubs for the pages under it,
+ * and the stubs docbook_stream_context adds from the outline. A page is
+ * handed over as soon as its subpages start, so pages come out in
+ * document order and only a few trees are ever around at once.
+ */
+static gboolean
+docbook_stream_extract (YelpDocbookDocument *docbook,
+                        DocbookStream       *stream)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    xmlTextReaderPtr reader = stream->reader;
+    gint ret;
+
+    ret = xmlTextReaderRead (reader);
+    while (ret == 1 && priv->state != DOCBOOK_STATE_STOP) {
+        DocbookStreamFrame *top = docbook_stream_top (stream);
+        gint type = xmlTextReaderNodeType (reader);
+        gint depth = xmlTextReaderDepth (reader);
+        const xmlChar *name = xmlTextReaderConstLocalName (reader);
+
+        if (type == XML_READER_TYPE_END_ELEMENT) {
+            if (top && top->depth == depth)
+                docbook_stream_extract_pop (docbook, stream);
+        }
+        else if (type == XML_READER_TYPE_ELEMENT &&
+                 depth <= stream->max_depth && docbook_name_divisionQ (name)) {
+            DocbookStreamFrame *frame;
+            xmlNodePtr node, stub;
+            gchar *id;
+
+            id = docbook_stream_get_id (stream, NULL);
+            node = g_hash_table_lookup (priv->stream_nodes, id);
+            if (node == NULL) {
+                /* The file changed since docbook_stream_walk */
+                g_free (id);
+                return FALSE;
+            }
+
+            /* Subpages come after everything else in a page */
+            if (top && top->doc) {
+                for (stub = node; stub; stub = stub->next)
+                    if (stub->type == XML_ELEMENT_NODE)
+                        xmlAddChild (top->node, docbook_stream_stub (stub, top->doc, TRUE));
+                docbook_stream_give (docbook, top);
+            }
+
+            frame = docbook_stream_push (stream, id);
+            frame->doc = xmlNewDoc (BAD_CAST "1.0");
+            frame->node = docbook_stream_context (node, frame->doc, TRUE);
+            g_free (id);
+
+            if (xmlTextReaderIsEmptyElement (reader))
+                docbook_stream_extract_pop (docbook, stream);
+        }
+        else if (type == XML_READER_TYPE_ELEMENT) {
+            if (top && top->doc && depth == top->depth + 1) {
+                xmlNodePtr node = xmlTextReaderExpand (reader);
+                if (node == NULL)
+                    return FALSE;
+                node = xmlDocCopyNode (node, top->doc, 1);
+                docbook_stream_fix_ids (stream, node);
+                xmlAddChild (top->node, node);
+                ret = xmlTextReaderNext (reader);
+                continue;
+            }
+            if (docbook_name_divisionQ (name))
+                stream->divisions++;
+            if (top && !docbook_stream_skip (stream))
+                return FALSE;
+        }
+        else if (top && top->doc && depth == top->depth + 1 &&
+                 (type == XML_READER_TYPE_TEXT       ||
+                  type == XML_READER_TYPE_CDATA      ||
+                  type == XML_READER_TYPE_WHITESPACE ||
+                  type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE)) {
+            xmlAddChild (top->node, xmlDocCopyNode (xmlTextReaderCurrentNode (reader),
+                                                    top->doc, 1));
+        }
+
+        ret = xmlTextReaderRead (reader);
+    }
+
+    return ret == 0;
+}
+
+static void
+docbook_stream_not_found (YelpDocbookDocument *docbook,
+                          const gchar         *page_id)
+{
+    YelpDocument *document = YELP_DOCUMENT (docbook);
+    gchar *docuri;
+    GError *error;
+
+    docuri = yelp_uri_get_document_uri (yelp_document_get_uri (document));
+    error = g_error_new (YELP_ERROR, YELP_ERROR_NOT_FOUND,
+                         _("The page ‘%s’ was not found in the document ‘%s’."),
+                         page_id, docuri);
+    g_free (docuri);
+    yelp_document_signal (document, page_id,
+                          YELP_DOCUMENT_SIGNAL_ERROR,
+                          error);
+    g_error_free (error);
+}
+
+static void
+docbook_stream_run (YelpDocbookDocument *docbook)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    DocbookStream *stream;
+
+    debug_print (DB_FUNCTION, "entering\n");
+
+    stream = docbook_stream_new (priv->stream_file, priv->max_depth);
+    if (stream != NULL) {
+        docbook_stream_extract (docbook, stream);
+        docbook_stream_free (stream);
+    }
+
+    g_mutex_lock (&priv->mutex);
+    priv->stream_done = TRUE;
+    g_mutex_unlock (&priv->mutex);
+
+    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                     (GSourceFunc) docbook_stream_next,
+                     g_object_ref (docbook),
+                     g_object_unref);
+    g_object_unref (docbook);
+}
+
+/* Called with priv->mutex held. Returns whether the page is yet to come out
+ * of the transform.
+ */
+static gboolean
+docbook_stream_request (YelpDocbookDocument *docbook,
+                        const gchar         *page_id)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    gchar *real;
+    gboolean ret;
+
+    /* The about page comes out of the transform with the root page */
+    if (g_str_equal (page_id, "//about"))
+        real = g_strdup (priv->root_id);
+    else
+        real = yelp_document_get_page_id (YELP_DOCUMENT (docbook), page_id);
+    if (real == NULL)
+        return FALSE;
+
+    ret = g_hash_table_contains (priv->stream_pending, real);
+    g_free (real);
+    return ret;
+}
+
+/* Runs in the main thread. Starts the transform on the next page the reader
+ * handed over, or fails the requests nothing is left to answer.
+ */
+static gboolean
+docbook_stream_next (YelpDocbookDocument *docbook)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    DocbookStreamPage *page;
+    gchar **params, **requests;
+    gint params_i = 0;
+    gint i;
+
+    g_mutex_lock (&priv->mutex);
+    if (priv->transform_running || !priv->stream_running) {
+        g_mutex_unlock (&priv->mutex);
+        return FALSE;
+    }
+
+    if (priv->stream_page) {
+        g_hash_table_remove (priv->stream_pending, priv->stream_page);
+        g_free (priv->stream_page);
+        priv->stream_page = NULL;
+    }
+
+    page = g_queue_pop_head (priv->stream_queue);
+    g_cond_signal (&priv->stream_cond);
+    if (page == NULL) {
+        if (priv->stream_done) {
+            priv->stream_running = FALSE;
+            requests = yelp_document_get_requests (YELP_DOCUMENT (docbook));
+            for (i = 0; requests[i]; i++) {
+                if (docbook_stream_request (docbook, requests[i]))
+                    docbook_stream_not_found (docbook, requests[i]);
+            }
+            g_strfreev (requests);
+        }
+        g_mutex_unlock (&priv->mutex);
+        return FALSE;
+    }
+
+    priv->stream_page = page->id;
+    priv->stream_found = FALSE;
+    priv->transform = yelp_transform_new (STYLESHEET);
+    g_object_weak_ref ((GObject *) priv->transform,
+                       (GWeakNotify) transform_finalized,
+                       page->tree);
+    priv->chunk_ready =
+        g_signal_connect (priv->transform, "chunk-ready",
+                          (GCallback) transform_chunk_ready,
+                          docbook);
+    priv->finished =
+        g_signal_connect (priv->transform, "finished",
+                          (GCallback) transform_finished,
+                          docbook);
+    priv->error =
+        g_signal_connect (priv->transform, "error",
+                          (GCallback) transform_error,
+                          docbook);
+
+    params = yelp_settings_get_all_params (yelp_settings_get_default (), 2, &params_i);
+    params[params_i++] = g_strdup ("db.chunk.max_depth");
+    params[params_i++] = g_strdup_printf ("%i", priv->max_depth);
+    params[params_i] = NULL;
+
+    priv->transform_running = TRUE;
+    yelp_transform_start (priv->transform,
+                          page->tree->doc,
+                          NULL,
+                          (const gchar * const *) params);
+    g_strfreev (params);
+    g_free (page);
+    g_mutex_unlock (&priv->mutex);
+
+    return FALSE;
+}
+
+static gboolean
+docbook_stream_process (YelpDocbookDocument *docbook,
+                        const gchar         *filepath)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+    YelpDocument *document = YELP_DOCUMENT (docbook);
+    DocbookStream *stream;
+    gchar **requests;
+    gboolean walked = FALSE;
+    GError *error;
+    gint i;
+
+    debug_print (DB_FUNCTION, "entering\n");
+
+    g_mutex_lock (&priv->mutex);
+    g_free (priv->root_id);
+    priv->root_id = NULL;
+    g_hash_table_remove_all (priv->stream_nodes);
+    g_hash_table_remove_all (priv->stream_pending);
+    if (priv->stream_outline)
+        xmlFreeDoc (priv->stream_outline);
+    priv->stream_outline = xmlNewDoc (BAD_CAST "1.0");
+    priv->batch = yelp_document_batch_new ();
+    g_mutex_unlock (&priv->mutex);
+
+    stream = docbook_stream_new (filepath, 1);
+    if (stream != NULL) {
+        walked = docbook_stream_walk (docbook, stream);
+        priv->max_depth = stream->max_depth;
+        docbook_stream_free (stream);
+    }
+
+    if (!walked || priv->root_id == NULL) {
+        error = g_error_new (YELP_ERROR, YELP_ERROR_PROCESSING,
+                             _("The file ‘%s’ could not be parsed because it is"
+                               " not a well-formed XML document."),
+                             filepath);
+        yelp_document_error_pending (document, error);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    yelp_document_commit_batch (document, priv->batch);
+    priv->batch = NULL;
+
+    g_mutex_lock (&priv->mutex);
+    g_free (priv->stream_file);
+    priv->stream_file = g_strdup (filepath);
+    priv->streaming = TRUE;
+    priv->state = DOCBOOK_STATE_PARSED;
+
+    if (priv->index_pending) {
+        priv->index_pending = FALSE;
+        docbook_index_start (docbook, NULL);
+    }
+
+    requests = yelp_document_get_requests (document);
+    for (i = 0; requests[i]; i++) {
+        if (!docbook_stream_request (docbook, requests[i]))
+            docbook_stream_not_found (docbook, requests[i]);
+    }
+    g_strfreev (requests);
+
+    /* Transform the whole book now, one page at a time */
+    priv->stream_running = TRUE;
+    priv->stream_done = FALSE;
+    g_object_ref (docbook);
+    priv->thread = g_thread_new ("docbook-stream",
+                                 (GThreadFunc) docbook_stream_run,
+                                 docbook);
+    g_mutex_unlock (&priv->mutex);
+
+    return TRUE;
+}
+
+/******************************************************************************/
+
 static void
 transform_chunk_ready (YelpTransform       *transform,
                        gchar               *chunk_id,
@@ -810,6 +1733,21 @@ transform_chunk_ready (YelpTransform       *transform,
     }
 
     content = yelp_transform_take_chunk (transform, chunk_id);
+
+    /* Stubs for the pages around the one we extracted come out as
+     * chunks too, but they only hold titles. Don't cache those. The
+     * about page is the only other real chunk, and comes with the root.
+     */
+    if (priv->streaming) {
+        if (g_strcmp0 (chunk_id, priv->stream_page) == 0)
+            priv->stream_found = TRUE;
+        else if (!(g_str_equal (chunk_id, "//about") &&
+                   g_strcmp0 (priv->stream_page, priv->root_id) == 0)) {
+            g_free (content);
+            return;
+        }
+    }
+
     yelp_document_give_contents (YELP_DOCUMENT (docbook),
                                  chunk_id,
                                  content,
@@ -840,13 +1778,12 @@ transform_finished (YelpTransform       *transform,
 
     docbook_disconnect (docbook);
 
-    /* We want to free priv->xmldoc, but we can't free it before transform
-       is finalized.   Otherwise, we could crash when YelpTransform frees
-       its libxslt resources.
-     */
-    g_object_weak_ref ((GObject *) transform,
-                       (GWeakNotify) transform_finalized,
-                       docbook);
+    if (priv->streaming) {
+        if (!priv->stream_found)
+            docbook_stream_not_found (docbook, priv->stream_page);
+        docbook_stream_next (docbook);
+        return;
+    }
 
     docuri = yelp_uri_get_document_uri (yelp_document_get_uri (document));
     error = g_error_new (YELP_ERROR, YELP_ERROR_NOT_FOUND,
@@ -873,23 +1810,53 @@ transform_error (YelpTransform       *transform,
     }
 
     error = yelp_transform_get_error (transform);
-    yelp_document_error_pending ((YelpDocument *) docbook, error);
+    if (priv->streaming)
+        yelp_document_signal ((YelpDocument *) docbook, priv->stream_page,
+                              YELP_DOCUMENT_SIGNAL_ERROR, error);
+    else
+        yelp_document_error_pending ((YelpDocument *) docbook, error);
     g_error_free (error);
 
     docbook_disconnect (docbook);
+
+    if (priv->streaming)
+        docbook_stream_next (docbook);
 }
 
 static void
-transform_finalized (YelpDocbookDocument *docbook,
-                     gpointer             transform)
+transform_finalized (DocbookTree *tree,
+                     gpointer     transform)
 {
-    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
-
     debug_print (DB_FUNCTION, "entering\n");
 
-    if (priv->xmldoc)
-	xmlFreeDoc (priv->xmldoc);
-    priv->xmldoc = NULL;
+    docbook_tree_unref (tree);
+}
+
+/******************************************************************************/
+
+static DocbookTree *
+docbook_tree_new (xmlDocPtr doc)
+{
+    DocbookTree *tree = g_new0 (DocbookTree, 1);
+    tree->doc = doc;
+    tree->ref_count = 1;
+    return tree;
+}
+
+static DocbookTree *
+docbook_tree_ref (DocbookTree *tree)
+{
+    g_atomic_int_inc (&tree->ref_count);
+    return tree;
+}
+
+static void
+docbook_tree_unref (DocbookTree *tree)
+{
+    if (g_atomic_int_dec_and_test (&tree->ref_count)) {
+        xmlFreeDoc (tree->doc);
+        g_free (tree);
+    }
 }
 
 /******************************************************************************/
@@ -904,7 +1871,7 @@ docbook_index_done (YelpDocbookDocument *docbook)
 
 typedef struct {
     YelpDocbookDocument *docbook;
-    xmlDocPtr doc;
+    DocbookTree *tree;
     xmlNodePtr cur;
     gchar *doc_uri;
     GString *str;
@@ -938,107 +1905,195 @@ docbook_index_node (DocbookIndexData *index)
     }
 }
 
+static void
+docbook_index_page (DocbookIndexData *index,
+                    const gchar      *id,
+                    const gchar      *title,
+                    const gchar      *body,
+                    gboolean          root)
+{
+    YelpUri *uri;
+    gchar *full_uri, *tmp;
+
+    tmp = g_strconcat ("xref:", id, NULL);
+    uri = yelp_uri_new_relative (yelp_document_get_uri (YELP_DOCUMENT (index->docbook)), tmp);
+    g_free (tmp);
+    yelp_uri_resolve_sync (uri);
+    full_uri = yelp_uri_get_canonical_uri (uri);
+    g_object_unref (uri);
+
+    yelp_storage_update (yelp_storage_get_default (),
+                         index->doc_uri, full_uri,
+                         title, "", "yelp-page-symbolic",
+                         body);
+    if (root)
+        yelp_storage_set_root_title (yelp_storage_get_default (),
+                                     index->doc_uri, title);
+    g_free (full_uri);
+}
+
 static void
 docbook_index_chunk (DocbookIndexData *index)
 {
     xmlChar *id;
-    xmlNodePtr child;
+    xmlNodePtr child, oldcur;
     gchar *title = NULL;
-    GSList *chunks = NULL;
+    gchar *body;
+    YelpDocument *document = YELP_DOCUMENT (index->docbook);
 
+    oldcur = index->cur;
     id = xmlGetProp (index->cur, BAD_CAST "id");
     if (id != NULL) {
-        title = docbook_walk_get_title (index->docbook, index->cur);
-        if (index->cur->parent->parent == NULL)
-            yelp_storage_set_root_title (yelp_storage_get_default (),
-                                         index->doc_uri, title);
+        /* docbook_walk already worked out titles for the pages it found */
+        title = yelp_document_get_page_title (document, (const gchar *) id);
+        if (title == NULL)
+            title = docbook_walk_get_title (index->docbook, index->cur);
         index->str = g_string_new ("");
-    }
 
-    for (child = index->cur->children; child; child = child->next) {
-        if (docbook_walk_chunkQ (index->docbook, child, index->depth, index->max_depth)) {
-            chunks = g_slist_append (chunks, child);
-        }
-        else if (id != NULL) {
-            xmlNodePtr oldcur = index->cur;
-            index->cur = child;
-            docbook_index_node (index);
-            index->cur = oldcur;
+        for (child = oldcur->children; child; child = child->next) {
+            if (!docbook_walk_chunkQ (index->docbook, child, index->depth, index->max_depth)) {
+                index->cur = child;
+                docbook_index_node (index);
+                index->cur = oldcur;
+            }
         }
-    }
-
-    if (id != NULL) {
-        YelpDocument *document = YELP_DOCUMENT (index->docbook);
-        YelpUri *uri;
-        gchar *full_uri, *tmp, *body;
 
         body = g_string_free (index->str, FALSE);
         index->str = NULL;
 
-        tmp = g_strconcat ("xref:", id, NULL);
-        uri = yelp_uri_new_relative (yelp_document_get_uri (document), tmp);
-        g_free (tmp);
-        yelp_uri_resolve_sync (uri);
-        full_uri = yelp_uri_get_canonical_uri (uri);
-        g_object_unref (uri);
-
-        yelp_storage_update (yelp_storage_get_default (),
-                             index->doc_uri, full_uri,
-                             title, "", "yelp-page-symbolic",
-                             body);
-        if (index->cur->parent->parent == NULL)
-            yelp_storage_set_root_title (yelp_storage_get_default (),
-                                         index->doc_uri, title);
-        g_free (full_uri);
+        docbook_index_page (index, (const gchar *) id, title, body,
+                            index->cur->parent->parent == NULL);
         g_free (body);
         g_free (title);
         xmlFree (id);
     }
 
-    index->depth++;
-    while (chunks != NULL) {
-        xmlNodePtr oldcur = index->cur;
-        index->cur = (xmlNodePtr) chunks->data;
-        docbook_index_chunk(index);
-        index->cur = oldcur;
-        chunks = g_slist_delete_link (chunks, chunks);
+    for (child = oldcur->children; child; child = child->next) {
+        if (docbook_walk_chunkQ (index->docbook, child, index->depth, index->max_depth)) {
+            index->cur = child;
+            index->depth++;
+            docbook_index_chunk (index);
+            index->depth--;
+            index->cur = oldcur;
+        }
     }
-    index->depth--;
 }
 
 static void
-docbook_index_threaded (YelpDocbookDocument *docbook)
+docbook_index_stream_pop (DocbookIndexData *index,
+                          DocbookStream    *stream)
+{
+    DocbookStreamFrame *top = docbook_stream_top (stream);
+    gchar *title;
+
+    title = yelp_document_get_page_title (YELP_DOCUMENT (index->docbook), top->id);
+    docbook_index_page (index, top->id, title ? title : _("Unknown"),
+                        top->str->str, top->depth == 0);
+    g_free (title);
+    docbook_stream_pop (stream);
+}
+
+/* Indexes a document too big to parse, one page's text at a time */
+static void
+docbook_index_stream (DocbookIndexData *index)
+{
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (index->docbook);
+    DocbookStream *stream;
+
+    stream = docbook_stream_new (priv->stream_file, priv->max_depth);
+    if (stream == NULL)
+        return;
+
+    while (docbook_stream_read (stream) == 1) {
+        DocbookStreamFrame *top = docbook_stream_top (stream);
+        gint type = xmlTextReaderNodeType (stream->reader);
+        gint depth = xmlTextReaderDepth (stream->reader);
+        const xmlChar *name = xmlTextReaderConstLocalName (stream->reader);
+        gchar *id;
+
+        if (type == XML_READER_TYPE_END_ELEMENT) {
+            if (top && top->depth == depth)
+                docbook_index_stream_pop (index, stream);
+            continue;
+        }
+        if (type == XML_READER_TYPE_TEXT       ||
+            type == XML_READER_TYPE_CDATA      ||
+            type == XML_READER_TYPE_WHITESPACE ||
+            type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE) {
+            if (top)
+                g_string_append (top->str,
+                                 (const gchar *) xmlTextReaderConstValue (stream->reader));
+            continue;
+        }
+        if (type != XML_READER_TYPE_ELEMENT)
+            continue;
+
+        if (top && depth > 0) {
+            const xmlChar *parent = g_ptr_array_index (stream->names, depth - 1);
+            if (!xmlStrcmp (parent, BAD_CAST "menuchoice") ||
+                !xmlStrcmp (parent, BAD_CAST "keycombo"))
+                g_string_append_c (top->str, ' ');
+        }
+        if (g_str_has_suffix ((const gchar *) name, "info") ||
+            !xmlStrcmp (name, BAD_CAST "remark")) {
+            if (!docbook_stream_skip (stream))
+                break;
+            continue;
+        }
+
+        id = docbook_stream_get_id (stream, NULL);
+        if (id && depth <= stream->max_depth && docbook_name_divisionQ (name)) {
+            top = docbook_stream_push (stream, id);
+            top->str = g_string_new ("");
+        }
+        g_free (id);
+
+        if (top && top->depth == depth && xmlTextReaderIsEmptyElement (stream->reader))
+            docbook_index_stream_pop (index, stream);
+    }
+
+    docbook_stream_free (stream);
+}
+
+static void
+docbook_index_threaded (DocbookIndexData *index)
 {
-    DocbookIndexData *index = NULL;
     xmlParserCtxtPtr parserCtxt = NULL;
     GFile *file = NULL;
     gchar *filename = NULL;
-    YelpUri *uri;
+    xmlDocPtr xmldoc;
+    YelpDocbookDocument *docbook = index->docbook;
     YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
 
-    uri = yelp_document_get_uri (YELP_DOCUMENT (docbook));
-    file = yelp_uri_get_file (uri);
-    if (file == NULL)
+    yelp_storage_begin_batch (yelp_storage_get_default (), index->doc_uri);
+
+    if (index->tree == NULL && priv->streaming) {
+        docbook_index_stream (index);
         goto done;
-    filename = g_file_get_path (file);
+    }
 
-    index = g_new0 (DocbookIndexData, 1);
-    index->docbook = docbook;
-    index->doc_uri = yelp_uri_get_document_uri (uri);
+    if (index->tree == NULL) {
+        /* Nobody has parsed the document for us, so do it ourselves */
+        file = yelp_uri_get_file (yelp_document_get_uri (YELP_DOCUMENT (docbook)));
+        if (file == NULL)
+            goto done;
+        filename = g_file_get_path (file);
 
-    parserCtxt = xmlNewParserCtxt ();
-    index->doc = xmlCtxtReadFile (parserCtxt, filename, NULL,
+        parserCtxt = xmlNewParserCtxt ();
+        xmldoc = xmlCtxtReadFile (parserCtxt, filename, NULL,
                                   XML_PARSE_DTDLOAD | XML_PARSE_NOCDATA |
                                   XML_PARSE_NOENT   | XML_PARSE_NONET   );
-    if (index->doc == NULL)
-        goto done;
-    if (xmlXIncludeProcessFlags (index->doc,
-                                 XML_PARSE_DTDLOAD | XML_PARSE_NOCDATA |
-                                 XML_PARSE_NOENT   | XML_PARSE_NONET   )
-        < 0)
-        goto done;
+        if (xmldoc == NULL)
+            goto done;
+        index->tree = docbook_tree_new (xmldoc);
+        if (xmlXIncludeProcessFlags (xmldoc,
+                                     XML_PARSE_DTDLOAD | XML_PARSE_NOCDATA |
+                                     XML_PARSE_NOENT   | XML_PARSE_NONET   )
+            < 0)
+            goto done;
+    }
 
-    index->cur = xmlDocGetRootElement (index->doc);
+    index->cur = xmlDocGetRootElement (index->tree->doc);
     index->depth = 0;
     if (!xmlStrcmp (index->cur->name, BAD_CAST "book"))
         index->max_depth = 2;
@@ -1047,23 +2102,39 @@ docbook_index_threaded (YelpDocbookDocument *docbook)
     docbook_index_chunk (index);
 
  done:
+    yelp_storage_commit_batch (yelp_storage_get_default (), index->doc_uri);
     if (file != NULL)
         g_object_unref (file);
-    if (filename != NULL)
-        g_free (filename);
-    if (index->doc != NULL)
-        xmlFreeDoc (index->doc);
-    if (index->doc_uri != NULL)
-        g_free (index->doc_uri);
-    if (index != NULL)
-        g_free (index);
+    g_free (filename);
     if (parserCtxt != NULL)
         xmlFreeParserCtxt (parserCtxt);
+    if (index->tree != NULL)
+        docbook_tree_unref (index->tree);
+    g_free (index->doc_uri);
+    g_free (index);
 
     priv->index_running = FALSE;
     g_idle_add ((GSourceFunc) docbook_index_done, docbook);
 }
 
+/* Called with priv->mutex held. Takes ownership of the tree reference. */
+static void
+docbook_index_start (YelpDocbookDocument *docbook,
+                     DocbookTree         *tree)
+{
+    DocbookIndexData *index;
+    YelpDocbookDocumentPrivate *priv = GET_PRIV (docbook);
+
+    index = g_new0 (DocbookIndexData, 1);
+    index->docbook = docbook;
+    index->tree = tree;
+    index->doc_uri = yelp_uri_get_document_uri (yelp_document_get_uri (YELP_DOCUMENT (docbook)));
+
+    priv->index = g_thread_new ("docbook-index",
+                                (GThreadFunc) docbook_index_threaded,
+                                index);
+}
+
 static void
 docbook_index (YelpDocument *document)
 {
@@ -1075,9 +2146,19 @@ docbook_index (YelpDocument *document)
         return;
 
     priv = GET_PRIV (document);
+    g_mutex_lock (&priv->mutex);
+    if (priv->index_running) {
+        g_mutex_unlock (&priv->mutex);
+        return;
+    }
+
     g_object_ref (document);
-    priv->index = g_thread_new ("docbook-index",
-                                (GThreadFunc) docbook_index_threaded,
-                                document);
     priv->index_running = TRUE;
+    if (priv->state == DOCBOOK_STATE_PARSING && priv->process_running)
+        /* docbook_process will start us once the tree is walked */
+        priv->index_pending = TRUE;
+    else
+        docbook_index_start (YELP_DOCBOOK_DOCUMENT (document),
+                             priv->tree ? docbook_tree_ref (priv->tree) : NULL);
+    g_mutex_unlock (&priv->mutex);
 }
@@ -44,6 +44,9 @@ enum {
     PROP_INDEXED
 };
 
+/* Number of results shown on each page of search results */
+#define SEARCH_PAGE_SIZE 20
+
 typedef struct _Request Request;
 struct _Request {
     YelpDocument         *document;
@@ -64,6 +67,29 @@ struct _Hash {
     GDestroyNotify  destroy;
 };
 
+typedef enum {
+    BATCH_PAGE_ID,
+    BATCH_ROOT_ID,
+    BATCH_PREV_ID,
+    BATCH_NEXT_ID,
+    BATCH_UP_ID,
+    BATCH_TITLE
+} BatchField;
+
+typedef struct _BatchEntry BatchEntry;
+struct _BatchEntry {
+    BatchField  field;
+    gchar      *key;
+    gchar      *value;
+};
+
+/* Page metadata collected by a document walker without touching the
+ * document, so it can all be published under one lock.
+ */
+struct _YelpDocumentBatch {
+    GArray *entries;
+};
+
 struct _YelpDocumentPriv {
     GMutex  mutex;
 
@@ -73,6 +99,8 @@ struct _YelpDocumentPriv {
 
     GSList *reqs_search;      /* Pending search requests, not in reqs_all */
     gboolean indexed;
+    gboolean index_checked;   /* Whether the stored index was looked at */
+    gint64   index_mtime;     /* Source mtime to record once indexed */
 
     YelpUri *uri;
     gchar   *doc_uri;
@@ -124,6 +152,13 @@ static void           document_finish_read      (YelpDocument         *document,
 static gchar *        document_get_mime_type    (YelpDocument         *document,
                                                  const gchar          *mime_type);
 static void           document_index            (YelpDocument         *document);
+static GVariant *     document_search           (YelpDocument         *document,
+                                                 const gchar          *text,
+                                                 gint                  offset,
+                                                 gint                  limit);
+static void           document_set_page_id      (YelpDocument         *document,
+                                                 const gchar          *id,
+                                                 const gchar          *page_id);
 
 static Hash *         hash_new                  (GDestroyNotify        destroy);
 static void           hash_free                 (Hash                 *hash);
@@ -273,6 +308,7 @@ yelp_document_class_init (YelpDocumentClass *klass)
     klass->finish_read =    document_finish_read;
     klass->get_mime_type =  document_get_mime_type;
     klass->index =          document_index;
+    klass->search =         document_search;
 
     g_object_class_install_property (object_class,
                                      PROP_INDEXED,
@@ -410,8 +446,15 @@ document_set_property (GObject      *object,
     switch (prop_id) {
     case PROP_INDEXED:
         document->priv->indexed = g_value_get_boolean (value);
-        if (document->priv->indexed)
+        if (document->priv->indexed) {
+            if (document->priv->index_mtime != 0) {
+                yelp_storage_set_mtime (yelp_storage_get_default (),
+                                        document->priv->doc_uri,
+                                        document->priv->index_mtime);
+                document->priv->index_mtime = 0;
+            }
             g_idle_add ((GSourceFunc) document_indexed, document);
+        }
         break;
     case PROP_URI:
         document->priv->uri = g_value_dup_object (value);
@@ -459,6 +502,41 @@ yelp_document_list_page_ids (YelpDocument *document)
     return ret;
 }
 
+/* Returns the ID, title, description and icon of every page as
+ * a(ssss), taking the lock once. A page with no title or description
+ * gets an empty string.
+ */
+GVariant *
+yelp_document_list_pages (YelpDocument *document)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    const gchar *id;
+
+    g_assert (document != NULL && YELP_IS_DOCUMENT (document));
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssss)"));
+
+    g_mutex_lock (&document->priv->mutex);
+    g_hash_table_iter_init (&iter, document->priv->core_ids);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL)) {
+        const gchar *real, *title = NULL, *desc = NULL, *icon = NULL;
+        real = hash_lookup (document->priv->page_ids, id);
+        if (real) {
+            title = hash_lookup (document->priv->titles, real);
+            desc = hash_lookup (document->priv->descs, real);
+            icon = hash_lookup (document->priv->icons, real);
+        }
+        g_variant_builder_add (&builder, "(ssss)", id,
+                               title ? title : "",
+                               desc ? desc : "",
+                               icon ? icon : "yelp-page-symbolic");
+    }
+    g_mutex_unlock (&document->priv->mutex);
+
+    return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 gchar *
 yelp_document_get_page_id (YelpDocument *document,
 			   const gchar  *id)
@@ -488,7 +566,16 @@ yelp_document_set_page_id (YelpDocument *document,
     g_assert (document != NULL && YELP_IS_DOCUMENT (document));
 
     g_mutex_lock (&document->priv->mutex);
+    document_set_page_id (document, id, page_id);
+    g_mutex_unlock (&document->priv->mutex);
+}
 
+/* Called with the document mutex held */
+static void
+document_set_page_id (YelpDocument *document,
+                      const gchar  *id,
+                      const gchar  *page_id)
+{
     hash_replace (document->priv->page_ids, id, g_strdup (page_id));
 
     if (id == NULL || !g_str_equal (id, page_id)) {
@@ -513,8 +600,6 @@ yelp_document_set_page_id (YelpDocument *document,
             g_hash_table_insert (document->priv->core_ids, ins, ins);
         }
     }
-
-    g_mutex_unlock (&document->priv->mutex);
 }
 
 gchar *
@@ -687,7 +772,7 @@ yelp_document_get_page_title (YelpDocument *document,
     g_assert (document != NULL && YELP_IS_DOCUMENT (document));
 
     if (page_id != NULL && g_str_has_prefix (page_id, "search=")) {
-        ret = g_uri_unescape_string (page_id + 7, NULL);
+        ret = document_parse_search (page_id, NULL);
         return ret;
     }
 
@@ -788,6 +873,159 @@ yelp_document_set_page_icon (YelpDocument *document,
     g_mutex_unlock (&document->priv->mutex);
 }
 
+/******************************************************************************/
+
+YelpDocumentBatch *
+yelp_document_batch_new (void)
+{
+    YelpDocumentBatch *batch = g_slice_new0 (YelpDocumentBatch);
+    batch->entries = g_array_new (FALSE, FALSE, sizeof (BatchEntry));
+    return batch;
+}
+
+void
+yelp_document_batch_free (YelpDocumentBatch *batch)
+{
+    guint i;
+
+    if (batch == NULL)
+        return;
+
+    for (i = 0; i < batch->entries->len; i++) {
+        BatchEntry *entry = &g_array_index (batch->entries, BatchEntry, i);
+        g_free (entry->key);
+        g_free (entry->value);
+    }
+    g_array_free (batch->entries, TRUE);
+    g_slice_free (YelpDocumentBatch, batch);
+}
+
+static void
+batch_add (YelpDocumentBatch *batch,
+           BatchField         field,
+           const gchar       *key,
+           const gchar       *value)
+{
+    BatchEntry entry;
+
+    g_return_if_fail (batch != NULL);
+
+    entry.field = field;
+    entry.key = g_strdup (key);
+    entry.value = g_strdup (value);
+    g_array_append_val (batch->entries, entry);
+}
+
+void
+yelp_document_batch_set_page_id (YelpDocumentBatch *batch,
+                                 const gchar       *id,
+                                 const gchar       *page_id)
+{
+    batch_add (batch, BATCH_PAGE_ID, id, page_id);
+}
+
+void
+yelp_document_batch_set_root_id (YelpDocumentBatch *batch,
+                                 const gchar       *page_id,
+                                 const gchar       *root_id)
+{
+    batch_add (batch, BATCH_ROOT_ID, page_id, root_id);
+}
+
+void
+yelp_document_batch_set_prev_id (YelpDocumentBatch *batch,
+                                 const gchar       *page_id,
+                                 const gchar       *prev_id)
+{
+    batch_add (batch, BATCH_PREV_ID, page_id, prev_id);
+}
+
+void
+yelp_document_batch_set_next_id (YelpDocumentBatch *batch,
+                                 const gchar       *page_id,
+                                 const gchar       *next_id)
+{
+    batch_add (batch, BATCH_NEXT_ID, page_id, next_id);
+}
+
+void
+yelp_document_batch_set_up_id (YelpDocumentBatch *batch,
+                               const gchar       *page_id,
+                               const gchar       *up_id)
+{
+    batch_add (batch, BATCH_UP_ID, page_id, up_id);
+}
+
+void
+yelp_document_batch_set_page_title (YelpDocumentBatch *batch,
+                                    const gchar       *page_id,
+                                    const gchar       *title)
+{
+    batch_add (batch, BATCH_TITLE, page_id, title);
+}
+
+/* Publishes everything in the batch under a single lock, then tells every
+ * request that now has a title about it at once. Takes ownership of the
+ * batch; the collected strings are moved into the document as they are.
+ */
+void
+yelp_document_commit_batch (YelpDocument      *document,
+                            YelpDocumentBatch *batch)
+{
+    GSList *cur;
+    guint i;
+
+    g_assert (document != NULL && YELP_IS_DOCUMENT (document));
+    g_return_if_fail (batch != NULL);
+
+    g_mutex_lock (&document->priv->mutex);
+
+    for (i = 0; i < batch->entries->len; i++) {
+        BatchEntry *entry = &g_array_index (batch->entries, BatchEntry, i);
+        Hash *hash = NULL;
+
+        switch (entry->field) {
+        case BATCH_PAGE_ID:
+            document_set_page_id (document, entry->key, entry->value);
+            break;
+        case BATCH_ROOT_ID:
+            hash = document->priv->root_ids;
+            break;
+        case BATCH_PREV_ID:
+            hash = document->priv->prev_ids;
+            break;
+        case BATCH_NEXT_ID:
+            hash = document->priv->next_ids;
+            break;
+        case BATCH_UP_ID:
+            hash = document->priv->up_ids;
+            break;
+        case BATCH_TITLE:
+            hash = document->priv->titles;
+            break;
+        default:
+            g_assert_not_reached ();
+        }
+
+        if (hash != NULL) {
+            hash_replace (hash, entry->key, entry->value);
+            entry->value = NULL;
+        }
+    }
+
+    for (cur = document->priv->reqs_all; cur != NULL; cur = cur->next) {
+        Request *request = (Request *) cur->data;
+        if (hash_lookup (document->priv->titles, request->page_id)) {
+            request->idle_funcs++;
+            g_idle_add ((GSourceFunc) request_idle_info, request);
+        }
+    }
+
+    g_mutex_unlock (&document->priv->mutex);
+
+    yelp_document_batch_free (batch);
+}
+
 static gboolean
 document_indexed (YelpDocument *document)
 {
@@ -945,6 +1183,102 @@ yelp_document_read_contents (YelpDocument *document,
     return YELP_DOCUMENT_GET_CLASS (document)->read_contents (document, page_id);
 }
 
+/* Search page IDs look like search=TEXT, followed by &offset=N for later
+ * pages of results. TEXT is URI-escaped, so it never holds a literal &.
+ */
+static gchar *
+document_parse_search (const gchar *page_id,
+                       gint        *offset)
+{
+    const gchar *text = page_id + 7;
+    const gchar *amp = strchr (text, '&');
+    gchar *tmp, *ret;
+
+    if (offset)
+        *offset = 0;
+    if (amp == NULL)
+        return g_uri_unescape_string (text, NULL);
+
+    if (offset && g_str_has_prefix (amp, "&offset="))
+        *offset = MAX (g_ascii_strtoll (amp + 8, NULL, 10), 0);
+    tmp = g_strndup (text, amp - text);
+    ret = g_uri_unescape_string (tmp, NULL);
+    g_free (tmp);
+    return ret;
+}
+
+/* Escapes a result snippet, marking up the terms it matched */
+static void
+document_append_snippet (GString     *ret,
+                         const gchar *snippet)
+{
+    const gchar *cur = snippet;
+    gboolean match = FALSE;
+
+    g_string_append (ret, "<div class='snippet'>");
+    while (*cur != '\0') {
+        const gchar *end = strpbrk (cur, YELP_STORAGE_MATCH_START YELP_STORAGE_MATCH_END);
+        gchar *tmp;
+
+        if (end == NULL)
+            end = cur + strlen (cur);
+        tmp = g_markup_escape_text (cur, end - cur);
+        g_string_append (ret, tmp);
+        g_free (tmp);
+
+        if (*end == YELP_STORAGE_MATCH_START[0] && !match) {
+            g_string_append (ret, "<span class='match'>");
+            match = TRUE;
+        }
+        else if (*end == YELP_STORAGE_MATCH_END[0] && match) {
+            g_string_append (ret, "</span>");
+            match = FALSE;
+        }
+        cur = *end != '\0' ? end + 1 : end;
+    }
+    if (match)
+        g_string_append (ret, "</span>");
+    g_string_append (ret, "</div>");
+}
+
+/* Appends up to max results from iter, an iterator over a(sssss) as returned
+ * by yelp_storage_search_range, and returns how many it appended.
+ */
+static gint
+document_append_results (YelpDocument *document,
+                         GString      *ret,
+                         GVariantIter *iter,
+                         gint          max)
+{
+    const gchar *url, *title, *desc, *icon, *snippet;
+    gint count = 0;
+
+    while (count < max &&
+           g_variant_iter_next (iter, "(&s&s&s&s&s)", &url, &title, &desc, &icon, &snippet)) {
+        gchar *xref_uri = NULL;
+        gchar *tmp;
+
+        count++;
+
+        if (g_str_has_prefix (url, document->priv->doc_uri))
+            xref_uri = g_strdup_printf ("xref:%s", url + strlen (document->priv->doc_uri) + 1);
+
+        tmp = g_markup_printf_escaped ("<div><a class='linkdiv' href='%s'><div class='linkdiv'>"
+                                       "<div class='title'>%s</div>"
+                                       "<div class='desc'>%s</div>",
+                                       xref_uri && xref_uri[0] != '\0' ? xref_uri : url,
+                                       title, desc);
+        g_string_append (ret, tmp);
+        if (snippet[0] != '\0')
+            document_append_snippet (ret, snippet);
+        g_string_append (ret, "</div></a></div>");
+        g_free (xref_uri);
+        g_free (tmp);
+    }
+
+    return count;
+}
+
 static const gchar *
 document_read_contents (YelpDocument *document,
 			const gchar  *page_id)
@@ -957,10 +1291,10 @@ document_read_contents (YelpDocument *document,
 
     if (page_id != NULL && g_str_has_prefix (page_id, "search=")) {
         gchar *tmp, *tmp2, *txt;
-        GVariant *value;
-        GVariantIter *iter;
-        gchar *url, *title, *desc, *icon; /* do not free */
+        GVariant *value, *pages;
+        GVariantIter *iter, groups;
         gchar *index_title;
+        gint offset, count = 0, n_results = 0;
         GString *ret = g_string_new ("<html xmlns=\"http://www.w3.org/1999/xhtml\"><head><style type='text/css'>");
 
         colors = yelp_settings_get_colors (yelp_settings_get_default ());
@@ -988,6 +1322,11 @@ document_read_contents (YelpDocument *document,
                                 " background: -webkit-gradient(linear, left top, left 80, from(%s), to(%s)); } "
                                 "div.title { margin-bottom: 0.2em; font-weight: bold; } "
                                 "div.desc { margin: 0; color: %s; } "
+                                "div.snippet { margin: 0.2em 0 0 0; font-size: 0.9em; } "
+                                "span.match { font-weight: bold; } "
+                                "h2 { margin: 1em 0 0 0; padding: 0; font-size: 1.2em; } "
+                                "div.pages { margin-top: 1em; } "
+                                "div.pages a { margin-right: 1em; } "
                                 "</style></head><body><div class='header'>",
                                 colors[YELP_SETTINGS_COLOR_BASE],
                                 colors[YELP_SETTINGS_COLOR_TEXT],
@@ -1026,18 +1365,23 @@ document_read_contents (YelpDocument *document,
             return (const gchar *) str;
         }
 
-        txt = g_uri_unescape_string (page_id + 7, NULL);
+        txt = document_parse_search (page_id, &offset);
         tmp2 = g_strdup_printf (_("Search results for “%s”"), txt);
         tmp = g_markup_printf_escaped ("<h1>%s</h1>", tmp2);
         g_string_append (ret, tmp);
         g_free (tmp2);
         g_free (tmp);
 
-        value = yelp_storage_search (yelp_storage_get_default (),
-                                     document->priv->doc_uri,
-                                     txt);
-        iter = g_variant_iter_new (value);
-        if (g_variant_iter_n_children (iter) == 0) {
+        /* Ask for one more than we show, to know if there's another page */
+        value = YELP_DOCUMENT_GET_CLASS (document)->search (document, txt, offset,
+                                                            SEARCH_PAGE_SIZE + 1);
+        g_variant_iter_init (&groups, value);
+        while (g_variant_iter_next (&groups, "(&s&s@a(sssss))", NULL, NULL, &pages)) {
+            n_results += g_variant_n_children (pages);
+            g_variant_unref (pages);
+        }
+
+        if (n_results == 0 && offset == 0) {
             if (index_title != NULL) {
                 gchar *t = g_strdup_printf (_("No matching help pages found in “%s”."), index_title);
                 tmp = g_markup_printf_escaped ("<p>%s</p>", t);
@@ -1051,24 +1395,51 @@ document_read_contents (YelpDocument *document,
             g_free (tmp);
         }
         else {
-            while (g_variant_iter_loop (iter, "(&s&s&s&s)", &url, &title, &desc, &icon)) {
-                gchar *xref_uri = NULL;
-
-                if (g_str_has_prefix (url, document->priv->doc_uri))
-                    xref_uri = g_strdup_printf ("xref:%s", url + strlen (document->priv->doc_uri) + 1);
-
-                tmp = g_markup_printf_escaped ("<div><a class='linkdiv' href='%s'><div class='linkdiv'>"
-                                               "<div class='title'>%s</div>"
-                                               "<div class='desc'>%s</div>"
-                                               "</div></a></div>",
-                                               xref_uri && xref_uri[0] != '\0' ? xref_uri : url,
-                                               title, desc);
+            const gchar *group_uri, *group_title;
+
+            /* Results from other documents get a heading for their document */
+            g_variant_iter_init (&groups, value);
+            while (count < SEARCH_PAGE_SIZE &&
+                   g_variant_iter_next (&groups, "(&s&s@a(sssss))",
+                                        &group_uri, &group_title, &pages)) {
+                if (g_strcmp0 (group_uri, document->priv->doc_uri) != 0) {
+                    tmp = g_markup_printf_escaped ("<h2>%s</h2>",
+                                                   group_title[0] != '\0' ? group_title : group_uri);
+                    g_string_append (ret, tmp);
+                    g_free (tmp);
+                }
+
+                iter = g_variant_iter_new (pages);
+                count += document_append_results (document, ret, iter,
+                                                  SEARCH_PAGE_SIZE - count);
+                g_variant_iter_free (iter);
+                g_variant_unref (pages);
+            }
+        }
+
+        /* The page is XHTML, so the & between the search text and the
+         * offset has to be an entity.
+         */
+        if (offset > 0 || n_results > SEARCH_PAGE_SIZE) {
+            gchar *escaped = g_uri_escape_string (txt, NULL, FALSE);
+            g_string_append (ret, "<div class='pages'>");
+            if (offset > 0) {
+                tmp = g_markup_printf_escaped ("<a href='xref:search=%s&amp;offset=%i'>%s</a>",
+                                               escaped, MAX (offset - SEARCH_PAGE_SIZE, 0),
+                                               _("Previous results"));
                 g_string_append (ret, tmp);
-                g_free (xref_uri);
                 g_free (tmp);
             }
+            if (n_results > SEARCH_PAGE_SIZE) {
+                tmp = g_markup_printf_escaped ("<a href='xref:search=%s&amp;offset=%i'>%s</a>",
+                                               escaped, offset + SEARCH_PAGE_SIZE,
+                                               _("More results"));
+                g_string_append (ret, tmp);
+                g_free (tmp);
+            }
+            g_string_append (ret, "</div>");
+            g_free (escaped);
         }
-        g_variant_iter_free (iter);
         g_variant_unref (value);
 
         if (index_title != NULL)
@@ -1166,12 +1537,91 @@ document_get_mime_type (YelpDocument *document,
 
 /******************************************************************************/
 
+static guint64
+document_file_mtime (GFile *file)
+{
+    GFileInfo *info;
+    guint64 ret = 0;
+
+    info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                              G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    if (info) {
+        ret = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+        g_object_unref (info);
+    }
+    return ret;
+}
+
+/* Returns the newest modification time of the files the document is
+ * built from, or 0 if it isn't built from files. Documents that are
+ * directories of pages look at every file in their search path.
+ */
+static gint64
+document_get_source_mtime (YelpDocument *document)
+{
+    GFile *file;
+    GFileEnumerator *children;
+    GFileInfo *info;
+    gchar **path;
+    gint i;
+    guint64 ret = 0;
+
+    file = yelp_uri_get_file (document->priv->uri);
+    if (file == NULL)
+        return 0;
+
+    if (g_file_query_file_type (file, G_FILE_QUERY_INFO_NONE, NULL) != G_FILE_TYPE_DIRECTORY) {
+        ret = document_file_mtime (file);
+        g_object_unref (file);
+        return ret;
+    }
+    g_object_unref (file);
+
+    path = yelp_uri_get_search_path (document->priv->uri);
+    for (i = 0; path && path[i]; i++) {
+        GFile *dir = g_file_new_for_path (path[i]);
+        ret = MAX (ret, document_file_mtime (dir));
+        children = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                              G_FILE_QUERY_INFO_NONE, NULL, NULL);
+        if (children) {
+            while ((info = g_file_enumerator_next_file (children, NULL, NULL))) {
+                ret = MAX (ret, g_file_info_get_attribute_uint64 (info,
+                                                                  G_FILE_ATTRIBUTE_TIME_MODIFIED));
+                g_object_unref (info);
+            }
+            g_object_unref (children);
+        }
+        g_object_unref (dir);
+    }
+    g_strfreev (path);
+
+    return ret;
+}
+
 void
 yelp_document_index (YelpDocument *document)
 {
+    YelpStorage *storage;
+    gint64 mtime;
+
     g_return_if_fail (YELP_IS_DOCUMENT (document));
     g_return_if_fail (YELP_DOCUMENT_GET_CLASS (document)->index != NULL);
 
+    /* The index is kept across runs. Use it if nothing changed since it
+     * was made, and otherwise throw it out before indexing again.
+     */
+    if (!document->priv->index_checked && document->priv->doc_uri != NULL) {
+        document->priv->index_checked = TRUE;
+        storage = yelp_storage_get_default ();
+        mtime = document_get_source_mtime (document);
+        if (mtime != 0 && yelp_storage_get_mtime (storage, document->priv->doc_uri) == mtime) {
+            g_object_set (document, "indexed", TRUE, NULL);
+            return;
+        }
+        yelp_storage_clear (storage, document->priv->doc_uri);
+        document->priv->index_mtime = mtime;
+    }
+
     YELP_DOCUMENT_GET_CLASS (document)->index (document);
 }
 
@@ -1181,6 +1631,29 @@ document_index (YelpDocument *document)
     g_object_set (document, "indexed", TRUE, NULL);
 }
 
+/* Returns the results of yelp_storage_search_range for this document, as a
+ * single group in the a(ssa(sssss)) form of yelp_storage_search_all.
+ */
+static GVariant *
+document_search (YelpDocument *document,
+                 const gchar  *text,
+                 gint          offset,
+                 gint          limit)
+{
+    GVariantBuilder builder;
+    GVariant *results;
+
+    results = g_variant_ref_sink (yelp_storage_search_range (yelp_storage_get_default (),
+                                                             document->priv->doc_uri,
+                                                             text, offset, limit));
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssa(sssss))"));
+    g_variant_builder_add (&builder, "(ss@a(sssss))",
+                           document->priv->doc_uri, "", results);
+    g_variant_unref (results);
+
+    return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
 /******************************************************************************/
 
 void
@@ -38,6 +38,7 @@ G_BEGIN_DECLS
 typedef struct _YelpDocument      YelpDocument;
 typedef struct _YelpDocumentClass YelpDocumentClass;
 typedef struct _YelpDocumentPriv  YelpDocumentPriv;
+typedef struct _YelpDocumentBatch YelpDocumentBatch;
 
 typedef enum {
     YELP_DOCUMENT_SIGNAL_CONTENTS,
@@ -72,6 +73,10 @@ struct _YelpDocumentClass {
     gchar *       (*get_mime_type)                  (YelpDocument         *document,
                                                      const gchar          *page_id);
     void          (*index)                          (YelpDocument         *document);
+    GVariant *    (*search)                         (YelpDocument         *document,
+                                                     const gchar          *text,
+                                                     gint                  offset,
+                                                     gint                  limit);
 
 };
 
@@ -105,6 +110,7 @@ void              yelp_document_finish_read         (YelpDocument         *docum
 void              yelp_document_index               (YelpDocument         *document);
 
 gchar **          yelp_document_list_page_ids       (YelpDocument         *document);
+GVariant *        yelp_document_list_pages          (YelpDocument         *document);
 
 gchar *           yelp_document_get_page_id         (YelpDocument         *document,
                                                      const gchar          *id);
@@ -160,6 +166,29 @@ void              yelp_document_set_page_icon       (YelpDocument         *docum
 gboolean          yelp_document_has_page            (YelpDocument         *document,
                                                      const gchar          *page_id);
 
+YelpDocumentBatch * yelp_document_batch_new        (void);
+void              yelp_document_batch_free          (YelpDocumentBatch    *batch);
+void              yelp_document_batch_set_page_id   (YelpDocumentBatch    *batch,
+                                                     const gchar          *id,
+                                                     const gchar          *page_id);
+void              yelp_document_batch_set_root_id   (YelpDocumentBatch    *batch,
+                                                     const gchar          *page_id,
+                                                     const gchar          *root_id);
+void              yelp_document_batch_set_prev_id   (YelpDocumentBatch    *batch,
+                                                     const gchar          *page_id,
+                                                     const gchar          *prev_id);
+void              yelp_document_batch_set_next_id   (YelpDocumentBatch    *batch,
+                                                     const gchar          *page_id,
+                                                     const gchar          *next_id);
+void              yelp_document_batch_set_up_id     (YelpDocumentBatch    *batch,
+                                                     const gchar          *page_id,
+                                                     const gchar          *up_id);
+void              yelp_document_batch_set_page_title (YelpDocumentBatch   *batch,
+                                                     const gchar          *page_id,
+                                                     const gchar          *title);
+void              yelp_document_commit_batch        (YelpDocument         *document,
+                                                     YelpDocumentBatch    *batch);
+
 void              yelp_document_signal              (YelpDocument         *document,
                                                      const gchar          *page_id,
                                                      YelpDocumentSignal    signal,
@@ -0,0 +1,157 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Yelp authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: The Yelp authors
+ */
+
+#include <config.h>
+
+#include "yelp-fuzzy.h"
+
+static gint
+fuzzy_decode (const gchar *text,
+              gssize       len,
+              gunichar    *chars,
+              gint         max_chars)
+{
+    const gchar *cur, *end = len < 0 ? NULL : text + len;
+    gint n = 0;
+
+    for (cur = text; n < max_chars && (end ? cur < end : *cur != '\0');
+         cur = g_utf8_next_char (cur))
+        chars[n++] = g_utf8_get_char (cur);
+
+    return n;
+}
+
+static gboolean
+fuzzy_is_word_char (gunichar c)
+{
+    return g_unichar_isalnum (c) || c == '_';
+}
+
+/* Returns how many typos a search for word, casefolded and len bytes long
+ * or nul-terminated if len is -1, tolerates. Short words get none, since
+ * nearly anything is a couple of edits away from them.
+ */
+gint
+yelp_fuzzy_max_edits (const gchar *word,
+                      gssize       len)
+{
+    glong chars = g_utf8_strlen (word, len);
+
+    if (chars < 4)
+        return 0;
+    if (chars < 8)
+        return 1;
+    return 2;
+}
+
+/* Counts the insertions, deletions, substitutions and swaps of adjacent
+ * characters it takes to turn word into the start of text, so that a word
+ * still being typed matches as well. Both are casefolded, and a length of
+ * -1 means nul-terminated. Gives up as soon as it is sure to need more than
+ * max_edits, returning max_edits + 1.
+ */
+gint
+yelp_fuzzy_distance (const gchar *word,
+                     gssize       word_len,
+                     const gchar *text,
+                     gssize       text_len,
+                     gint         max_edits)
+{
+    gunichar a[YELP_FUZZY_MAX_CHARS], b[2 * YELP_FUZZY_MAX_CHARS];
+    gint rows[3][YELP_FUZZY_MAX_CHARS + 1];
+    gint *prev2 = rows[0], *prev = rows[1], *cur = rows[2];
+    gint n, m, i, j, best, prev_min = 0;
+
+    n = fuzzy_decode (word, word_len, a, YELP_FUZZY_MAX_CHARS);
+    max_edits = CLAMP (max_edits, 0, YELP_FUZZY_MAX_CHARS);
+    /* Characters past these can only be left out of the prefix */
+    m = fuzzy_decode (text, text_len, b, n + max_edits);
+    if (m + max_edits < n)
+        return max_edits + 1;
+
+    for (i = 0; i <= n; i++)
+        prev[i] = i;
+    best = n;
+
+    for (j = 1; j <= m; j++) {
+        gint row_min;
+
+        cur[0] = row_min = j;
+        for (i = 1; i <= n; i++) {
+            gint v = prev[i - 1] + (a[i - 1] != b[j - 1]);
+            v = MIN (v, prev[i] + 1);
+            v = MIN (v, cur[i - 1] + 1);
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+                v = MIN (v, prev2[i - 2] + 1);
+            cur[i] = v;
+            row_min = MIN (row_min, v);
+        }
+        best = MIN (best, cur[n]);
+
+        /* A swap can reach back two rows, so both have to be over */
+        if (row_min > max_edits && prev_min > max_edits)
+            break;
+        prev_min = row_min;
+
+        {
+            gint *tmp = prev2;
+            prev2 = prev;
+            prev = cur;
+            cur = tmp;
+        }
+    }
+
+    return MIN (best, max_edits + 1);
+}
+
+/* Returns the fewest edits from word to any word in text, as from
+ * yelp_fuzzy_distance, or max_edits + 1 if none is close enough. Text may
+ * be NULL.
+ */
+gint
+yelp_fuzzy_text_distance (const gchar *text,
+                          const gchar *word,
+                          gint         max_edits)
+{
+    const gchar *cur, *start = NULL;
+    gint best = max_edits + 1;
+
+    if (text == NULL)
+        return best;
+
+    for (cur = text; ; cur = g_utf8_next_char (cur)) {
+        gunichar c = g_utf8_get_char (cur);
+        if (c != 0 && fuzzy_is_word_char (c)) {
+            if (start == NULL)
+                start = cur;
+            continue;
+        }
+        if (start != NULL) {
+            best = MIN (best, yelp_fuzzy_distance (word, -1, start, cur - start, max_edits));
+            if (best == 0)
+                break;
+        }
+        start = NULL;
+        if (c == 0)
+            break;
+    }
+
+    return best;
+}
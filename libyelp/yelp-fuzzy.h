@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Yelp authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: The Yelp authors
+ */
+
+#ifndef __YELP_FUZZY_H__
+#define __YELP_FUZZY_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Only this many characters of a word are compared */
+#define YELP_FUZZY_MAX_CHARS 32
+
+gint      yelp_fuzzy_max_edits      (const gchar *word,
+                                     gssize       len);
+gint      yelp_fuzzy_distance       (const gchar *word,
+                                     gssize       word_len,
+                                     const gchar *text,
+                                     gssize       text_len,
+                                     gint         max_edits);
+gint      yelp_fuzzy_text_distance  (const gchar *text,
+                                     const gchar *word,
+                                     gint         max_edits);
+
+G_END_DECLS
+
+#endif /* __YELP_FUZZY_H__ */
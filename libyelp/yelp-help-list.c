@@ -33,6 +33,7 @@
 
 #include "yelp-help-list.h"
 #include "yelp-settings.h"
+#include "yelp-storage.h"
 
 typedef struct _HelpListEntry HelpListEntry;
 
@@ -45,6 +46,10 @@ static gboolean       help_list_request_page         (YelpDocument          *doc
                                                       YelpDocumentCallback   callback,
                                                       gpointer               user_data,
                                                       GDestroyNotify         notify);
+static GVariant *     help_list_search               (YelpDocument          *document,
+                                                      const gchar           *text,
+                                                      gint                   offset,
+                                                      gint                   limit);
 static void           help_list_think                (YelpHelpList          *list);
 static void           help_list_handle_page          (YelpHelpList          *list,
                                                       const gchar           *page_id);
@@ -115,6 +120,7 @@ yelp_help_list_class_init (YelpHelpListClass *klass)
     object_class->finalize = yelp_help_list_finalize;
 
     document_class->request_page = help_list_request_page;
+    document_class->search = help_list_search;
 
     g_type_class_add_private (klass, sizeof (YelpHelpListPrivate));
 }
@@ -203,6 +209,7 @@ help_list_request_page (YelpDocument          *document,
     g_mutex_lock (&priv->mutex);
     if (priv->process_ran) {
         help_list_handle_page ((YelpHelpList *) document, page_id);
+        g_mutex_unlock (&priv->mutex);
         return TRUE;
     }
 
@@ -218,6 +225,41 @@ help_list_request_page (YelpDocument          *document,
     return TRUE;
 }
 
+/* The help list searches every document, grouping the results by document */
+static GVariant *
+help_list_search (YelpDocument *document,
+                  const gchar  *text,
+                  gint          offset,
+                  gint          limit)
+{
+    return yelp_storage_search_all (yelp_storage_get_default (),
+                                    text, offset, limit);
+}
+
+/* Returns the IDs of the listed documents, like help:gnome-help, or NULL
+ * if the list hasn't been read yet. Request a page first to read it.
+ */
+gchar **
+yelp_help_list_get_document_ids (YelpHelpList *list)
+{
+    GPtrArray *ids;
+    GList *cur;
+    YelpHelpListPrivate *priv = GET_PRIV (list);
+
+    g_mutex_lock (&priv->mutex);
+    if (!priv->process_ran) {
+        g_mutex_unlock (&priv->mutex);
+        return NULL;
+    }
+    ids = g_ptr_array_new ();
+    for (cur = priv->all_entries; cur != NULL; cur = cur->next)
+        g_ptr_array_add (ids, g_strdup (((HelpListEntry *) cur->data)->id));
+    g_ptr_array_add (ids, NULL);
+    g_mutex_unlock (&priv->mutex);
+
+    return (gchar **) g_ptr_array_free (ids, FALSE);
+}
+
 static void
 help_list_think (YelpHelpList *list)
 {
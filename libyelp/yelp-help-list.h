@@ -45,5 +45,6 @@ struct _YelpHelpListClass {
 
 GType           yelp_help_list_get_type     (void);
 YelpDocument *  yelp_help_list_new          (YelpUri *uri);
+gchar **        yelp_help_list_get_document_ids (YelpHelpList *list);
 
 #endif /* __YELP_HELP_LIST_H__ */
@@ -969,6 +969,7 @@ mallard_index_threaded (YelpMallardDocument *mallard)
     doc_uri = yelp_uri_get_document_uri (document_uri);
     ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     path = yelp_uri_get_search_path (document_uri);
+    yelp_storage_begin_batch (yelp_storage_get_default (), doc_uri);
     for (path_i = 0; path[path_i] != NULL; path_i++) {
         GFile *gfile;
         GFileEnumerator *children;
@@ -1081,6 +1082,7 @@ mallard_index_threaded (YelpMallardDocument *mallard)
             g_object_unref (pageinfo);
         }
     }
+    yelp_storage_commit_batch (yelp_storage_get_default (), doc_uri);
     g_strfreev (path);
     g_hash_table_destroy (ids);
     priv->index_running = FALSE;
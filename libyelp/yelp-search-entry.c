@@ -26,9 +26,11 @@
 #include <gtk/gtk.h>
 #include <glib/gi18n.h>
 
+#include "yelp-fuzzy.h"
 #include "yelp-search-entry.h"
 #include "yelp-marshal.h"
 #include "yelp-settings.h"
+#include "yelp-storage.h"
 
 static void     search_entry_constructed     (GObject           *object);
 static void     search_entry_dispose         (GObject           *object);
@@ -50,11 +52,22 @@ static void     search_entry_bookmark_clicked  (YelpSearchEntry *entry);
 /* Utilities */
 static void     search_entry_set_completion  (YelpSearchEntry *entry,
                                                 GtkTreeModel      *model);
+static void     entry_match_reset            (YelpSearchEntry *entry);
+static void     entry_match_prepare          (YelpSearchEntry *entry,
+                                              GtkTreeModel    *model,
+                                              const gchar     *key);
+static gboolean entry_match_keys             (YelpSearchEntry *entry,
+                                              const gchar     *title,
+                                              const gchar     *desc);
+static void     full_text_cancel             (YelpSearchEntry *entry);
+static void     full_text_remove_rows        (YelpSearchEntry *entry);
 
 
 /* GtkEntry callbacks */
 static void     entry_activate_cb                   (GtkEntry          *text_entry,
                                                      gpointer           user_data);
+static void     entry_changed_cb                    (GtkEditable       *editable,
+                                                     YelpSearchEntry   *entry);
 
 /* GtkEntryCompletion callbacks */
 static void     cell_set_completion_bookmark_icon   (GtkCellLayout     *layout,
@@ -90,6 +103,25 @@ struct _YelpSearchEntryPrivate
     YelpView *view;
     YelpBookmarks *bookmarks;
     gchar *completion_uri;
+    GCancellable *completion_cancellable;
+
+    /* Full-text hits are looked up a little after typing stops. The ones
+     * in the model are shown only for the key they were found for.
+     */
+    guint full_text_timeout;
+    GCancellable *full_text_cancellable;
+    gchar *full_text_key;
+
+    /* The key being matched, split once per keystroke, and the rows that
+     * matched it. While the user keeps typing, only the rows that matched
+     * the last key are tried again.
+     */
+    gchar *match_key;
+    gchar **match_words;
+    gint *match_edits;
+    GHashTable *match_prev;
+    GHashTable *match_cur;
+    gint match_calls;
 
     /* do not free below */
     GtkEntryCompletion *completion;
@@ -100,13 +132,26 @@ enum {
     COMPLETION_COL_DESC,
     COMPLETION_COL_ICON,
     COMPLETION_COL_PAGE,
-    COMPLETION_COL_FLAGS
+    COMPLETION_COL_FLAGS,
+    COMPLETION_COL_KEYS,
+    COMPLETION_COL_SORT,
+    COMPLETION_COL_OWNER
 };
 
+/* Casefolded title and desc of a row, owned by the list store */
+typedef struct {
+    gchar *title;
+    gchar *desc;
+} CompletionKeys;
+
 enum {
-    COMPLETION_FLAG_ACTIVATE_SEARCH = 1<<0
+    COMPLETION_FLAG_ACTIVATE_SEARCH = 1<<0,
+    COMPLETION_FLAG_FULL_TEXT       = 1<<1
 };
 
+#define FULL_TEXT_DELAY 200 /* milliseconds */
+#define FULL_TEXT_MAX   3
+
 enum {
     SEARCH_ACTIVATED,
     LAST_SIGNAL
@@ -118,7 +163,14 @@ enum {
     PROP_BOOKMARKS
 };
 
+/* Completion models by document URI, at most COMPLETION_CACHE_SIZE of
+ * them, shared by all entries. The queue has the URIs, most recently used
+ * first.
+ */
+#define COMPLETION_CACHE_SIZE 8
+
 static GHashTable *completions;
+static GQueue *completions_lru;
 
 static guint search_entry_signals[LAST_SIGNAL] = {0,};
 
@@ -196,6 +248,7 @@ yelp_search_entry_class_init (YelpSearchEntryClass *klass)
                               sizeof (YelpSearchEntryPrivate));
 
     completions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+    completions_lru = g_queue_new ();
 }
 
 static void
@@ -210,6 +263,8 @@ search_entry_constructed (GObject *object)
 
     g_signal_connect (object, "activate",
                       G_CALLBACK (entry_activate_cb), object);
+    g_signal_connect (object, "changed",
+                      G_CALLBACK (entry_changed_cb), object);
 
     g_signal_connect (priv->view, "loaded", G_CALLBACK (view_loaded), object);
 }
@@ -229,6 +284,14 @@ search_entry_dispose (GObject *object)
         priv->bookmarks = NULL;
     }
 
+    if (priv->completion_cancellable) {
+        g_cancellable_cancel (priv->completion_cancellable);
+        g_clear_object (&priv->completion_cancellable);
+    }
+
+    full_text_cancel (YELP_SEARCH_ENTRY (object));
+    full_text_remove_rows (YELP_SEARCH_ENTRY (object));
+
     G_OBJECT_CLASS (yelp_search_entry_parent_class)->dispose (object);
 }
 
@@ -238,6 +301,8 @@ search_entry_finalize (GObject *object)
     YelpSearchEntryPrivate *priv = GET_PRIV (object);
 
     g_free (priv->completion_uri);
+    g_free (priv->full_text_key);
+    entry_match_reset (YELP_SEARCH_ENTRY (object));
 
     G_OBJECT_CLASS (yelp_search_entry_parent_class)->finalize (object);
 }
@@ -340,6 +405,7 @@ search_entry_set_completion (YelpSearchEntry *entry,
     GList *cells;
     GtkCellRenderer *icon_cell, *bookmark_cell;
 
+    entry_match_reset (entry);
     priv->completion = gtk_entry_completion_new ();
     gtk_entry_completion_set_minimum_key_length (priv->completion, 3);
     gtk_entry_completion_set_model (priv->completion, model);
@@ -393,6 +459,192 @@ entry_activate_cb (GtkEntry  *text_entry,
     g_free (text);
 }
 
+typedef struct {
+    gchar *doc_uri;
+    gchar *text;
+} FullTextQuery;
+
+static void
+full_text_query_free (FullTextQuery *query)
+{
+    g_free (query->doc_uri);
+    g_free (query->text);
+    g_free (query);
+}
+
+static void
+full_text_cancel (YelpSearchEntry *entry)
+{
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+
+    if (priv->full_text_timeout != 0) {
+        g_source_remove (priv->full_text_timeout);
+        priv->full_text_timeout = 0;
+    }
+    if (priv->full_text_cancellable) {
+        g_cancellable_cancel (priv->full_text_cancellable);
+        g_clear_object (&priv->full_text_cancellable);
+    }
+}
+
+/* Models are shared by every entry on the same document, so full-text
+ * rows carry the entry they were found for. Removes this entry's rows.
+ */
+static void
+full_text_remove_rows (YelpSearchEntry *entry)
+{
+    GtkEntryCompletion *completion = gtk_entry_get_completion (GTK_ENTRY (entry));
+    GtkTreeModel *model;
+    GtkListStore *base;
+    GtkTreeIter iter;
+    gboolean valid;
+
+    if (completion == NULL)
+        return;
+    model = gtk_entry_completion_get_model (completion);
+    if (model == NULL)
+        return;
+    base = GTK_LIST_STORE (gtk_tree_model_sort_get_model (GTK_TREE_MODEL_SORT (model)));
+
+    valid = gtk_tree_model_get_iter_first (GTK_TREE_MODEL (base), &iter);
+    while (valid) {
+        gint flags;
+        gpointer owner;
+        gtk_tree_model_get (GTK_TREE_MODEL (base), &iter,
+                            COMPLETION_COL_FLAGS, &flags,
+                            COMPLETION_COL_OWNER, &owner,
+                            -1);
+        if ((flags & COMPLETION_FLAG_FULL_TEXT) && owner == entry)
+            valid = gtk_list_store_remove (base, &iter);
+        else
+            valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (base), &iter);
+    }
+}
+
+static void
+full_text_thread (GTask         *task,
+                  gpointer       source_object,
+                  FullTextQuery *query,
+                  GCancellable  *cancellable)
+{
+    /* Some hits will be pages already offered for their titles */
+    GVariant *results = yelp_storage_search_incremental (yelp_storage_get_default (),
+                                                         query->doc_uri, query->text,
+                                                         2 * FULL_TEXT_MAX);
+
+    g_task_return_pointer (task, results, (GDestroyNotify) g_variant_unref);
+}
+
+/* Replaces the full-text rows in the completion model with the hits for
+ * the query, which sort after the pages and before the search row. Hits
+ * whose title or desc already match the key are left out.
+ */
+static void
+full_text_ready (YelpSearchEntry *entry,
+                 GAsyncResult    *result,
+                 gpointer         user_data)
+{
+    FullTextQuery *query = g_task_get_task_data (G_TASK (result));
+    GVariant *results;
+    GtkTreeModel *model;
+    GtkListStore *base;
+    GVariantIter hits;
+    const gchar *url, *title, *desc, *icon;
+    gchar *normalized;
+    gint i = 0;
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+
+    results = g_task_propagate_pointer (G_TASK (result), NULL);
+    if (results == NULL)
+        return;
+    if (priv->completion == NULL || priv->completion_uri == NULL ||
+        !g_str_equal (query->doc_uri, priv->completion_uri)) {
+        g_variant_unref (results);
+        return;
+    }
+
+    model = gtk_entry_completion_get_model (priv->completion);
+    base = GTK_LIST_STORE (gtk_tree_model_sort_get_model (GTK_TREE_MODEL_SORT (model)));
+
+    /* Keys are matched the way GtkEntryCompletion passes them */
+    normalized = g_utf8_normalize (query->text, -1, G_NORMALIZE_ALL);
+    g_free (priv->full_text_key);
+    priv->full_text_key = g_utf8_casefold (normalized, -1);
+    g_free (normalized);
+    entry_match_prepare (entry, model, priv->full_text_key);
+
+    full_text_remove_rows (entry);
+
+    g_variant_iter_init (&hits, results);
+    while (i < FULL_TEXT_MAX &&
+           g_variant_iter_next (&hits, "(&s&s&s&s)", &url, &title, &desc, &icon)) {
+        gchar *title_casefold = g_utf8_casefold (title, -1);
+        gchar *desc_casefold = g_utf8_casefold (desc, -1);
+        gboolean shown = entry_match_keys (entry, title_casefold, desc_casefold);
+        g_free (title_casefold);
+        g_free (desc_casefold);
+        if (shown)
+            continue;
+        gtk_list_store_insert_with_values (base, NULL, -1,
+                                           COMPLETION_COL_TITLE, title,
+                                           COMPLETION_COL_DESC, desc,
+                                           COMPLETION_COL_ICON, icon,
+                                           COMPLETION_COL_PAGE, url,
+                                           COMPLETION_COL_FLAGS, COMPLETION_FLAG_FULL_TEXT,
+                                           COMPLETION_COL_SORT, G_MAXINT - FULL_TEXT_MAX + i,
+                                           COMPLETION_COL_OWNER, entry,
+                                           -1);
+        i++;
+    }
+    g_variant_unref (results);
+
+    if (g_str_equal (gtk_entry_get_text (GTK_ENTRY (entry)), query->text))
+        gtk_entry_completion_complete (priv->completion);
+}
+
+static gboolean
+full_text_timeout_cb (YelpSearchEntry *entry)
+{
+    FullTextQuery *query;
+    GTask *task;
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+
+    priv->full_text_timeout = 0;
+
+    query = g_new0 (FullTextQuery, 1);
+    query->doc_uri = g_strdup (priv->completion_uri);
+    query->text = g_strdup (gtk_entry_get_text (GTK_ENTRY (entry)));
+
+    priv->full_text_cancellable = g_cancellable_new ();
+    task = g_task_new (entry, priv->full_text_cancellable,
+                       (GAsyncReadyCallback) full_text_ready, NULL);
+    g_task_set_task_data (task, query, (GDestroyNotify) full_text_query_free);
+    g_task_run_in_thread (task, (GTaskThreadFunc) full_text_thread);
+    g_object_unref (task);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* A new keystroke makes any full-text lookup in flight stale */
+static void
+entry_changed_cb (GtkEditable     *editable,
+                  YelpSearchEntry *entry)
+{
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+
+    full_text_cancel (entry);
+
+    if (priv->completion == NULL || priv->completion_uri == NULL)
+        return;
+    if (g_utf8_strlen (gtk_entry_get_text (GTK_ENTRY (entry)), -1) <
+        gtk_entry_completion_get_minimum_key_length (priv->completion))
+        return;
+
+    priv->full_text_timeout = g_timeout_add (FULL_TEXT_DELAY,
+                                             (GSourceFunc) full_text_timeout_cb,
+                                             entry);
+}
+
 static void
 cell_set_completion_bookmark_icon (GtkCellLayout     *layout,
                                    GtkCellRenderer   *cell,
@@ -444,56 +696,137 @@ cell_set_completion_text_cell (GtkCellLayout     *layout,
     g_free (title);
 }
 
+static void
+entry_match_reset (YelpSearchEntry *entry)
+{
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+
+    g_clear_pointer (&priv->match_key, g_free);
+    g_clear_pointer (&priv->match_words, g_strfreev);
+    g_clear_pointer (&priv->match_edits, g_free);
+    g_clear_pointer (&priv->match_prev, g_hash_table_destroy);
+    g_clear_pointer (&priv->match_cur, g_hash_table_destroy);
+    priv->match_calls = 0;
+}
+
+/* Splits a new key into words. If it only adds to the last key, no row
+ * that failed the last key can match it, unless a word got long enough
+ * to allow another typo.
+ */
+static void
+entry_match_prepare (YelpSearchEntry *entry,
+                     GtkTreeModel    *model,
+                     const gchar     *key)
+{
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+    gchar **words;
+    gint *edits;
+    gboolean narrow;
+    gint i;
+    static GRegex *nonword = NULL;
+
+    if (priv->match_key != NULL && g_str_equal (key, priv->match_key))
+        return;
+
+    if (nonword == NULL)
+        nonword = g_regex_new ("\\W", 0, 0, NULL);
+    words = nonword ? g_regex_split (nonword, key, 0) : g_strsplit (key, " ", -1);
+    edits = g_new (gint, g_strv_length (words));
+    for (i = 0; words[i]; i++)
+        edits[i] = yelp_fuzzy_max_edits (words[i], -1);
+
+    narrow = (priv->match_key != NULL &&
+              g_str_has_prefix (key, priv->match_key) &&
+              priv->match_calls >= gtk_tree_model_iter_n_children (model, NULL));
+    for (i = 0; narrow && priv->match_words[i] && words[i]; i++)
+        narrow = (edits[i] == priv->match_edits[i]);
+
+    if (narrow) {
+        if (priv->match_prev != NULL)
+            g_hash_table_destroy (priv->match_prev);
+        priv->match_prev = priv->match_cur;
+        priv->match_cur = NULL;
+    }
+    else {
+        g_clear_pointer (&priv->match_prev, g_hash_table_destroy);
+        g_clear_pointer (&priv->match_cur, g_hash_table_destroy);
+    }
+    priv->match_cur = g_hash_table_new (g_direct_hash, g_direct_equal);
+    priv->match_calls = 0;
+
+    g_free (priv->match_key);
+    priv->match_key = g_strdup (key);
+    g_strfreev (priv->match_words);
+    priv->match_words = words;
+    g_free (priv->match_edits);
+    priv->match_edits = edits;
+}
+
+/* Whether casefolded title and desc have every word of the key */
+static gboolean
+entry_match_keys (YelpSearchEntry *entry,
+                  const gchar     *title,
+                  const gchar     *desc)
+{
+    gint stri;
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+
+    /* Words not found as typed may still be a typo or two off */
+    for (stri = 0; priv->match_words[stri]; stri++) {
+        const gchar *word = priv->match_words[stri];
+        gint max_edits = priv->match_edits[stri];
+        if (title && strstr (title, word))
+            continue;
+        if (desc && strstr (desc, word))
+            continue;
+        if (max_edits > 0 &&
+            (yelp_fuzzy_text_distance (title, word, max_edits) <= max_edits ||
+             yelp_fuzzy_text_distance (desc, word, max_edits) <= max_edits))
+            continue;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static gboolean
 entry_match_func (GtkEntryCompletion *completion,
                   const gchar        *key,
                   GtkTreeIter        *iter,
                   YelpSearchEntry  *entry)
 {
-    gint stri;
-    gchar *title, *desc, *titlecase = NULL, *desccase = NULL;
-    gboolean ret = FALSE;
-    gchar **strs;
+    gboolean ret;
     gint flags;
+    gpointer owner;
+    CompletionKeys *keys;
+    GtkTreeIter child;
     GtkTreeModel *model = gtk_entry_completion_get_model (completion);
-    static GRegex *nonword = NULL;
-
-    if (nonword == NULL)
-        nonword = g_regex_new ("\\W", 0, 0, NULL);
-    if (nonword == NULL)
-        return FALSE;
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
 
-    gtk_tree_model_get (model, iter, COMPLETION_COL_FLAGS, &flags, -1);
-    if (flags & COMPLETION_FLAG_ACTIVATE_SEARCH)
-        return TRUE;
+    entry_match_prepare (entry, model, key);
+    priv->match_calls++;
 
     gtk_tree_model_get (model, iter,
-                        COMPLETION_COL_TITLE, &title,
-                        COMPLETION_COL_DESC, &desc,
+                        COMPLETION_COL_FLAGS, &flags,
+                        COMPLETION_COL_KEYS, &keys,
+                        COMPLETION_COL_OWNER, &owner,
                         -1);
-    if (title) {
-        titlecase = g_utf8_casefold (title, -1);
-        g_free (title);
-    }
-    if (desc) {
-        desccase = g_utf8_casefold (desc, -1);
-        g_free (desc);
-    }
+    if (flags & COMPLETION_FLAG_ACTIVATE_SEARCH)
+        return TRUE;
+    if (flags & COMPLETION_FLAG_FULL_TEXT)
+        return (owner == entry && priv->full_text_key != NULL &&
+                g_str_equal (key, priv->full_text_key));
+    if (keys == NULL)
+        return FALSE;
 
-    strs = g_regex_split (nonword, key, 0);
-    ret = TRUE;
-    for (stri = 0; strs[stri]; stri++) {
-        if (!titlecase || !strstr (titlecase, strs[stri])) {
-            if (!desccase || !strstr (desccase, strs[stri])) {
-                ret = FALSE;
-                break;
-            }
-        }
-    }
+    /* Rows are remembered by their row in the list store */
+    gtk_tree_model_sort_convert_iter_to_child_iter (GTK_TREE_MODEL_SORT (model), &child, iter);
+    if (priv->match_prev != NULL && !g_hash_table_contains (priv->match_prev, child.user_data))
+        return FALSE;
 
-    g_free (titlecase);
-    g_free (desccase);
-    g_strfreev (strs);
+    ret = entry_match_keys (entry, keys->title, keys->desc);
+    if (ret)
+        g_hash_table_add (priv->match_cur, child.user_data);
 
     return ret;
 }
@@ -504,38 +837,12 @@ entry_completion_sort (GtkTreeModel *model,
                        GtkTreeIter  *iter2,
                        gpointer      user_data)
 {
-    gint ret = 0;
-    gint flags1, flags2;
-    gchar *key1, *key2;
+    gint key1, key2;
 
-    gtk_tree_model_get (model, iter1, COMPLETION_COL_FLAGS, &flags1, -1);
-    gtk_tree_model_get (model, iter2, COMPLETION_COL_FLAGS, &flags2, -1);
-    if (flags1 & COMPLETION_FLAG_ACTIVATE_SEARCH)
-        return 1;
-    else if (flags2 & COMPLETION_FLAG_ACTIVATE_SEARCH)
-        return -1;
+    gtk_tree_model_get (model, iter1, COMPLETION_COL_SORT, &key1, -1);
+    gtk_tree_model_get (model, iter2, COMPLETION_COL_SORT, &key2, -1);
 
-    gtk_tree_model_get (model, iter1, COMPLETION_COL_ICON, &key1, -1);
-    gtk_tree_model_get (model, iter2, COMPLETION_COL_ICON, &key2, -1);
-    ret = yelp_settings_cmp_icons (key1, key2);
-    g_free (key1);
-    g_free (key2);
-
-    if (ret)
-        return ret;
-
-    gtk_tree_model_get (model, iter1, COMPLETION_COL_TITLE, &key1, -1);
-    gtk_tree_model_get (model, iter2, COMPLETION_COL_TITLE, &key2, -1);
-    if (key1 && key2)
-        ret = g_utf8_collate (key1, key2);
-    else if (key2 == NULL)
-        return -1;
-    else if (key1 == NULL)
-        return 1;
-    g_free (key1);
-    g_free (key2);
-
-    return ret;
+    return (key1 > key2) - (key1 < key2);
 }
 
 static gboolean
@@ -555,9 +862,19 @@ entry_match_selected (GtkEntryCompletion *completion,
         return TRUE;
     }
 
-    g_object_get (priv->view, "yelp-uri", &base, NULL);
     gtk_tree_model_get (model, iter, COMPLETION_COL_PAGE, &page, -1);
 
+    if (flags & COMPLETION_FLAG_FULL_TEXT) {
+        uri = yelp_uri_new (page);
+        yelp_view_load_uri (priv->view, uri);
+        g_object_unref (uri);
+        g_free (page);
+        gtk_widget_grab_focus (GTK_WIDGET (priv->view));
+        return TRUE;
+    }
+
+    g_object_get (priv->view, "yelp-uri", &base, NULL);
+
     xref = g_strconcat ("xref:", page, NULL);
     uri = yelp_uri_new_relative (base, xref);
 
@@ -572,71 +889,260 @@ entry_match_selected (GtkEntryCompletion *completion,
     return TRUE;
 }
 
+static void
+completion_keys_free (CompletionKeys *keys)
+{
+    g_free (keys->title);
+    g_free (keys->desc);
+    g_free (keys);
+}
+
+typedef struct {
+    gchar *page_id;
+    gchar *title;
+    gchar *desc;
+    gchar *icon;
+    gchar *collate_key;
+    CompletionKeys *keys;
+} CompletionRow;
+
+static void
+completion_row_clear (CompletionRow *row)
+{
+    g_free (row->page_id);
+    g_free (row->title);
+    g_free (row->desc);
+    g_free (row->icon);
+    g_free (row->collate_key);
+    if (row->keys)
+        completion_keys_free (row->keys);
+}
+
+static gint
+completion_row_compare (gconstpointer a,
+                        gconstpointer b)
+{
+    const CompletionRow *row_a = a, *row_b = b;
+    gint ret = yelp_settings_cmp_icons (row_a->icon, row_b->icon);
+
+    if (ret)
+        return ret;
+    if (row_a->collate_key && row_b->collate_key)
+        return strcmp (row_a->collate_key, row_b->collate_key);
+    if (row_b->collate_key == NULL)
+        return row_a->collate_key == NULL ? 0 : -1;
+    return 1;
+}
+
+/* Runs in a worker thread. Everything slow about a completion model is
+ * done here: reading the pages, casefolding, collation keys and sorting.
+ */
+static void
+completion_rows_thread (GTask        *task,
+                        gpointer      source_object,
+                        YelpDocument *document,
+                        GCancellable *cancellable)
+{
+    GVariant *pages = yelp_document_list_pages (document);
+    GArray *rows;
+    GVariantIter iter;
+    const gchar *page_id, *title, *desc, *icon;
+
+    rows = g_array_sized_new (FALSE, FALSE, sizeof (CompletionRow), g_variant_n_children (pages));
+    g_array_set_clear_func (rows, (GDestroyNotify) completion_row_clear);
+
+    g_variant_iter_init (&iter, pages);
+    while (g_variant_iter_next (&iter, "(&s&s&s&s)", &page_id, &title, &desc, &icon)) {
+        CompletionRow row;
+        row.page_id = g_strdup (page_id);
+        row.title = *title ? g_strdup (title) : NULL;
+        row.desc = *desc ? g_strdup (desc) : NULL;
+        row.icon = g_strdup (icon);
+        row.collate_key = row.title ? g_utf8_collate_key (row.title, -1) : NULL;
+        row.keys = g_new0 (CompletionKeys, 1);
+        if (row.title)
+            row.keys->title = g_utf8_casefold (row.title, -1);
+        if (row.desc)
+            row.keys->desc = g_utf8_casefold (row.desc, -1);
+        g_array_append_val (rows, row);
+    }
+    g_variant_unref (pages);
+
+    g_array_sort (rows, completion_row_compare);
+
+    g_task_return_pointer (task, rows, (GDestroyNotify) g_array_unref);
+}
+
+/* Rows come in sorted, so the sort model only compares their positions.
+ * With no rows, the model is empty, without the search row.
+ */
+static GtkTreeModel *
+completion_model_new (GArray *rows)
+{
+    GPtrArray *all_keys = g_ptr_array_new_with_free_func ((GDestroyNotify) completion_keys_free);
+    GtkListStore *base = gtk_list_store_new (8,
+                                             G_TYPE_STRING,  /* title */
+                                             G_TYPE_STRING,  /* desc */
+                                             G_TYPE_STRING,  /* icon */
+                                             G_TYPE_STRING,  /* uri */
+                                             G_TYPE_INT,     /* flags */
+                                             G_TYPE_POINTER, /* keys */
+                                             G_TYPE_INT,     /* sort */
+                                             G_TYPE_POINTER  /* owner */
+                                             );
+    GtkTreeModel *completion;
+    guint i;
+
+    g_object_set_data_full (G_OBJECT (base), "completion-keys", all_keys,
+                            (GDestroyNotify) g_ptr_array_unref);
+
+    if (rows != NULL) {
+        for (i = 0; i < rows->len; i++) {
+            CompletionRow *row = &g_array_index (rows, CompletionRow, i);
+            gtk_list_store_insert_with_values (base, NULL, -1,
+                                               COMPLETION_COL_TITLE, row->title,
+                                               COMPLETION_COL_DESC, row->desc,
+                                               COMPLETION_COL_ICON, row->icon,
+                                               COMPLETION_COL_PAGE, row->page_id,
+                                               COMPLETION_COL_KEYS, row->keys,
+                                               COMPLETION_COL_SORT, (gint) i,
+                                               -1);
+            g_ptr_array_add (all_keys, row->keys);
+            row->keys = NULL;
+        }
+
+        gtk_list_store_insert_with_values (base, NULL, -1,
+                                           COMPLETION_COL_ICON, "edit-find-symbolic",
+                                           COMPLETION_COL_FLAGS, COMPLETION_FLAG_ACTIVATE_SEARCH,
+                                           COMPLETION_COL_SORT, G_MAXINT,
+                                           -1);
+    }
+
+    completion = gtk_tree_model_sort_new_with_model (GTK_TREE_MODEL (base));
+    gtk_tree_sortable_set_default_sort_func (GTK_TREE_SORTABLE (completion),
+                                             entry_completion_sort,
+                                             NULL, NULL);
+    g_object_unref (base);
+
+    return completion;
+}
+
+static GtkTreeModel *
+completion_cache_lookup (const gchar *doc_uri)
+{
+    GtkTreeModel *completion = g_hash_table_lookup (completions, doc_uri);
+
+    if (completion != NULL) {
+        GList *link = g_queue_find_custom (completions_lru, doc_uri, (GCompareFunc) strcmp);
+        g_queue_unlink (completions_lru, link);
+        g_queue_push_head_link (completions_lru, link);
+    }
+
+    return completion;
+}
+
+/* Takes the reference to completion. Entries using an evicted model keep
+ * their own reference to it.
+ */
+static void
+completion_cache_insert (const gchar  *doc_uri,
+                         GtkTreeModel *completion)
+{
+    if (g_hash_table_lookup (completions, doc_uri) == NULL)
+        g_queue_push_head (completions_lru, g_strdup (doc_uri));
+    g_hash_table_insert (completions, g_strdup (doc_uri), completion);
+
+    while (g_queue_get_length (completions_lru) > COMPLETION_CACHE_SIZE) {
+        gchar *old = g_queue_pop_tail (completions_lru);
+        g_hash_table_remove (completions, old);
+        g_free (old);
+    }
+}
+
+static void
+completion_rows_ready (YelpSearchEntry *entry,
+                       GAsyncResult    *result,
+                       gchar           *doc_uri)
+{
+    GArray *rows;
+    GtkTreeModel *completion;
+    YelpSearchEntryPrivate *priv = GET_PRIV (entry);
+
+    rows = g_task_propagate_pointer (G_TASK (result), NULL);
+    if (rows == NULL) {
+        g_free (doc_uri);
+        return;
+    }
+
+    /* Another entry may have built it in the meantime */
+    completion = completion_cache_lookup (doc_uri);
+    if (completion == NULL) {
+        completion = completion_model_new (rows);
+        completion_cache_insert (doc_uri, completion);
+    }
+    g_array_unref (rows);
+
+    if (priv->completion_uri && g_str_equal (priv->completion_uri, doc_uri))
+        search_entry_set_completion (entry, completion);
+
+    g_free (doc_uri);
+}
+
 static void
 view_loaded (YelpView          *view,
              YelpSearchEntry *entry)
 {
-    gchar **ids;
-    gint i;
-    GtkTreeIter iter;
     YelpUri *uri;
     gchar *doc_uri;
     GtkTreeModel *completion;
+    GTask *task;
     YelpSearchEntryPrivate *priv = GET_PRIV (entry);
     YelpDocument *document = yelp_view_get_document (view);
 
     g_object_get (view, "yelp-uri", &uri, NULL);
     doc_uri = yelp_uri_get_document_uri (uri);
+    g_object_unref (uri);
 
-    if ((priv->completion_uri == NULL) || 
-        !g_str_equal (doc_uri, priv->completion_uri)) {
-        completion = (GtkTreeModel *) g_hash_table_lookup (completions, doc_uri);
-        if (completion == NULL) {
-            GtkListStore *base = gtk_list_store_new (5,
-                                                     G_TYPE_STRING,  /* title */
-                                                     G_TYPE_STRING,  /* desc */
-                                                     G_TYPE_STRING,  /* icon */
-                                                     G_TYPE_STRING,  /* uri */
-                                                     G_TYPE_INT      /* flags */
-                                                     );
-            completion = gtk_tree_model_sort_new_with_model (GTK_TREE_MODEL (base));
-            gtk_tree_sortable_set_default_sort_func (GTK_TREE_SORTABLE (completion),
-                                                     entry_completion_sort,
-                                                     NULL, NULL);
-            g_hash_table_insert (completions, g_strdup (doc_uri), completion);
-            if (document != NULL) {
-                ids = yelp_document_list_page_ids (document);
-                for (i = 0; ids[i]; i++) {
-                    gchar *title, *desc, *icon;
-                    gtk_list_store_insert (GTK_LIST_STORE (base), &iter, 0);
-                    title = yelp_document_get_page_title (document, ids[i]);
-                    desc = yelp_document_get_page_desc (document, ids[i]);
-                    icon = yelp_document_get_page_icon (document, ids[i]);
-                    gtk_list_store_set (base, &iter,
-                                        COMPLETION_COL_TITLE, title,
-                                        COMPLETION_COL_DESC, desc,
-                                        COMPLETION_COL_ICON, icon,
-                                        COMPLETION_COL_PAGE, ids[i],
-                                        -1);
-                    g_free (icon);
-                    g_free (desc);
-                    g_free (title);
-                }
-                g_strfreev (ids);
-                gtk_list_store_insert (GTK_LIST_STORE (base), &iter, 0);
-                gtk_list_store_set (base, &iter,
-                                    COMPLETION_COL_ICON, "edit-find-symbolic",
-                                    COMPLETION_COL_FLAGS, COMPLETION_FLAG_ACTIVATE_SEARCH,
-                                    -1);
-            }
-            g_object_unref (base);
-        }
-        g_free (priv->completion_uri);
-        priv->completion_uri = doc_uri;
+    if (priv->completion_uri != NULL && g_str_equal (doc_uri, priv->completion_uri)) {
+        g_free (doc_uri);
+        return;
+    }
+
+    g_free (priv->completion_uri);
+    priv->completion_uri = doc_uri;
+    full_text_cancel (entry);
+    full_text_remove_rows (entry);
+    g_clear_pointer (&priv->full_text_key, g_free);
+
+    if (priv->completion_cancellable) {
+        g_cancellable_cancel (priv->completion_cancellable);
+        g_clear_object (&priv->completion_cancellable);
+    }
+
+    completion = completion_cache_lookup (doc_uri);
+    if (completion == NULL && document == NULL) {
+        completion = completion_model_new (NULL);
+        completion_cache_insert (doc_uri, completion);
+    }
+    if (completion != NULL) {
         search_entry_set_completion (entry, completion);
+        return;
     }
 
-    g_object_unref (uri);
+    /* The last document's pages must not be offered until the new model
+     * is swapped in.
+     */
+    gtk_entry_set_completion (GTK_ENTRY (entry), NULL);
+    priv->completion = NULL;
+    entry_match_reset (entry);
+
+    priv->completion_cancellable = g_cancellable_new ();
+    task = g_task_new (entry, priv->completion_cancellable,
+                       (GAsyncReadyCallback) completion_rows_ready,
+                       g_strdup (doc_uri));
+    g_task_set_task_data (task, g_object_ref (document), g_object_unref);
+    g_task_run_in_thread (task, (GTaskThreadFunc) completion_rows_thread);
+    g_object_unref (task);
 }
 
 /**
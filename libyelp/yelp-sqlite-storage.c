@@ -20,7 +20,10 @@
 
 #include "config.h"
 
+#include <gio/gio.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <math.h>
 #include <sqlite3.h>
 
 #include "yelp-sqlite-storage.h"
@@ -45,18 +48,175 @@ static void        yelp_sqlite_storage_update         (YelpStorage      *storage
                                                        const gchar      *text);
 static GVariant *  yelp_sqlite_storage_search         (YelpStorage      *storage,
                                                        const gchar      *doc_uri,
-                                                       const gchar      *text);
+                                                       const gchar      *text,
+                                                       gint              offset,
+                                                       gint              limit);
+static GVariant *  yelp_sqlite_storage_search_all     (YelpStorage      *storage,
+                                                       const gchar      *text,
+                                                       gint              offset,
+                                                       gint              limit);
+static GVariant *  yelp_sqlite_storage_search_incremental (YelpStorage  *storage,
+                                                           const gchar  *doc_uri,
+                                                           const gchar  *text,
+                                                           gint          limit);
+static GVariant *  yelp_sqlite_storage_list_pages     (YelpStorage      *storage);
 static gchar *     yelp_sqlite_storage_get_root_title (YelpStorage      *storage,
                                                        const gchar      *doc_uri);
 static void        yelp_sqlite_storage_set_root_title (YelpStorage      *storage,
                                                        const gchar      *doc_uri,
                                                        const gchar      *title);
+static void        yelp_sqlite_storage_begin_batch    (YelpStorage      *storage,
+                                                       const gchar      *doc_uri);
+static void        yelp_sqlite_storage_commit_batch   (YelpStorage      *storage,
+                                                       const gchar      *doc_uri);
+static gint64      yelp_sqlite_storage_get_mtime      (YelpStorage      *storage,
+                                                       const gchar      *doc_uri);
+static void        yelp_sqlite_storage_set_mtime      (YelpStorage      *storage,
+                                                       const gchar      *doc_uri,
+                                                       gint64            mtime);
+static void        yelp_sqlite_storage_clear          (YelpStorage      *storage,
+                                                       const gchar      *doc_uri);
+
+/* Bump this whenever the tables change. Older databases are dropped and
+ * created again, since they only hold what we can always index again.
+ */
+#define SCHEMA_VERSION 6
+
+/* Column values shorter than this aren't worth compressing */
+#define COMPRESS_MIN 256
+
+/* How text in one language is broken into searchable terms. FTS fixes
+ * the tokenizer per table, so each analyzer gets a pages table of its
+ * own, and rows for a language always go to the table of its analyzer.
+ * That way queries see the same analysis the index was built with.
+ */
+typedef struct {
+    const gchar *table;
+    const gchar *tokenize;
+    gboolean     bigrams;   /* Split runs of CJK characters into bigrams */
+} SqliteAnalyzer;
+
+static const SqliteAnalyzer analyzers[] = {
+    { "pages_porter",    "porter",                          FALSE },
+    { "pages_cjk",       "unicode61",                       TRUE  },
+    { "pages_unicode61", "unicode61 \"remove_diacritics=1\"", FALSE }
+};
+
+#define SNIPPET_SQL \
+    "snippet({pages}, '" YELP_STORAGE_MATCH_START "', '" YELP_STORAGE_MATCH_END "', '\342\200\246', 6, 24)"
+
+/* Statements are prepared the first time a connection needs them, and
+ * live as long as the connection does.
+ */
+enum {
+    STMT_PAGES_DELETE,
+    STMT_PAGES_INSERT,
+    STMT_PAGES_SEARCH,
+    STMT_PAGES_SEARCH_ALL,
+    STMT_PAGES_SEARCH_RANGE,
+    STMT_PAGES_LIST,
+    STMT_TITLES_SELECT,
+    STMT_TITLES_DELETE,
+    STMT_TITLES_INSERT,
+    STMT_SOURCES_SELECT,
+    STMT_SOURCES_UPDATE,
+    STMT_SOURCES_DELETE,
+    STMT_PAGES_CLEAR,
+    STMT_BEGIN,
+    STMT_COMMIT,
+    STMT_ROLLBACK,
+    STMT_STAGED_INSERT,
+    STMT_STAGED_SELECT,
+    STMT_STAGED_DELETE,
+    N_STMTS
+};
+
+static const gchar *stmt_sql[N_STMTS] = {
+    "delete from {pages} where doc_uri = ? and lang = ? and full_uri = ?;",
+    "insert into {pages} (doc_uri, lang, full_uri, title, desc, icon, body)"
+    " values (?, ?, ?, ?, ?, ?, ?);",
+    "select full_uri, title, desc, icon, " SNIPPET_SQL " from {pages} where"
+    " doc_uri = ? and lang = ? and {pages} match ?"
+    " order by rank(matchinfo({pages}, 'pcnalx'), 0, 0, 0, 10, 5, 0, 1) desc"
+    " limit ? offset ?;",
+    "select {pages}.doc_uri, titles.title, {pages}.full_uri,"
+    " {pages}.title, {pages}.desc, {pages}.icon, " SNIPPET_SQL " from {pages}"
+    " left join titles on titles.doc_uri = {pages}.doc_uri and titles.lang = {pages}.lang"
+    " where {pages}.lang = ? and {pages} match ?"
+    " order by rank(matchinfo({pages}, 'pcnalx'), 0, 0, 0, 10, 5, 0, 1) desc"
+    " limit ? offset ?;",
+    "select docid, full_uri, title, desc, icon from {pages} where"
+    " doc_uri = ? and lang = ? and {pages} match ? and docid between ? and ?"
+    " order by rank(matchinfo({pages}, 'pcnalx'), 0, 0, 0, 10, 5, 0, 1) desc"
+    " limit ?;",
+    "select doc_uri, full_uri, title, desc, icon from {pages} where lang = ?;",
+    "select title from titles where doc_uri = ? and lang = ?;",
+    "delete from titles where doc_uri = ? and lang = ?;",
+    "insert into titles (doc_uri, lang, title) values (?, ?, ?);",
+    "select mtime from sources where doc_uri = ? and lang = ?;",
+    "insert or replace into sources (doc_uri, lang, mtime) values (?, ?, ?);",
+    "delete from sources where doc_uri = ? and lang = ?;",
+    "delete from {pages} where doc_uri = ? and lang = ?;",
+    "begin immediate;",
+    "commit;",
+    "rollback;",
+    "insert into temp.staged (doc_uri, full_uri, title, desc, icon, body)"
+    " values (?, ?, ?, ?, ?, ?);",
+    "select full_uri, title, desc, icon, body from temp.staged where"
+    " doc_uri = ? order by rowid;",
+    "delete from temp.staged where doc_uri = ?;"
+};
+
+typedef struct _SqliteConnection SqliteConnection;
+struct _SqliteConnection {
+    sqlite3      *db;
+    sqlite3_stmt *stmts[N_STMTS];
+    const SqliteAnalyzer *analyzer;
+};
+
+typedef struct {
+    const gchar *full_uri;
+    const gchar *title;
+    const gchar *desc;
+    const gchar *icon;
+    const gchar *body;
+} SqlitePage;
+
+typedef struct {
+    gint     depth;
+    gboolean failed;   /* A page couldn't be staged */
+} SqliteBatch;
 
+/* Indexers write through one connection, guarded by mutex. With a database
+ * file in WAL mode, queries get connections of their own from a pool and
+ * run alongside the writer. An in-memory database can't be shared between
+ * connections, so there queries use the writer too.
+ */
 typedef struct _YelpSqliteStoragePrivate YelpSqliteStoragePrivate;
 struct _YelpSqliteStoragePrivate {
     gchar   *filename;
-    sqlite3 *db;
+    const SqliteAnalyzer *analyzer;
+    SqliteConnection writer;
+    GHashTable *batches;  /* Document URIs to their open SqliteBatch */
+    GHashTable *cleared;  /* Documents with no pages left since clear */
+    GHashTable *failed;   /* Documents whose last batch was lost */
     GMutex mutex;
+
+    gboolean wal;
+    GSList *readers;  /* Idle read connections */
+    GMutex readers_mutex;
+
+    /* The last search_incremental, to narrow down on the next keystroke */
+    struct {
+        gchar    *doc_uri;
+        gchar   **words;
+        gboolean  prefix;
+        gint      limit;
+        GVariant *results;
+        gint64    min_docid;
+        gint64    max_docid;
+    } last;
+    GMutex last_mutex;
 };
 
 enum {  
@@ -69,6 +229,317 @@ G_DEFINE_TYPE_WITH_CODE (YelpSqliteStorage, yelp_sqlite_storage, G_TYPE_OBJECT,
                                                 yelp_sqlite_storage_iface_init))
 #define GET_PRIV(object)(G_TYPE_INSTANCE_GET_PRIVATE ((object), YELP_TYPE_SQLITE_STORAGE, YelpSqliteStoragePrivate))
 
+/* Okapi BM25, computed from FTS4 matchinfo(pages, 'pcnalx'). The remaining
+ * arguments weight each column; columns without a weight count for 1.
+ */
+static void
+sqlite_storage_rank (sqlite3_context  *context,
+                     int               argc,
+                     sqlite3_value   **argv)
+{
+    const guint32 *info, *avg, *len, *hits;
+    guint32 nphrase, ncol, ndoc, phrase, col;
+    gdouble score = 0.0;
+    const gdouble k1 = 1.2, b = 0.75;
+
+    if (argc < 1 ||
+        sqlite3_value_bytes (argv[0]) < (int) (3 * sizeof (guint32))) {
+        sqlite3_result_double (context, 0.0);
+        return;
+    }
+    info = sqlite3_value_blob (argv[0]);
+    nphrase = info[0];
+    ncol = info[1];
+    ndoc = info[2];
+    avg = info + 3;
+    len = avg + ncol;
+    hits = len + ncol;
+
+    for (phrase = 0; phrase < nphrase; phrase++) {
+        for (col = 0; col < ncol; col++) {
+            const guint32 *x = hits + 3 * (col + phrase * ncol);
+            gdouble weight = (gint) col + 1 < argc ? sqlite3_value_double (argv[col + 1]) : 1.0;
+            gdouble idf, norm;
+
+            if (weight == 0.0 || x[0] == 0)
+                continue;
+
+            idf = log ((ndoc - x[2] + 0.5) / (x[2] + 0.5));
+            if (idf <= 0.0)
+                idf = 1e-6;
+            norm = 1.0 - b + b * (avg[col] ? (gdouble) len[col] / avg[col] : 1.0);
+            score += weight * idf * (x[0] * (k1 + 1.0)) / (x[0] + k1 * norm);
+        }
+    }
+
+    sqlite3_result_double (context, score);
+}
+
+/* Chinese, Japanese and Korean don't separate words with spaces, and
+ * unicode61 would take a whole run of characters as a single word.
+ */
+static const SqliteAnalyzer *
+sqlite_storage_pick_analyzer (const gchar *lang)
+{
+    if (g_str_has_prefix (lang, "zh") || g_str_has_prefix (lang, "ja") ||
+        g_str_has_prefix (lang, "ko"))
+        return &analyzers[1];
+    if (g_str_has_prefix (lang, "en") || g_str_equal (lang, "C") ||
+        g_str_equal (lang, "POSIX"))
+        return &analyzers[0];
+    return &analyzers[2];
+}
+
+static gboolean
+sqlite_storage_is_cjk (gunichar c)
+{
+    switch (g_unichar_get_script (c)) {
+    case G_UNICODE_SCRIPT_HAN:
+    case G_UNICODE_SCRIPT_HIRAGANA:
+    case G_UNICODE_SCRIPT_KATAKANA:
+    case G_UNICODE_SCRIPT_HANGUL:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* Rewrites each run of CJK characters as the overlapping pairs of
+ * characters in it, so that the tokenizer sees every bigram as a word.
+ * Text is passed through for analyzers that don't use bigrams. Used on
+ * both indexed text and queries. Free the result with g_free.
+ */
+static gchar *
+sqlite_storage_segment (const SqliteAnalyzer *analyzer,
+                        const gchar          *text)
+{
+    GString *ret;
+    const gchar *cur, *run = NULL;
+
+    if (text == NULL || !analyzer->bigrams)
+        return g_strdup (text);
+
+    ret = g_string_sized_new (strlen (text) * 2);
+    for (cur = text; ; cur = g_utf8_next_char (cur)) {
+        gunichar c = g_utf8_get_char (cur);
+        if (c != 0 && sqlite_storage_is_cjk (c)) {
+            if (run == NULL)
+                run = cur;
+            continue;
+        }
+        if (run != NULL) {
+            const gchar *first = run, *second = g_utf8_next_char (run);
+            g_string_append_c (ret, ' ');
+            if (second == cur)
+                g_string_append_len (ret, first, cur - first);
+            while (second != cur) {
+                const gchar *end = g_utf8_next_char (second);
+                g_string_append_len (ret, first, end - first);
+                g_string_append_c (ret, ' ');
+                first = second;
+                second = end;
+            }
+            run = NULL;
+        }
+        if (c == 0)
+            break;
+        g_string_append_unichar (ret, c);
+    }
+    return g_string_free (ret, FALSE);
+}
+
+/* Runs all of data through converter in one go. Returns NULL on failure. */
+static guchar *
+sqlite_storage_convert (GConverter    *converter,
+                        gconstpointer  data,
+                        gsize          len,
+                        gsize         *out_len)
+{
+    gsize size = MAX (len * 2, 1024), in_pos = 0, out_pos = 0;
+    guchar *buf = g_malloc (size);
+
+    for (;;) {
+        gsize read, written;
+        GConverterResult result;
+        GError *error = NULL;
+
+        result = g_converter_convert (converter,
+                                      (const guchar *) data + in_pos, len - in_pos,
+                                      buf + out_pos, size - out_pos,
+                                      G_CONVERTER_INPUT_AT_END,
+                                      &read, &written, &error);
+        if (result == G_CONVERTER_ERROR) {
+            if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+                g_error_free (error);
+                size *= 2;
+                buf = g_realloc (buf, size);
+                continue;
+            }
+            g_error_free (error);
+            g_free (buf);
+            return NULL;
+        }
+        in_pos += read;
+        out_pos += written;
+        if (result == G_CONVERTER_FINISHED)
+            break;
+        if (out_pos == size) {
+            size *= 2;
+            buf = g_realloc (buf, size);
+        }
+    }
+
+    *out_len = out_pos;
+    return buf;
+}
+
+/* FTS4 compress and uncompress functions for the pages tables. Long text
+ * is stored as a raw deflate blob, and everything else is left as it is,
+ * so uncompress only has to inflate blobs.
+ */
+static void
+sqlite_storage_compress (sqlite3_context  *context,
+                         int               argc,
+                         sqlite3_value   **argv)
+{
+    GConverter *converter;
+    const guchar *data;
+    guchar *out;
+    gsize len, out_len;
+
+    if (sqlite3_value_type (argv[0]) != SQLITE_TEXT ||
+        sqlite3_value_bytes (argv[0]) < COMPRESS_MIN) {
+        sqlite3_result_value (context, argv[0]);
+        return;
+    }
+
+    data = sqlite3_value_text (argv[0]);
+    len = sqlite3_value_bytes (argv[0]);
+    converter = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+    out = sqlite_storage_convert (converter, data, len, &out_len);
+    g_object_unref (converter);
+
+    if (out == NULL || out_len >= len) {
+        g_free (out);
+        sqlite3_result_value (context, argv[0]);
+        return;
+    }
+    sqlite3_result_blob (context, out, out_len, g_free);
+}
+
+static void
+sqlite_storage_uncompress (sqlite3_context  *context,
+                           int               argc,
+                           sqlite3_value   **argv)
+{
+    GConverter *converter;
+    guchar *out;
+    gsize out_len;
+
+    if (sqlite3_value_type (argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value (context, argv[0]);
+        return;
+    }
+
+    converter = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+    out = sqlite_storage_convert (converter,
+                                  sqlite3_value_blob (argv[0]),
+                                  sqlite3_value_bytes (argv[0]),
+                                  &out_len);
+    g_object_unref (converter);
+
+    if (out == NULL) {
+        sqlite3_result_error (context, "corrupt compressed text", -1);
+        return;
+    }
+    sqlite3_result_text (context, (const char *) out, out_len, g_free);
+}
+
+/* Undoes sqlite_storage_segment on a snippet for display, joining each
+ * bigram to the one before it. Match markers may sit between the two.
+ */
+static gchar *
+sqlite_storage_unsegment (const SqliteAnalyzer *analyzer,
+                          const gchar          *text)
+{
+    GString *ret;
+    const gchar *cur;
+    gunichar last = 0;
+
+    if (text == NULL || !analyzer->bigrams)
+        return g_strdup (text ? text : "");
+
+    ret = g_string_sized_new (strlen (text));
+    for (cur = text; *cur != '\0'; cur = g_utf8_next_char (cur)) {
+        gunichar c = g_utf8_get_char (cur);
+        if (c == ' ' && last != 0 && sqlite_storage_is_cjk (last)) {
+            const gchar *next = g_utf8_next_char (cur);
+            while (*next == YELP_STORAGE_MATCH_START[0] || *next == YELP_STORAGE_MATCH_END[0])
+                next++;
+            if (g_utf8_get_char (next) == last) {
+                /* Keep any markers, drop the space and the repeat */
+                g_string_append_len (ret, cur + 1, next - (cur + 1));
+                cur = next;
+                continue;
+            }
+        }
+        if (c != YELP_STORAGE_MATCH_START[0] && c != YELP_STORAGE_MATCH_END[0])
+            last = c;
+        g_string_append_unichar (ret, c);
+    }
+    return g_string_free (ret, FALSE);
+}
+
+/* Titles and descriptions are segmented like the body, so that they
+ * match the same queries. This gets them back for display, without the
+ * spaces segmenting left around runs of CJK characters at either end.
+ */
+static gchar *
+sqlite_storage_unsegment_column (const SqliteAnalyzer *analyzer,
+                                 const gchar          *text)
+{
+    return g_strstrip (sqlite_storage_unsegment (analyzer, text));
+}
+
+static gboolean
+sqlite_connection_open (SqliteConnection     *conn,
+                        const gchar          *filename,
+                        gint                  flags,
+                        const SqliteAnalyzer *analyzer)
+{
+    conn->analyzer = analyzer;
+    if (sqlite3_open_v2 (filename, &(conn->db), flags, NULL) != SQLITE_OK) {
+        sqlite3_close (conn->db);
+        conn->db = NULL;
+        return FALSE;
+    }
+
+    /* Other instances may be using the same file */
+    sqlite3_busy_timeout (conn->db, 5000);
+
+    sqlite3_create_function (conn->db, "rank", -1, SQLITE_UTF8, NULL,
+                             sqlite_storage_rank, NULL, NULL);
+    sqlite3_create_function (conn->db, "yelp_compress", 1, SQLITE_UTF8, NULL,
+                             sqlite_storage_compress, NULL, NULL);
+    sqlite3_create_function (conn->db, "yelp_uncompress", 1, SQLITE_UTF8, NULL,
+                             sqlite_storage_uncompress, NULL, NULL);
+    return TRUE;
+}
+
+static void
+sqlite_connection_close (SqliteConnection *conn)
+{
+    gint i;
+
+    for (i = 0; i < N_STMTS; i++) {
+        sqlite3_finalize (conn->stmts[i]);
+        conn->stmts[i] = NULL;
+    }
+    if (conn->db)
+        sqlite3_close (conn->db);
+    conn->db = NULL;
+}
+
 static void
 yelp_sqlite_storage_finalize (GObject *object)
 {
@@ -77,10 +548,24 @@ yelp_sqlite_storage_finalize (GObject *object)
     if (priv->filename)
         g_free (priv->filename);
 
-    if (priv->db)
-        sqlite3_close (priv->db);
+    sqlite_connection_close (&priv->writer);
+    while (priv->readers) {
+        sqlite_connection_close (priv->readers->data);
+        g_free (priv->readers->data);
+        priv->readers = g_slist_delete_link (priv->readers, priv->readers);
+    }
 
+    g_hash_table_destroy (priv->batches);
+    g_hash_table_destroy (priv->cleared);
+    g_hash_table_destroy (priv->failed);
     g_mutex_clear (&priv->mutex);
+    g_mutex_clear (&priv->readers_mutex);
+
+    g_free (priv->last.doc_uri);
+    g_strfreev (priv->last.words);
+    if (priv->last.results)
+        g_variant_unref (priv->last.results);
+    g_mutex_clear (&priv->last_mutex);
 
     G_OBJECT_CLASS (yelp_sqlite_storage_parent_class)->finalize (object);
 }
@@ -89,42 +574,171 @@ static void
 yelp_sqlite_storage_init (YelpSqliteStorage *storage)
 {
     YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+    priv->batches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    priv->cleared = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    priv->failed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
     g_mutex_init (&priv->mutex);
+    g_mutex_init (&priv->readers_mutex);
+    g_mutex_init (&priv->last_mutex);
 }
 
-static void
-yelp_sqlite_storage_constructed (GObject *object)
+/* Opens the writer on priv->filename and sets up the tables. Returns the
+ * SQLite status of the first step that failed, with the writer closed
+ * again, or SQLITE_OK.
+ */
+static gint
+sqlite_storage_setup (YelpSqliteStoragePrivate *priv)
 {
     int status;
+    gint version = 0;
+    guint i;
     sqlite3_stmt *stmt = NULL;
-    YelpSqliteStoragePrivate *priv = GET_PRIV (object);
+    gchar *sql;
+    sqlite3 *db;
 
-    if (priv->filename != NULL)
-        status = sqlite3_open (priv->filename, &(priv->db));
-    else
-        status = sqlite3_open (":memory:", &(priv->db));
+    priv->wal = FALSE;
+    if (!sqlite_connection_open (&priv->writer, priv->filename,
+                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                                 priv->analyzer))
+        return SQLITE_CANTOPEN;
+    db = priv->writer.db;
 
-    if (status != SQLITE_OK)
-        return;
+    if (!g_str_equal (priv->filename, ":memory:")) {
+        status = sqlite3_prepare_v2 (db, "pragma journal_mode = wal;", -1, &stmt, NULL);
+        if (status != SQLITE_OK)
+            goto fail;
+        status = sqlite3_step (stmt);
+        if (status == SQLITE_ROW)
+            priv->wal = !g_ascii_strcasecmp ((const gchar *) sqlite3_column_text (stmt, 0),
+                                             "wal");
+        sqlite3_finalize (stmt);
+        if (status != SQLITE_ROW && status != SQLITE_DONE)
+            goto fail;
+        /* Losing the last few commits to a crash is fine for a cache */
+        if (priv->wal)
+            sqlite3_exec (db, "pragma synchronous = normal;", NULL, NULL, NULL);
+    }
 
-    status = sqlite3_prepare_v2 (priv->db,
-                                 "create virtual table pages using fts4("
-                                 " doc_uri, lang, full_uri,"
-                                 " title, desc, icon, body"
-                                 ");",
-                                 -1, &stmt, NULL);
+    status = sqlite3_exec (db, "begin immediate;", NULL, NULL, NULL);
     if (status != SQLITE_OK)
-        return;
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+        goto fail;
+
+    status = sqlite3_prepare_v2 (db, "pragma user_version;", -1, &stmt, NULL);
+    if (status == SQLITE_OK) {
+        if (sqlite3_step (stmt) == SQLITE_ROW)
+            version = sqlite3_column_int (stmt, 0);
+        status = sqlite3_finalize (stmt);
+    }
+
+    if (status == SQLITE_OK && version != SCHEMA_VERSION) {
+        for (i = 0; status == SQLITE_OK && i < G_N_ELEMENTS (analyzers); i++) {
+            sql = g_strdup_printf ("drop table if exists %s;", analyzers[i].table);
+            status = sqlite3_exec (db, sql, NULL, NULL, NULL);
+            g_free (sql);
+        }
+        if (status == SQLITE_OK)
+            status = sqlite3_exec (db,
+                                   "drop table if exists pages;"
+                                   "drop table if exists titles;"
+                                   "drop table if exists sources;"
+                                   "create table titles (doc_uri text, lang text, title text);"
+                                   "create table sources (doc_uri text, lang text, mtime integer,"
+                                   " primary key (doc_uri, lang));"
+                                   "pragma user_version = " G_STRINGIFY (SCHEMA_VERSION) ";",
+                                   NULL, NULL, NULL);
+    }
 
-    status = sqlite3_prepare_v2 (priv->db,
-                                 "create table titles (doc_uri text, lang text, title text);",
-                                 -1, &stmt, NULL);
+    /* Each analyzer's table is made the first time yelp runs in a language
+     * that uses it. Pages indexed for other languages stay where they are.
+     */
+    if (status == SQLITE_OK) {
+        sql = g_strdup_printf ("create virtual table if not exists %s using fts4("
+                               " doc_uri, lang, full_uri,"
+                               " title, desc, icon, body,"
+                               " notindexed=doc_uri, notindexed=lang,"
+                               " notindexed=full_uri, notindexed=icon,"
+                               " prefix=\"2,3,4\", tokenize=%s,"
+                               " compress=yelp_compress, uncompress=yelp_uncompress"
+                               ");",
+                               priv->analyzer->table, priv->analyzer->tokenize);
+        status = sqlite3_exec (db, sql, NULL, NULL, NULL);
+        g_free (sql);
+    }
+
+    if (status == SQLITE_OK)
+        status = sqlite3_exec (db, "commit;", NULL, NULL, NULL);
+    if (status != SQLITE_OK) {
+        sqlite3_exec (db, "rollback;", NULL, NULL, NULL);
+        goto fail;
+    }
+
+    /* Pages in a batch wait here until it is committed. Temporary tables
+     * belong to the connection, so this starts out empty every time, and
+     * keeping it in a file bounds the memory a large batch takes.
+     */
+    status = sqlite3_exec (db,
+                           "pragma temp_store = file;"
+                           "create temp table staged (doc_uri text, full_uri text,"
+                           " title text, desc text, icon text, body text);"
+                           "create index temp.staged_doc_uri on staged (doc_uri);",
+                           NULL, NULL, NULL);
     if (status != SQLITE_OK)
+        goto fail;
+
+    return SQLITE_OK;
+
+ fail:
+    sqlite_connection_close (&priv->writer);
+    priv->wal = FALSE;
+    return status;
+}
+
+static void
+sqlite_storage_unlink (const gchar *filename)
+{
+    static const gchar *suffixes[] = { "", "-wal", "-shm", "-journal", NULL };
+    gint i;
+
+    for (i = 0; suffixes[i]; i++) {
+        gchar *path = g_strconcat (filename, suffixes[i], NULL);
+        g_unlink (path);
+        g_free (path);
+    }
+}
+
+/* The database is only a cache, so one that can't be used is thrown out
+ * and made again. Failing that, pages are indexed in memory for this run.
+ * A database that is just busy belongs to another instance, and is left
+ * alone.
+ */
+static void
+yelp_sqlite_storage_constructed (GObject *object)
+{
+    gint status;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (object);
+
+    if (priv->filename == NULL)
+        priv->filename = g_strdup (":memory:");
+
+    priv->analyzer = sqlite_storage_pick_analyzer (g_get_language_names()[0]);
+    status = sqlite_storage_setup (priv);
+    if (status == SQLITE_OK || g_str_equal (priv->filename, ":memory:"))
         return;
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+
+    if (status != SQLITE_BUSY && status != SQLITE_LOCKED) {
+        g_warning ("Could not open the search index %s, making it again: %s",
+                   priv->filename, sqlite3_errstr (status));
+        sqlite_storage_unlink (priv->filename);
+        status = sqlite_storage_setup (priv);
+        if (status == SQLITE_OK)
+            return;
+    }
+
+    g_warning ("Could not open the search index %s, keeping it in memory: %s",
+               priv->filename, sqlite3_errstr (status));
+    g_free (priv->filename);
+    priv->filename = g_strdup (":memory:");
+    sqlite_storage_setup (priv);
 }
 
 static void
@@ -154,8 +768,16 @@ yelp_sqlite_storage_iface_init (YelpStorageInterface *iface)
 {
     iface->update = yelp_sqlite_storage_update;
     iface->search = yelp_sqlite_storage_search;
+    iface->search_all = yelp_sqlite_storage_search_all;
+    iface->search_incremental = yelp_sqlite_storage_search_incremental;
+    iface->list_pages = yelp_sqlite_storage_list_pages;
     iface->get_root_title = yelp_sqlite_storage_get_root_title;
     iface->set_root_title = yelp_sqlite_storage_set_root_title;
+    iface->begin_batch = yelp_sqlite_storage_begin_batch;
+    iface->commit_batch = yelp_sqlite_storage_commit_batch;
+    iface->get_mtime = yelp_sqlite_storage_get_mtime;
+    iface->set_mtime = yelp_sqlite_storage_set_mtime;
+    iface->clear = yelp_sqlite_storage_clear;
 }
 
 YelpStorage *
@@ -208,6 +830,194 @@ yelp_sqlite_storage_set_property (GObject      *object,
 
 /******************************************************************************/
 
+/* Returns the statement reset and ready to bind. The caller must own conn,
+ * either by holding priv->mutex for the writer or by having taken it from
+ * the pool of readers.
+ */
+static sqlite3_stmt *
+sqlite_connection_get_stmt (SqliteConnection *conn,
+                            gint              which)
+{
+    sqlite3_stmt *stmt;
+
+    if (conn->stmts[which] == NULL && conn->db != NULL) {
+        gchar **parts = g_strsplit (stmt_sql[which], "{pages}", -1);
+        gchar *sql = g_strjoinv (conn->analyzer->table, parts);
+        sqlite3_prepare_v2 (conn->db, sql, -1, &(conn->stmts[which]), NULL);
+        g_free (sql);
+        g_strfreev (parts);
+    }
+
+    stmt = conn->stmts[which];
+    if (stmt != NULL) {
+        sqlite3_reset (stmt);
+        sqlite3_clear_bindings (stmt);
+    }
+    return stmt;
+}
+
+/* Returns a connection to run queries on. Release it with
+ * sqlite_storage_release_reader when done.
+ */
+static SqliteConnection *
+sqlite_storage_get_reader (YelpSqliteStoragePrivate *priv)
+{
+    SqliteConnection *conn = NULL;
+
+    if (priv->wal) {
+        g_mutex_lock (&priv->readers_mutex);
+        if (priv->readers) {
+            conn = priv->readers->data;
+            priv->readers = g_slist_delete_link (priv->readers, priv->readers);
+        }
+        g_mutex_unlock (&priv->readers_mutex);
+
+        if (conn == NULL) {
+            conn = g_new0 (SqliteConnection, 1);
+            if (!sqlite_connection_open (conn, priv->filename, SQLITE_OPEN_READONLY,
+                                         priv->analyzer)) {
+                g_free (conn);
+                conn = NULL;
+            }
+        }
+        if (conn != NULL)
+            return conn;
+    }
+
+    g_mutex_lock (&priv->mutex);
+    return &priv->writer;
+}
+
+static void
+sqlite_storage_release_reader (YelpSqliteStoragePrivate *priv,
+                               SqliteConnection         *conn)
+{
+    if (conn == &priv->writer) {
+        g_mutex_unlock (&priv->mutex);
+        return;
+    }
+
+    g_mutex_lock (&priv->readers_mutex);
+    priv->readers = g_slist_prepend (priv->readers, conn);
+    g_mutex_unlock (&priv->readers_mutex);
+}
+
+/* Called with priv->mutex held, whenever the pages table changes */
+static void
+sqlite_storage_forget_last (YelpSqliteStoragePrivate *priv)
+{
+    g_mutex_lock (&priv->last_mutex);
+    if (priv->last.results)
+        g_variant_unref (priv->last.results);
+    priv->last.results = NULL;
+    g_mutex_unlock (&priv->last_mutex);
+}
+
+/* Runs a statement on the writer that returns no rows, and resets it.
+ * Called with priv->mutex held. Returns FALSE and logs why on failure.
+ */
+static gboolean
+sqlite_storage_exec (YelpSqliteStoragePrivate *priv,
+                     sqlite3_stmt             *stmt)
+{
+    gint status;
+
+    if (stmt == NULL)
+        return FALSE;
+
+    status = sqlite3_step (stmt);
+    if (status != SQLITE_DONE)
+        g_warning ("Could not update the search index in %s: %s",
+                   priv->filename, sqlite3_errmsg (priv->writer.db));
+    sqlite3_reset (stmt);
+    return status == SQLITE_DONE;
+}
+
+/* Called with priv->mutex held */
+static gboolean
+sqlite_storage_write_page (YelpSqliteStoragePrivate *priv,
+                           const gchar              *doc_uri,
+                           SqlitePage               *page)
+{
+    sqlite3_stmt *stmt;
+
+    /* Deleting by full_uri scans the whole table, as FTS only indexes
+     * the text columns. Reindexing right after a clear doesn't need it.
+     */
+    if (!g_hash_table_contains (priv->cleared, doc_uri)) {
+        stmt = sqlite_connection_get_stmt (&priv->writer, STMT_PAGES_DELETE);
+        sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 3, page->full_uri, -1, SQLITE_STATIC);
+        if (!sqlite_storage_exec (priv, stmt))
+            return FALSE;
+    }
+
+    stmt = sqlite_connection_get_stmt (&priv->writer, STMT_PAGES_INSERT);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 3, page->full_uri, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 4, page->title, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 5, page->desc, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 6, page->icon, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 7, page->body, -1, SQLITE_STATIC);
+    return sqlite_storage_exec (priv, stmt);
+}
+
+/* Called with priv->mutex held */
+static gboolean
+sqlite_storage_stage_page (YelpSqliteStoragePrivate *priv,
+                           const gchar              *doc_uri,
+                           SqlitePage               *page)
+{
+    sqlite3_stmt *stmt;
+
+    stmt = sqlite_connection_get_stmt (&priv->writer, STMT_STAGED_INSERT);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, page->full_uri, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 3, page->title, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 4, page->desc, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 5, page->icon, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 6, page->body, -1, SQLITE_STATIC);
+    return sqlite_storage_exec (priv, stmt);
+}
+
+/* Called with priv->mutex held, in the transaction of a batch commit.
+ * Moves the pages staged for doc_uri into the pages table.
+ */
+static gboolean
+sqlite_storage_write_staged (YelpSqliteStoragePrivate *priv,
+                             const gchar              *doc_uri)
+{
+    sqlite3_stmt *stmt;
+    gint status;
+
+    stmt = sqlite_connection_get_stmt (&priv->writer, STMT_STAGED_SELECT);
+    if (stmt == NULL)
+        return FALSE;
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+
+    while ((status = sqlite3_step (stmt)) == SQLITE_ROW) {
+        SqlitePage page;
+
+        page.full_uri = (const gchar *) sqlite3_column_text (stmt, 0);
+        page.title = (const gchar *) sqlite3_column_text (stmt, 1);
+        page.desc = (const gchar *) sqlite3_column_text (stmt, 2);
+        page.icon = (const gchar *) sqlite3_column_text (stmt, 3);
+        page.body = (const gchar *) sqlite3_column_text (stmt, 4);
+        if (!sqlite_storage_write_page (priv, doc_uri, &page)) {
+            sqlite3_reset (stmt);
+            return FALSE;
+        }
+    }
+    if (status != SQLITE_DONE)
+        g_warning ("Could not update the search index in %s: %s",
+                   priv->filename, sqlite3_errmsg (priv->writer.db));
+    sqlite3_reset (stmt);
+
+    return status == SQLITE_DONE;
+}
+
 static void
 yelp_sqlite_storage_update (YelpStorage   *storage,
                             const gchar   *doc_uri,
@@ -217,93 +1027,423 @@ yelp_sqlite_storage_update (YelpStorage   *storage,
                             const gchar   *icon,
                             const gchar   *text)
 {
-    sqlite3_stmt *stmt = NULL;
+    SqliteBatch *batch;
+    SqlitePage page;
+    gchar *seg_title, *seg_desc, *seg_body;
     YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
 
+    seg_title = sqlite_storage_segment (priv->analyzer, title);
+    seg_desc = sqlite_storage_segment (priv->analyzer, desc);
+    seg_body = sqlite_storage_segment (priv->analyzer, text);
+    page.full_uri = full_uri;
+    page.title = seg_title;
+    page.desc = seg_desc;
+    page.icon = icon;
+    page.body = seg_body;
+
     g_mutex_lock (&priv->mutex);
 
-    sqlite3_prepare_v2 (priv->db,
-                        "delete from pages where doc_uri = ? and lang = ? and full_uri = ?;",
-                        -1, &stmt, NULL);
-    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
-    sqlite3_bind_text (stmt, 3, full_uri, -1, SQLITE_TRANSIENT);
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
-
-    sqlite3_prepare_v2 (priv->db,
-                        "insert into pages (doc_uri, lang, full_uri, title, desc, icon, body)"
-                        " values (?, ?, ?, ?, ?, ?, ?);",
-                        -1, &stmt, NULL);
-    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
-    sqlite3_bind_text (stmt, 3, full_uri, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 4, title, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 5, desc, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 6, icon, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text (stmt, 7, text, -1, SQLITE_TRANSIENT);
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+    batch = g_hash_table_lookup (priv->batches, doc_uri);
+    if (batch != NULL) {
+        if (!batch->failed)
+            batch->failed = !sqlite_storage_stage_page (priv, doc_uri, &page);
+    }
+    else {
+        sqlite_storage_forget_last (priv);
+        sqlite_storage_write_page (priv, doc_uri, &page);
+    }
 
     g_mutex_unlock (&priv->mutex);
+
+    g_free (seg_title);
+    g_free (seg_desc);
+    g_free (seg_body);
 }
 
 static GVariant *
 yelp_sqlite_storage_search (YelpStorage   *storage,
                             const gchar   *doc_uri,
-                            const gchar   *text)
+                            const gchar   *text,
+                            gint           offset,
+                            gint           limit)
 {
-    sqlite3_stmt *stmt = NULL;
+    SqliteConnection *conn;
+    sqlite3_stmt *stmt;
     GVariantBuilder builder;
     GVariant *ret;
+    gchar *query;
     YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
 
-    g_mutex_lock (&priv->mutex);
+    query = sqlite_storage_segment (priv->analyzer, text);
+    conn = sqlite_storage_get_reader (priv);
+
+    stmt = sqlite_connection_get_stmt (conn, STMT_PAGES_SEARCH);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 3, query, -1, SQLITE_STATIC);
+    sqlite3_bind_int (stmt, 4, limit);
+    sqlite3_bind_int (stmt, 5, MAX (offset, 0));
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sssss)"));
+    while (sqlite3_step (stmt) == SQLITE_ROW) {
+        gchar *title = sqlite_storage_unsegment_column (priv->analyzer,
+                                                        (const gchar *) sqlite3_column_text (stmt, 1));
+        gchar *desc = sqlite_storage_unsegment_column (priv->analyzer,
+                                                       (const gchar *) sqlite3_column_text (stmt, 2));
+        gchar *snippet = sqlite_storage_unsegment (priv->analyzer,
+                                                   (const gchar *) sqlite3_column_text (stmt, 4));
+        g_variant_builder_add (&builder, "(sssss)",
+                               sqlite3_column_text (stmt, 0),
+                               title,
+                               desc,
+                               sqlite3_column_text (stmt, 3),
+                               snippet);
+        g_free (title);
+        g_free (desc);
+        g_free (snippet);
+    }
+    sqlite3_reset (stmt);
+    ret = g_variant_new ("a(sssss)", &builder);
+
+    sqlite_storage_release_reader (priv, conn);
+    g_free (query);
+
+    return ret;
+}
+
+typedef struct {
+    const gchar     *doc_uri;
+    const gchar     *title;
+    GVariantBuilder *pages;
+} SearchGroup;
+
+static GVariant *
+yelp_sqlite_storage_search_all (YelpStorage   *storage,
+                                const gchar   *text,
+                                gint           offset,
+                                gint           limit)
+{
+    SqliteConnection *conn;
+    sqlite3_stmt *stmt;
+    GVariantBuilder builder;
+    GHashTable *groups;
+    GPtrArray *order;
+    GStringChunk *strings;
+    GVariant *ret;
+    gchar *query;
+    guint i;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    /* Group URIs and titles are copied here, since the row they came
+     * from is gone after the next step.
+     */
+    strings = g_string_chunk_new (256);
+    groups = g_hash_table_new (g_str_hash, g_str_equal);
+    order = g_ptr_array_new ();
+
+    query = sqlite_storage_segment (priv->analyzer, text);
+    conn = sqlite_storage_get_reader (priv);
+
+    stmt = sqlite_connection_get_stmt (conn, STMT_PAGES_SEARCH_ALL);
+    sqlite3_bind_text (stmt, 1, g_get_language_names()[0], -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, query, -1, SQLITE_STATIC);
+    sqlite3_bind_int (stmt, 3, limit);
+    sqlite3_bind_int (stmt, 4, MAX (offset, 0));
+
+    while (sqlite3_step (stmt) == SQLITE_ROW) {
+        const gchar *doc_uri = (const gchar *) sqlite3_column_text (stmt, 0);
+        SearchGroup *group;
+        gchar *title, *desc, *snippet;
+
+        if (doc_uri == NULL)
+            continue;
+        group = g_hash_table_lookup (groups, doc_uri);
+        if (group == NULL) {
+            const gchar *title = (const gchar *) sqlite3_column_text (stmt, 1);
+            group = g_new0 (SearchGroup, 1);
+            group->doc_uri = g_string_chunk_insert (strings, doc_uri);
+            group->title = g_string_chunk_insert (strings, title ? title : "");
+            group->pages = g_variant_builder_new (G_VARIANT_TYPE ("a(sssss)"));
+            g_hash_table_insert (groups, (gpointer) group->doc_uri, group);
+            g_ptr_array_add (order, group);
+        }
+        title = sqlite_storage_unsegment_column (priv->analyzer,
+                                                 (const gchar *) sqlite3_column_text (stmt, 3));
+        desc = sqlite_storage_unsegment_column (priv->analyzer,
+                                                (const gchar *) sqlite3_column_text (stmt, 4));
+        snippet = sqlite_storage_unsegment (priv->analyzer,
+                                            (const gchar *) sqlite3_column_text (stmt, 6));
+        g_variant_builder_add (group->pages, "(sssss)",
+                               sqlite3_column_text (stmt, 2),
+                               title,
+                               desc,
+                               sqlite3_column_text (stmt, 5),
+                               snippet);
+        g_free (title);
+        g_free (desc);
+        g_free (snippet);
+    }
+    sqlite3_reset (stmt);
+
+    sqlite_storage_release_reader (priv, conn);
+    g_free (query);
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssa(sssss))"));
+    for (i = 0; i < order->len; i++) {
+        SearchGroup *group = g_ptr_array_index (order, i);
+        g_variant_builder_add (&builder, "(ssa(sssss))",
+                               group->doc_uri, group->title, group->pages);
+        g_variant_builder_unref (group->pages);
+        g_free (group);
+    }
+    ret = g_variant_new ("a(ssa(sssss))", &builder);
+
+    g_ptr_array_free (order, TRUE);
+    g_hash_table_destroy (groups);
+    g_string_chunk_free (strings);
+
+    return ret;
+}
+
+/* Splits text into the words FTS will see, dropping anything that could
+ * be taken for query syntax.
+ */
+static gchar **
+sqlite_storage_split_words (const gchar *text)
+{
+    GPtrArray *words = g_ptr_array_new ();
+    const gchar *cur, *start = NULL;
+
+    for (cur = text; ; cur = g_utf8_next_char (cur)) {
+        gunichar c = g_utf8_get_char (cur);
+        if (c != 0 && g_unichar_isalnum (c)) {
+            if (start == NULL)
+                start = cur;
+            continue;
+        }
+        if (start != NULL) {
+            g_ptr_array_add (words, g_utf8_strdown (start, cur - start));
+            start = NULL;
+        }
+        if (c == 0)
+            break;
+    }
+    g_ptr_array_add (words, NULL);
+
+    return (gchar **) g_ptr_array_free (words, FALSE);
+}
+
+/* Whether every match for new_words is also a match for old_words */
+static gboolean
+sqlite_storage_words_narrow (gchar    **old_words,
+                             gboolean   old_prefix,
+                             gchar    **new_words)
+{
+    gint i;
+
+    for (i = 0; old_words[i] != NULL; i++) {
+        if (new_words[i] == NULL)
+            return FALSE;
+        if (old_prefix && old_words[i + 1] == NULL) {
+            if (!g_str_has_prefix (new_words[i], old_words[i]))
+                return FALSE;
+        }
+        else if (!g_str_equal (new_words[i], old_words[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean
+sqlite_storage_words_equal (gchar **words1,
+                            gchar **words2)
+{
+    gint i;
+
+    for (i = 0; words1[i] != NULL && words2[i] != NULL; i++) {
+        if (!g_str_equal (words1[i], words2[i]))
+            return FALSE;
+    }
+    return words1[i] == NULL && words2[i] == NULL;
+}
+
+static GVariant *
+yelp_sqlite_storage_search_incremental (YelpStorage   *storage,
+                                        const gchar   *doc_uri,
+                                        const gchar   *text,
+                                        gint           limit)
+{
+    SqliteConnection *conn;
+    sqlite3_stmt *stmt;
+    GVariantBuilder builder;
+    GVariant *ret = NULL;
+    GString *query;
+    gchar **words;
+    gboolean prefix, narrow;
+    gint64 min_docid = 0, max_docid = G_MAXINT64;
+    gint i, count = 0;
+    gchar *segmented;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    segmented = sqlite_storage_segment (priv->analyzer, text);
+    words = sqlite_storage_split_words (segmented);
+    g_free (segmented);
+
+    /* A trailing space means the last word is finished. Look at the text
+     * as typed, since segmenting puts a space after every CJK bigram; an
+     * unfinished CJK run then matches on its last bigram, or on a lone
+     * character as the start of a bigram.
+     */
+    prefix = (text[0] != '\0' && g_unichar_isalnum (g_utf8_get_char (g_utf8_prev_char (text + strlen (text)))));
+    if (words[0] == NULL) {
+        g_strfreev (words);
+        return g_variant_new_array (G_VARIANT_TYPE ("(ssss)"), NULL, 0);
+    }
+
+    /* Adding letters or words only ever drops results. If the last
+     * search wasn't cut short by its limit, this one can only find pages
+     * it found, so we can look in just their range of docids. If it found
+     * nothing, there's nothing to look for.
+     */
+    g_mutex_lock (&priv->last_mutex);
+    narrow = (priv->last.results != NULL &&
+              limit <= priv->last.limit &&
+              g_strcmp0 (doc_uri, priv->last.doc_uri) == 0 &&
+              (gint) g_variant_n_children (priv->last.results) < priv->last.limit &&
+              sqlite_storage_words_narrow (priv->last.words, priv->last.prefix, words));
+    if (narrow) {
+        if (g_variant_n_children (priv->last.results) == 0 ||
+            (prefix == priv->last.prefix &&
+             sqlite_storage_words_equal (words, priv->last.words)))
+            ret = g_variant_ref (priv->last.results);
+        min_docid = priv->last.min_docid;
+        max_docid = priv->last.max_docid;
+    }
+    g_mutex_unlock (&priv->last_mutex);
 
-    sqlite3_prepare_v2 (priv->db,
-                        "select full_uri, title, desc, icon from pages where"
-                        " doc_uri = ? and lang = ? and body match ?;",
-                        -1, &stmt, NULL);
-    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_TRANSIENT);
+    if (ret != NULL) {
+        g_strfreev (words);
+        return ret;
+    }
+
+    query = g_string_new (NULL);
+    for (i = 0; words[i] != NULL; i++) {
+        g_string_append_printf (query, "%s\"%s%s\"",
+                                i > 0 ? " " : "", words[i],
+                                prefix && words[i + 1] == NULL ? "*" : "");
+    }
+
+    conn = sqlite_storage_get_reader (priv);
+
+    stmt = sqlite_connection_get_stmt (conn, STMT_PAGES_SEARCH_RANGE);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
     sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
-    sqlite3_bind_text (stmt, 3, text, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text (stmt, 3, query->str, -1, SQLITE_STATIC);
+    sqlite3_bind_int64 (stmt, 4, min_docid);
+    sqlite3_bind_int64 (stmt, 5, max_docid);
+    sqlite3_bind_int (stmt, 6, limit);
 
+    min_docid = G_MAXINT64;
+    max_docid = 0;
     g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssss)"));
     while (sqlite3_step (stmt) == SQLITE_ROW) {
+        gint64 docid = sqlite3_column_int64 (stmt, 0);
+        gchar *title = sqlite_storage_unsegment_column (priv->analyzer,
+                                                        (const gchar *) sqlite3_column_text (stmt, 2));
+        gchar *desc = sqlite_storage_unsegment_column (priv->analyzer,
+                                                       (const gchar *) sqlite3_column_text (stmt, 3));
+        min_docid = MIN (min_docid, docid);
+        max_docid = MAX (max_docid, docid);
         g_variant_builder_add (&builder, "(ssss)",
-                               sqlite3_column_text (stmt, 0),
                                sqlite3_column_text (stmt, 1),
-                               sqlite3_column_text (stmt, 2),
-                               sqlite3_column_text (stmt, 3));
+                               title,
+                               desc,
+                               sqlite3_column_text (stmt, 4));
+        g_free (title);
+        g_free (desc);
+        count++;
     }
-    sqlite3_finalize (stmt);
-    ret = g_variant_new ("a(ssss)", &builder);
+    sqlite3_reset (stmt);
 
-    g_mutex_unlock (&priv->mutex);
+    sqlite_storage_release_reader (priv, conn);
+    g_string_free (query, TRUE);
+
+    ret = g_variant_ref_sink (g_variant_new ("a(ssss)", &builder));
+
+    g_mutex_lock (&priv->last_mutex);
+    g_free (priv->last.doc_uri);
+    g_strfreev (priv->last.words);
+    if (priv->last.results)
+        g_variant_unref (priv->last.results);
+    priv->last.doc_uri = g_strdup (doc_uri);
+    priv->last.words = words;
+    priv->last.prefix = prefix;
+    priv->last.limit = limit;
+    priv->last.results = g_variant_ref (ret);
+    priv->last.min_docid = min_docid;
+    priv->last.max_docid = max_docid;
+    g_mutex_unlock (&priv->last_mutex);
 
     return ret;
 }
 
+static GVariant *
+yelp_sqlite_storage_list_pages (YelpStorage *storage)
+{
+    SqliteConnection *conn;
+    sqlite3_stmt *stmt;
+    GVariantBuilder builder;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    conn = sqlite_storage_get_reader (priv);
+
+    stmt = sqlite_connection_get_stmt (conn, STMT_PAGES_LIST);
+    sqlite3_bind_text (stmt, 1, g_get_language_names()[0], -1, SQLITE_STATIC);
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sssss)"));
+    while (sqlite3_step (stmt) == SQLITE_ROW) {
+        const gchar *cols[5];
+        gchar *title, *desc;
+        gint i;
+
+        for (i = 0; i < 5; i++) {
+            cols[i] = (const gchar *) sqlite3_column_text (stmt, i);
+            if (cols[i] == NULL)
+                cols[i] = "";
+        }
+        title = sqlite_storage_unsegment_column (priv->analyzer, cols[2]);
+        desc = sqlite_storage_unsegment_column (priv->analyzer, cols[3]);
+        g_variant_builder_add (&builder, "(sssss)",
+                               cols[0], cols[1], title, desc, cols[4]);
+        g_free (title);
+        g_free (desc);
+    }
+    sqlite3_reset (stmt);
+
+    sqlite_storage_release_reader (priv, conn);
+
+    return g_variant_new ("a(sssss)", &builder);
+}
+
 static gchar *
 yelp_sqlite_storage_get_root_title (YelpStorage *storage,
                                     const gchar *doc_uri)
 {
     gchar *ret = NULL;
-    sqlite3_stmt *stmt = NULL;
+    SqliteConnection *conn;
+    sqlite3_stmt *stmt;
     YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
 
-    g_mutex_lock (&priv->mutex);
+    conn = sqlite_storage_get_reader (priv);
 
-    sqlite3_prepare_v2 (priv->db,
-                        "select title from titles where doc_uri = ? and lang = ?;",
-                        -1, &stmt, NULL);
-    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_TRANSIENT);
+    stmt = sqlite_connection_get_stmt (conn, STMT_TITLES_SELECT);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
     sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
     if (sqlite3_step (stmt) == SQLITE_ROW)
         ret = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
-    sqlite3_finalize (stmt);
+    sqlite3_reset (stmt);
 
-    g_mutex_unlock (&priv->mutex);
+    sqlite_storage_release_reader (priv, conn);
     return ret;
 }
 
@@ -312,28 +1452,165 @@ yelp_sqlite_storage_set_root_title (YelpStorage *storage,
                                     const gchar *doc_uri,
                                     const gchar *title)
 {
-    sqlite3_stmt *stmt = NULL;
+    sqlite3_stmt *stmt;
     YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
 
     g_mutex_lock (&priv->mutex);
 
-    sqlite3_prepare_v2 (priv->db,
-                        "delete from titles where doc_uri = ? and lang = ?;",
-                        -1, &stmt, NULL);
-    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_TRANSIENT);
+    stmt = sqlite_connection_get_stmt (&priv->writer, STMT_TITLES_DELETE);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
     sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
-
-    sqlite3_prepare_v2 (priv->db,
-                        "insert into titles (doc_uri, lang, title)"
-                        " values (?, ?, ?);",
-                        -1, &stmt, NULL);
-    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_TRANSIENT);
+    if (sqlite_storage_exec (priv, stmt)) {
+        stmt = sqlite_connection_get_stmt (&priv->writer, STMT_TITLES_INSERT);
+        sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 3, title, -1, SQLITE_STATIC);
+        sqlite_storage_exec (priv, stmt);
+    }
+
+    g_mutex_unlock (&priv->mutex);
+}
+
+/* Indexers for different documents share the one writer connection. So
+ * that one of them can't hold a transaction open while others run, pages
+ * in a batch are staged in a temporary table as they come, and moved to
+ * the pages table in a transaction of their own when the batch is
+ * committed. If any of them fails, none of them make it.
+ */
+static void
+yelp_sqlite_storage_begin_batch (YelpStorage *storage,
+                                 const gchar *doc_uri)
+{
+    SqliteBatch *batch;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    g_mutex_lock (&priv->mutex);
+    batch = g_hash_table_lookup (priv->batches, doc_uri);
+    if (batch == NULL) {
+        batch = g_new0 (SqliteBatch, 1);
+        g_hash_table_insert (priv->batches, g_strdup (doc_uri), batch);
+    }
+    batch->depth++;
+    g_mutex_unlock (&priv->mutex);
+}
+
+static void
+yelp_sqlite_storage_commit_batch (YelpStorage *storage,
+                                  const gchar *doc_uri)
+{
+    SqliteBatch *batch;
+    sqlite3_stmt *stmt;
+    gboolean ok;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    g_mutex_lock (&priv->mutex);
+    batch = g_hash_table_lookup (priv->batches, doc_uri);
+    if (batch == NULL || --batch->depth > 0) {
+        g_mutex_unlock (&priv->mutex);
+        return;
+    }
+
+    sqlite_storage_forget_last (priv);
+
+    ok = (!batch->failed &&
+          sqlite_storage_exec (priv, sqlite_connection_get_stmt (&priv->writer, STMT_BEGIN)));
+    if (ok)
+        ok = sqlite_storage_write_staged (priv, doc_uri);
+    if (ok)
+        ok = sqlite_storage_exec (priv, sqlite_connection_get_stmt (&priv->writer, STMT_COMMIT));
+
+    g_hash_table_remove (priv->failed, doc_uri);
+    if (!ok) {
+        /* A failed COMMIT leaves the transaction open */
+        if (!sqlite3_get_autocommit (priv->writer.db))
+            sqlite_storage_exec (priv, sqlite_connection_get_stmt (&priv->writer, STMT_ROLLBACK));
+        /* Don't let set_mtime mark the document as indexed */
+        g_hash_table_add (priv->failed, g_strdup (doc_uri));
+    }
+
+    stmt = sqlite_connection_get_stmt (&priv->writer, STMT_STAGED_DELETE);
+    if (stmt != NULL) {
+        sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+        sqlite_storage_exec (priv, stmt);
+    }
+
+    /* Pages updated from now on may already be there */
+    g_hash_table_remove (priv->cleared, doc_uri);
+    g_hash_table_remove (priv->batches, doc_uri);
+    g_mutex_unlock (&priv->mutex);
+}
+
+static gint64
+yelp_sqlite_storage_get_mtime (YelpStorage *storage,
+                               const gchar *doc_uri)
+{
+    gint64 ret = 0;
+    SqliteConnection *conn;
+    sqlite3_stmt *stmt;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    conn = sqlite_storage_get_reader (priv);
+
+    stmt = sqlite_connection_get_stmt (conn, STMT_SOURCES_SELECT);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
     sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
-    sqlite3_bind_text (stmt, 3, title, -1, SQLITE_TRANSIENT);
-    sqlite3_step (stmt);
-    sqlite3_finalize (stmt);
+    if (sqlite3_step (stmt) == SQLITE_ROW)
+        ret = sqlite3_column_int64 (stmt, 0);
+    sqlite3_reset (stmt);
+
+    sqlite_storage_release_reader (priv, conn);
+    return ret;
+}
+
+static void
+yelp_sqlite_storage_set_mtime (YelpStorage *storage,
+                               const gchar *doc_uri,
+                               gint64       mtime)
+{
+    sqlite3_stmt *stmt;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    g_mutex_lock (&priv->mutex);
+
+    /* Index the document again next time */
+    if (g_hash_table_remove (priv->failed, doc_uri)) {
+        g_mutex_unlock (&priv->mutex);
+        return;
+    }
+
+    stmt = sqlite_connection_get_stmt (&priv->writer, STMT_SOURCES_UPDATE);
+    sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+    sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
+    sqlite3_bind_int64 (stmt, 3, mtime);
+    sqlite_storage_exec (priv, stmt);
+
+    g_mutex_unlock (&priv->mutex);
+}
+
+static void
+yelp_sqlite_storage_clear (YelpStorage *storage,
+                           const gchar *doc_uri)
+{
+    static const gint clear_stmts[] = {
+        STMT_SOURCES_DELETE, STMT_PAGES_CLEAR, STMT_TITLES_DELETE
+    };
+    sqlite3_stmt *stmt;
+    guint i;
+    YelpSqliteStoragePrivate *priv = GET_PRIV (storage);
+
+    g_mutex_lock (&priv->mutex);
+
+    sqlite_storage_forget_last (priv);
+
+    for (i = 0; i < G_N_ELEMENTS (clear_stmts); i++) {
+        stmt = sqlite_connection_get_stmt (&priv->writer, clear_stmts[i]);
+        sqlite3_bind_text (stmt, 1, doc_uri, -1, SQLITE_STATIC);
+        sqlite3_bind_text (stmt, 2, g_get_language_names()[0], -1, SQLITE_STATIC);
+        if (!sqlite_storage_exec (priv, stmt))
+            break;
+    }
+    if (i == G_N_ELEMENTS (clear_stmts))
+        g_hash_table_add (priv->cleared, g_strdup (doc_uri));
 
     g_mutex_unlock (&priv->mutex);
 }
@@ -42,8 +42,21 @@ yelp_storage_get_default (void)
 {
     static GMutex mutex;
     g_mutex_lock (&mutex);
-    if (default_storage == NULL)
-        default_storage = yelp_sqlite_storage_new (":memory:");
+    if (default_storage == NULL) {
+        /* Keep the index across runs, so documents that haven't
+         * changed don't have to be indexed again.
+         */
+        gchar *dir = g_build_filename (g_get_user_cache_dir (), "yelp", NULL);
+        if (g_mkdir_with_parents (dir, 0755) == 0) {
+            gchar *filename = g_build_filename (dir, "search.db", NULL);
+            default_storage = yelp_sqlite_storage_new (filename);
+            g_free (filename);
+        }
+        else {
+            default_storage = yelp_sqlite_storage_new (":memory:");
+        }
+        g_free (dir);
+    }
     g_mutex_unlock (&mutex);
     return default_storage;
 }
@@ -74,6 +87,22 @@ GVariant *
 yelp_storage_search (YelpStorage   *storage,
                      const gchar   *doc_uri,
                      const gchar   *text)
+{
+    return yelp_storage_search_range (storage, doc_uri, text, 0, -1);
+}
+
+/* Returns at most limit results, best first, skipping the first offset
+ * of them. A negative limit returns all results. Results are a(sssss),
+ * holding the page URI, title, description, icon, and a snippet of the
+ * page text with the matching terms between YELP_STORAGE_MATCH_START
+ * and YELP_STORAGE_MATCH_END.
+ */
+GVariant *
+yelp_storage_search_range (YelpStorage   *storage,
+                           const gchar   *doc_uri,
+                           const gchar   *text,
+                           gint           offset,
+                           gint           limit)
 {
     YelpStorageInterface *iface;
 
@@ -82,7 +111,73 @@ yelp_storage_search (YelpStorage   *storage,
     iface = YELP_STORAGE_GET_INTERFACE (storage);
 
     if (iface->search)
-        return (*iface->search) (storage, doc_uri, text);
+        return (*iface->search) (storage, doc_uri, text, offset, limit);
+    else
+        return NULL;
+}
+
+/* Searches every indexed document at once. Results come back as
+ * a(ssa(sssss)), one entry per document holding its URI, its root title,
+ * and its results as from yelp_storage_search_range. Documents are ordered
+ * by their best result, and offset and limit count results, not documents.
+ */
+GVariant *
+yelp_storage_search_all (YelpStorage   *storage,
+                         const gchar   *text,
+                         gint           offset,
+                         gint           limit)
+{
+    YelpStorageInterface *iface;
+
+    g_return_val_if_fail (YELP_IS_STORAGE (storage), NULL);
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->search_all)
+        return (*iface->search_all) (storage, text, offset, limit);
+    else
+        return NULL;
+}
+
+/* Search as you type. Unlike yelp_storage_search, text is not a query:
+ * it is split into words, all of which must match, and the last one is
+ * matched as a prefix unless text ends with a space. Implementations may
+ * reuse the results for the text typed before this. Returns at most
+ * limit results, best first, as a(ssss), without snippets.
+ */
+GVariant *
+yelp_storage_search_incremental (YelpStorage   *storage,
+                                 const gchar   *doc_uri,
+                                 const gchar   *text,
+                                 gint           limit)
+{
+    YelpStorageInterface *iface;
+
+    g_return_val_if_fail (YELP_IS_STORAGE (storage), NULL);
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->search_incremental)
+        return (*iface->search_incremental) (storage, doc_uri, text, limit);
+    else
+        return NULL;
+}
+
+/* Lists every indexed page in the current language, as a(sssss) of the
+ * document URI, the page URI, and the title, description and icon. This
+ * gives the pages of every indexed document without loading any of them.
+ */
+GVariant *
+yelp_storage_list_pages (YelpStorage *storage)
+{
+    YelpStorageInterface *iface;
+
+    g_return_val_if_fail (YELP_IS_STORAGE (storage), NULL);
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->list_pages)
+        return (*iface->list_pages) (storage);
     else
         return NULL;
 }
@@ -97,7 +192,7 @@ yelp_storage_get_root_title (YelpStorage *storage,
 
     iface = YELP_STORAGE_GET_INTERFACE (storage);
 
-    if (iface->search)
+    if (iface->get_root_title)
         return (*iface->get_root_title) (storage, doc_uri);
     else
         return NULL;
@@ -114,6 +209,88 @@ yelp_storage_set_root_title (YelpStorage *storage,
 
     iface = YELP_STORAGE_GET_INTERFACE (storage);
 
-    if (iface->search)
+    if (iface->set_root_title)
         (*iface->set_root_title) (storage, doc_uri, title);
 }
+
+/* Updates to doc_uri between begin_batch and commit_batch may be held
+ * back and written together. Batches for one document can nest, and
+ * nothing is committed until the outermost one is. Batches for different
+ * documents don't wait for each other.
+ */
+void
+yelp_storage_begin_batch (YelpStorage *storage,
+                          const gchar *doc_uri)
+{
+    YelpStorageInterface *iface;
+
+    g_return_if_fail (YELP_IS_STORAGE (storage));
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->begin_batch)
+        (*iface->begin_batch) (storage, doc_uri);
+}
+
+void
+yelp_storage_commit_batch (YelpStorage *storage,
+                           const gchar *doc_uri)
+{
+    YelpStorageInterface *iface;
+
+    g_return_if_fail (YELP_IS_STORAGE (storage));
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->commit_batch)
+        (*iface->commit_batch) (storage, doc_uri);
+}
+
+/* Returns the modification time recorded with the index for doc_uri,
+ * or 0 if it has never been indexed.
+ */
+gint64
+yelp_storage_get_mtime (YelpStorage *storage,
+                        const gchar *doc_uri)
+{
+    YelpStorageInterface *iface;
+
+    g_return_val_if_fail (YELP_IS_STORAGE (storage), 0);
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->get_mtime)
+        return (*iface->get_mtime) (storage, doc_uri);
+    else
+        return 0;
+}
+
+void
+yelp_storage_set_mtime (YelpStorage *storage,
+                        const gchar *doc_uri,
+                        gint64       mtime)
+{
+    YelpStorageInterface *iface;
+
+    g_return_if_fail (YELP_IS_STORAGE (storage));
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->set_mtime)
+        (*iface->set_mtime) (storage, doc_uri, mtime);
+}
+
+/* Forgets everything stored for doc_uri, including its mtime */
+void
+yelp_storage_clear (YelpStorage *storage,
+                    const gchar *doc_uri)
+{
+    YelpStorageInterface *iface;
+
+    g_return_if_fail (YELP_IS_STORAGE (storage));
+
+    iface = YELP_STORAGE_GET_INTERFACE (storage);
+
+    if (iface->clear)
+        (*iface->clear) (storage, doc_uri);
+}
@@ -30,6 +30,10 @@ G_BEGIN_DECLS
 #define YELP_IS_STORAGE(o)            (G_TYPE_CHECK_INSTANCE_TYPE ((o), YELP_TYPE_STORAGE))
 #define YELP_STORAGE_GET_INTERFACE(o) (G_TYPE_INSTANCE_GET_INTERFACE ((o), YELP_TYPE_STORAGE, YelpStorageInterface))
 
+/* Surround the matching terms in search result snippets */
+#define YELP_STORAGE_MATCH_START "\002"
+#define YELP_STORAGE_MATCH_END   "\003"
+
 typedef struct _YelpStorage          YelpStorage;
 typedef struct _YelpStorageInterface YelpStorageInterface;
 
@@ -45,12 +49,34 @@ struct _YelpStorageInterface {
                                      const gchar   *text);
     GVariant *    (*search)         (YelpStorage   *storage,
                                      const gchar   *doc_uri,
-                                     const gchar   *text);
+                                     const gchar   *text,
+                                     gint           offset,
+                                     gint           limit);
     gchar *       (*get_root_title) (YelpStorage   *storage,
                                      const gchar   *doc_uri);
     void          (*set_root_title) (YelpStorage   *storage,
                                      const gchar   *doc_uri,
                                      const gchar   *title);
+    void          (*begin_batch)    (YelpStorage   *storage,
+                                     const gchar   *doc_uri);
+    void          (*commit_batch)   (YelpStorage   *storage,
+                                     const gchar   *doc_uri);
+    gint64        (*get_mtime)      (YelpStorage   *storage,
+                                     const gchar   *doc_uri);
+    void          (*set_mtime)      (YelpStorage   *storage,
+                                     const gchar   *doc_uri,
+                                     gint64         mtime);
+    void          (*clear)          (YelpStorage   *storage,
+                                     const gchar   *doc_uri);
+    GVariant *    (*search_all)     (YelpStorage   *storage,
+                                     const gchar   *text,
+                                     gint           offset,
+                                     gint           limit);
+    GVariant *    (*search_incremental) (YelpStorage   *storage,
+                                         const gchar   *doc_uri,
+                                         const gchar   *text,
+                                         gint           limit);
+    GVariant *    (*list_pages)     (YelpStorage   *storage);
 };
 
 GType             yelp_storage_get_type       (void);
@@ -68,11 +94,36 @@ void              yelp_storage_update         (YelpStorage   *storage,
 GVariant *        yelp_storage_search         (YelpStorage   *storage,
                                                const gchar   *doc_uri,
                                                const gchar   *text);
+GVariant *        yelp_storage_search_range   (YelpStorage   *storage,
+                                               const gchar   *doc_uri,
+                                               const gchar   *text,
+                                               gint           offset,
+                                               gint           limit);
+GVariant *        yelp_storage_search_all     (YelpStorage   *storage,
+                                               const gchar   *text,
+                                               gint           offset,
+                                               gint           limit);
+GVariant *        yelp_storage_search_incremental (YelpStorage   *storage,
+                                                   const gchar   *doc_uri,
+                                                   const gchar   *text,
+                                                   gint           limit);
+GVariant *        yelp_storage_list_pages     (YelpStorage   *storage);
 gchar *           yelp_storage_get_root_title (YelpStorage   *storage,
                                                const gchar   *doc_uri);
 void              yelp_storage_set_root_title (YelpStorage   *storage,
                                                const gchar   *doc_uri,
                                                const gchar   *title);
+void              yelp_storage_begin_batch    (YelpStorage   *storage,
+                                               const gchar   *doc_uri);
+void              yelp_storage_commit_batch   (YelpStorage   *storage,
+                                               const gchar   *doc_uri);
+gint64            yelp_storage_get_mtime      (YelpStorage   *storage,
+                                               const gchar   *doc_uri);
+void              yelp_storage_set_mtime      (YelpStorage   *storage,
+                                               const gchar   *doc_uri,
+                                               gint64         mtime);
+void              yelp_storage_clear          (YelpStorage   *storage,
+                                               const gchar   *doc_uri);
 
 G_END_DECLS
 
@@ -26,6 +26,7 @@
 #include <stdio.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "yelp-uri.h"
@@ -629,6 +630,159 @@ resolve_file_path (YelpUri *uri)
     resolve_gfile (uri, NULL, hash);
 }
 
+/* The help directories looked at so far, with what is in them, so that
+ * resolving a help URI does not stat every candidate file again. Whether
+ * a candidate exists at all is answered from the listing of its parent,
+ * all the way up to the data directory. Only the data directory itself is
+ * kept when it is missing, so that is answered from the cache too. Each
+ * directory is watched, and dropped from the cache when its entries
+ * change. Resolving happens in other threads, hence the lock.
+ */
+typedef struct {
+    gchar        *path;
+    GHashTable   *files;    /* Names to GFileType, or NULL if missing */
+    GFileMonitor *monitor;
+} HelpDir;
+
+/* Past this, the cache starts over rather than growing */
+#define HELP_DIRS_MAX 256
+
+G_LOCK_DEFINE_STATIC (help_dirs);
+static GHashTable *help_dirs = NULL;
+
+static void
+help_dir_free (HelpDir *dir)
+{
+    if (dir->monitor) {
+        g_signal_handlers_disconnect_by_data (dir->monitor, dir);
+        g_file_monitor_cancel (dir->monitor);
+        g_object_unref (dir->monitor);
+    }
+    if (dir->files)
+        g_hash_table_destroy (dir->files);
+    g_free (dir->path);
+    g_free (dir);
+}
+
+static void
+help_dir_changed (GFileMonitor      *monitor,
+                  GFile             *file,
+                  GFile             *other_file,
+                  GFileMonitorEvent  event,
+                  HelpDir           *dir)
+{
+    /* Only the names and types of the entries are cached */
+    if (event == G_FILE_MONITOR_EVENT_CHANGED ||
+        event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT ||
+        event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+        return;
+
+    G_LOCK (help_dirs);
+    if (g_hash_table_lookup (help_dirs, dir->path) == dir)
+        g_hash_table_remove (help_dirs, dir->path);
+    G_UNLOCK (help_dirs);
+}
+
+/* Called with the lock held. Returns NULL if path is not a directory below
+ * the data directory datadir. Each parent up to datadir is checked in its
+ * listing first, so a missing directory is never opened or watched. The
+ * monitor is set up before listing, so no change can slip in between. Its
+ * events go to the main context.
+ */
+static HelpDir *
+help_dir_get (const gchar *datadir,
+              const gchar *path)
+{
+    HelpDir *dir;
+    GFile *file;
+    GFileMonitor *monitor;
+    GFileEnumerator *children;
+    GFileInfo *info;
+    gboolean top;
+
+    dir = g_hash_table_lookup (help_dirs, path);
+    if (dir != NULL)
+        return dir->files ? dir : NULL;
+
+    top = (strlen (path) <= strlen (datadir));
+    if (!top) {
+        gchar *parent_path = g_path_get_dirname (path);
+        gchar *name = g_path_get_basename (path);
+        HelpDir *parent = help_dir_get (datadir, parent_path);
+        gboolean exists = (parent != NULL &&
+                           GPOINTER_TO_INT (g_hash_table_lookup (parent->files, name)) == G_FILE_TYPE_DIRECTORY);
+        g_free (parent_path);
+        g_free (name);
+        if (!exists)
+            return NULL;
+    }
+
+    file = g_file_new_for_path (path);
+    monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE, NULL, NULL);
+    children = g_file_enumerate_children (file,
+                                          G_FILE_ATTRIBUTE_STANDARD_NAME ","
+                                          G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                                          G_FILE_QUERY_INFO_NONE,
+                                          NULL, NULL);
+    g_object_unref (file);
+    if (children == NULL && !(top && monitor)) {
+        if (monitor) {
+            g_file_monitor_cancel (monitor);
+            g_object_unref (monitor);
+        }
+        return NULL;
+    }
+
+    dir = g_new0 (HelpDir, 1);
+    dir->path = g_strdup (path);
+    dir->monitor = monitor;
+    if (dir->monitor)
+        g_signal_connect (dir->monitor, "changed", G_CALLBACK (help_dir_changed), dir);
+
+    if (children != NULL) {
+        dir->files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        while ((info = g_file_enumerator_next_file (children, NULL, NULL)) != NULL) {
+            g_hash_table_insert (dir->files,
+                                 g_strdup (g_file_info_get_name (info)),
+                                 GINT_TO_POINTER (g_file_info_get_file_type (info)));
+            g_object_unref (info);
+        }
+        g_object_unref (children);
+    }
+
+    if (g_hash_table_size (help_dirs) >= HELP_DIRS_MAX)
+        g_hash_table_remove_all (help_dirs);
+    g_hash_table_insert (help_dirs, dir->path, dir);
+    return dir->files ? dir : NULL;
+}
+
+/* With a NULL name, whether path is a directory. Otherwise, whether it
+ * has a regular file called name. The path is below the data directory
+ * datadir, which is where the listings start.
+ */
+static gboolean
+help_dir_test (const gchar *datadir,
+               const gchar *path,
+               const gchar *name)
+{
+    HelpDir *dir;
+    gboolean ret;
+
+    G_LOCK (help_dirs);
+    if (help_dirs == NULL)
+        help_dirs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify) help_dir_free);
+    dir = help_dir_get (datadir, path);
+    if (name == NULL)
+        ret = (dir != NULL);
+    else
+        ret = (dir != NULL &&
+               GPOINTER_TO_INT (g_hash_table_lookup (dir->files, name)) == G_FILE_TYPE_REGULAR);
+    G_UNLOCK (help_dirs);
+
+    return ret;
+}
+
 static void
 resolve_data_dirs (YelpUri      *ret,
                    const gchar  *subdir,
@@ -641,7 +795,7 @@ resolve_data_dirs (YelpUri      *ret,
     /* The strings are still owned by GLib; we just own the array. */
     gchar **datadirs;
     YelpUriPrivate *priv = GET_PRIV (ret);
-    gchar *filename = NULL;
+    gchar *filename = NULL, *name;
     gchar **searchpath = NULL;
     gint searchi, searchmax;
     gint datadir_i, lang_i;
@@ -662,7 +816,7 @@ resolve_data_dirs (YelpUri      *ret,
                                                langfirst ? langs[lang_i] : docid,
                                                langfirst ? docid : langs[lang_i],
                                                NULL);
-            if (!g_file_test (helpdir, G_FILE_TEST_IS_DIR)) {
+            if (!help_dir_test (datadirs[datadir_i], helpdir, NULL)) {
                 g_free (helpdir);
                 continue;
             }
@@ -678,45 +832,47 @@ resolve_data_dirs (YelpUri      *ret,
                 /* We've already found it.  We're just adding to the search path now. */
                 continue;
 
-            filename = g_strdup_printf ("%s/index.page", helpdir);
-            if (g_file_test (filename, G_FILE_TEST_IS_REGULAR)) {
+            if (help_dir_test (datadirs[datadir_i], helpdir, "index.page")) {
                 priv->tmptype = YELP_URI_DOCUMENT_TYPE_MALLARD;
-                g_free (filename);
                 filename = g_strdup (helpdir);
                 continue;
             }
-            g_free (filename);
 
             if (langfirst) {
-                filename = g_strdup_printf ("%s/index.docbook", helpdir);
-                if (g_file_test (filename, G_FILE_TEST_IS_REGULAR)) {
+                if (help_dir_test (datadirs[datadir_i], helpdir, "index.docbook")) {
                     priv->tmptype = YELP_URI_DOCUMENT_TYPE_DOCBOOK;
+                    filename = g_strdup_printf ("%s/index.docbook", helpdir);
                     continue;
                 }
-                g_free (filename);
             }
             else {
-                filename = g_strdup_printf ("%s/%s.xml", helpdir, pageid);
-                if (g_file_test (filename, G_FILE_TEST_IS_REGULAR)) {
+                name = g_strdup_printf ("%s.xml", pageid);
+                if (help_dir_test (datadirs[datadir_i], helpdir, name)) {
                     priv->tmptype = YELP_URI_DOCUMENT_TYPE_DOCBOOK;
+                    filename = g_build_filename (helpdir, name, NULL);
+                    g_free (name);
                     continue;
                 }
-                g_free (filename);
+                g_free (name);
             }
 
-            filename = g_strdup_printf ("%s/%s.html", helpdir, pageid);
-            if (g_file_test (filename, G_FILE_TEST_IS_REGULAR)) {
+            name = g_strdup_printf ("%s.html", pageid);
+            if (help_dir_test (datadirs[datadir_i], helpdir, name)) {
                 priv->tmptype = YELP_URI_DOCUMENT_TYPE_HTML;
+                filename = g_build_filename (helpdir, name, NULL);
+                g_free (name);
                 continue;
             }
-            g_free (filename);
+            g_free (name);
 
-            filename = g_strdup_printf ("%s/%s.xhtml", helpdir, pageid);
-            if (g_file_test (filename, G_FILE_TEST_IS_REGULAR)) {
+            name = g_strdup_printf ("%s.xhtml", pageid);
+            if (help_dir_test (datadirs[datadir_i], helpdir, name)) {
                 priv->tmptype = YELP_URI_DOCUMENT_TYPE_XHTML;
+                filename = g_build_filename (helpdir, name, NULL);
+                g_free (name);
                 continue;
             }
-            g_free (filename);
+            g_free (name);
         } /* end for langs */
     } /* end for datadirs */
 
@@ -951,56 +1107,415 @@ resolve_help_list_uri (YelpUri *uri)
     priv->tmptype = YELP_URI_DOCUMENT_TYPE_HELP_LIST;
 }
 
-/*
-  Resolve a manual file's path using 'man -w'. section may be NULL,
-  otherwise should be the section of the manual (ie should have dealt
-  with empty strings before calling this!) Returns NULL if the file
-  can't be found.
-*/
-static gchar*
-find_man_path (gchar* name, gchar* section)
+/* An index of every man page on the manpath, by name, so resolving a
+ * man: URI never has to run man. It is built on first use, and built
+ * again when a man directory's mtime changes, checking at most every few
+ * seconds. The system manpath is asked of manpath once per build.
+ * Resolving happens in other threads, hence the lock.
+ */
+#define MAN_INDEX_CHECK_INTERVAL (3 * G_TIME_SPAN_SECOND)
+
+typedef struct {
+    const gchar *dir;      /* Interned */
+    const gchar *file;
+    const gchar *section;
+} ManPage;
+
+typedef struct {
+    gchar  *path;
+    time_t  mtime;         /* 0 if missing */
+} ManDir;
+
+G_LOCK_DEFINE_STATIC (man_index);
+static GHashTable   *man_index = NULL;   /* Names to GArrays of ManPage */
+static GStringChunk *man_strings = NULL;
+static GArray       *man_dirs = NULL;
+static gint64        man_index_checked = 0;
+
+static const gchar *man_compress_suffixes[] = {
+    ".gz", ".bz2", ".lzma", ".xz", ".Z", NULL
+};
+
+/* The order man looks through sections when none is given */
+static const gchar *man_section_order[] = {
+    "1", "n", "l", "8", "3", "2", "3posix", "3pm", "3perl", "3am",
+    "5", "4", "9", "6", "7", NULL
+};
+
+static const gchar default_man_path[] =
+    "/usr/share/man:/usr/man:/usr/local/share/man:/usr/local/man";
+
+static time_t
+man_dir_mtime (const gchar *path)
 {
-    const gchar* argv[] = { "man", "-w", NULL, NULL, NULL };
-    gchar **my_argv;
+    GStatBuf buf;
+
+    if (g_stat (path, &buf) != 0 || !S_ISDIR (buf.st_mode))
+        return 0;
+    return buf.st_mtime;
+}
+
+static void
+man_path_add (GPtrArray   *path,
+              const gchar *dir)
+{
+    guint i;
+
+    if (dir == NULL || dir[0] != '/')
+        return;
+    for (i = 0; i < path->len; i++)
+        if (g_str_equal (g_ptr_array_index (path, i), dir))
+            return;
+    g_ptr_array_add (path, g_strdup (dir));
+}
+
+/* The system manpath as man works it out, with MANPATH unset so that it
+ * doesn't just echo that back. Returns FALSE if that gives nothing.
+ */
+static gboolean
+man_path_add_manpath (GPtrArray *path)
+{
+    const gchar *argv[] = { "manpath", "-q", NULL };
+    gchar **envp;
     gchar *ystdout = NULL;
-    gint status;
+    gint status = -1;
+    gboolean ret = FALSE;
+
+    envp = g_environ_unsetenv (g_get_environ (), "MANPATH");
+    if (g_spawn_sync (NULL, (gchar **) argv, envp,
+                      G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                      NULL, NULL,
+                      &ystdout, NULL, &status, NULL) &&
+        status == 0 && ystdout != NULL) {
+        gchar **dirs = g_strsplit (g_strstrip (ystdout), ":", -1);
+        gint i;
+
+        for (i = 0; dirs[i]; i++) {
+            if (dirs[i][0] == '/')
+                ret = TRUE;
+            man_path_add (path, dirs[i]);
+        }
+        g_strfreev (dirs);
+    }
+    g_free (ystdout);
+    g_strfreev (envp);
+
+    return ret;
+}
+
+/* The system manpath, from manpath, or else from the first man
+ * configuration file there is
+ */
+static void
+man_path_add_system (GPtrArray *path)
+{
+    static const gchar *configs[] = {
+        "/etc/manpath.config", "/etc/man_db.conf", "/etc/man.conf", NULL
+    };
+    gchar *contents = NULL;
     gchar **lines;
-    GError *error = NULL;
+    guint len = path->len;
+    gint i;
 
-    /* Syntax for man is "man -w <section> <name>", possibly omitting
-       section */
-    if (section) {
-        argv[2] = section;
-        argv[3] = name;
-    } else {
-        argv[2] = name;
+    if (man_path_add_manpath (path))
+        return;
+
+    for (i = 0; configs[i]; i++)
+        if (g_file_get_contents (configs[i], &contents, NULL, NULL))
+            break;
+
+    if (contents != NULL) {
+        lines = g_strsplit (contents, "\n", -1);
+        for (i = 0; lines[i]; i++) {
+            gchar **words = g_strsplit_set (g_strstrip (lines[i]), " \t", -1);
+            gchar *args[3] = { NULL, NULL, NULL };
+            gint j, n = 0;
+
+            for (j = 0; words[j] && n < 3; j++)
+                if (words[j][0] != '\0')
+                    args[n++] = words[j];
+
+            if (args[0] == NULL || args[0][0] == '#')
+                ;
+            else if (g_str_equal (args[0], "MANDATORY_MANPATH") ||
+                     g_str_equal (args[0], "MANDB_MAP") ||
+                     g_str_equal (args[0], "MANPATH"))
+                man_path_add (path, args[1]);
+            else if (g_str_equal (args[0], "MANPATH_MAP"))
+                man_path_add (path, args[2]);
+
+            g_strfreev (words);
+        }
+        g_strfreev (lines);
+        g_free (contents);
     }
 
-    /* g_strdupv() should accept a "const gchar **". */
-    my_argv = g_strdupv ((gchar **) argv);
+    if (path->len == len) {
+        gchar **dirs = g_strsplit (default_man_path, ":", -1);
+        for (i = 0; dirs[i]; i++)
+            man_path_add (path, dirs[i]);
+        g_strfreev (dirs);
+    }
+}
 
-    if (!g_spawn_sync (NULL, my_argv, NULL,
-                       G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
-                       NULL, NULL,
-                       &ystdout, NULL, &status, &error)) {
-        g_warning ("Couldn't find path for %s(%s). Error: %s",
-                   name, section, error->message);
-        g_error_free (error);
+/* MANPATH if set, where an empty element stands for the system manpath,
+ * as it does for man. Each directory comes after its subdirectories for
+ * the user's languages.
+ */
+static GPtrArray *
+man_path_get (void)
+{
+    const gchar * const *langs = g_get_language_names ();
+    const gchar *env = g_getenv ("MANPATH");
+    GPtrArray *base = g_ptr_array_new_with_free_func (g_free);
+    GPtrArray *path = g_ptr_array_new_with_free_func (g_free);
+    gboolean system = FALSE;
+    guint i, j;
+
+    if (env != NULL && env[0] != '\0') {
+        gchar **dirs = g_strsplit (env, ":", -1);
+        for (i = 0; dirs[i]; i++) {
+            if (dirs[i][0] == '\0') {
+                if (!system)
+                    man_path_add_system (base);
+                system = TRUE;
+            }
+            else
+                man_path_add (base, dirs[i]);
+        }
+        g_strfreev (dirs);
+    }
+    else {
+        man_path_add_system (base);
     }
 
-    g_strfreev (my_argv);
+    for (i = 0; i < base->len; i++) {
+        const gchar *dir = g_ptr_array_index (base, i);
+        for (j = 0; langs[j]; j++) {
+            gchar *langdir;
+            if (g_str_equal (langs[j], "C") || g_str_equal (langs[j], "POSIX"))
+                continue;
+            langdir = g_build_filename (dir, langs[j], NULL);
+            man_path_add (path, langdir);
+            g_free (langdir);
+        }
+        man_path_add (path, dir);
+    }
 
-    if (status == 0) {
-        lines = g_strsplit (ystdout, "\n", 2);
-        g_free (ystdout);
-        ystdout = g_strdup (lines[0]);
+    g_ptr_array_unref (base);
+    return path;
+}
 
-        g_strfreev (lines);
-        return ystdout;
-    } else {
-        g_free (ystdout);
+/* Records the directory's mtime and, given the section of a manN
+ * directory, indexes its pages.
+ */
+static void
+man_index_add_dir (const gchar *path,
+                   const gchar *section)
+{
+    ManDir mandir;
+    GDir *dir;
+    const gchar *file;
+    const gchar *interned = g_intern_string (path);
+
+    mandir.path = g_strdup (path);
+    mandir.mtime = man_dir_mtime (path);
+    g_array_append_val (man_dirs, mandir);
+    if (mandir.mtime == 0 || section == NULL)
+        return;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (dir == NULL)
+        return;
+
+    while ((file = g_dir_read_name (dir)) != NULL) {
+        gchar *name = g_strdup (file);
+        gchar *dot;
+        GArray *pages;
+        ManPage page;
+        gint i;
+
+        for (i = 0; man_compress_suffixes[i]; i++) {
+            if (g_str_has_suffix (name, man_compress_suffixes[i])) {
+                name[strlen (name) - strlen (man_compress_suffixes[i])] = '\0';
+                break;
+            }
+        }
+
+        /* name.section, where the section is the directory's or an
+         * extension of it, like 3pm in man3
+         */
+        dot = strrchr (name, '.');
+        if (dot == NULL || dot == name || !g_str_has_prefix (dot + 1, section)) {
+            g_free (name);
+            continue;
+        }
+        *dot = '\0';
+
+        page.dir = interned;
+        page.file = g_string_chunk_insert (man_strings, file);
+        page.section = g_string_chunk_insert_const (man_strings, dot + 1);
+
+        pages = g_hash_table_lookup (man_index, name);
+        if (pages == NULL) {
+            pages = g_array_new (FALSE, FALSE, sizeof (ManPage));
+            g_hash_table_insert (man_index, name, pages);
+        }
+        else {
+            g_free (name);
+        }
+        g_array_append_val (pages, page);
+    }
+
+    g_dir_close (dir);
+}
+
+static void
+man_index_clear (void)
+{
+    guint i;
+
+    if (man_index == NULL)
+        return;
+
+    g_hash_table_destroy (man_index);
+    g_string_chunk_free (man_strings);
+    for (i = 0; i < man_dirs->len; i++)
+        g_free (g_array_index (man_dirs, ManDir, i).path);
+    g_array_free (man_dirs, TRUE);
+    man_index = NULL;
+}
+
+static void
+man_index_build (void)
+{
+    GPtrArray *path;
+    guint i;
+
+    man_index_clear ();
+    man_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify) g_array_unref);
+    man_strings = g_string_chunk_new (4096);
+    man_dirs = g_array_new (FALSE, FALSE, sizeof (ManDir));
+
+    path = man_path_get ();
+    for (i = 0; i < path->len; i++) {
+        const gchar *mandir = g_ptr_array_index (path, i);
+        GDir *dir;
+        const gchar *sub;
+
+        /* Recorded too, so that new section directories are noticed */
+        man_index_add_dir (mandir, NULL);
+
+        dir = g_dir_open (mandir, 0, NULL);
+        if (dir == NULL)
+            continue;
+        while ((sub = g_dir_read_name (dir)) != NULL) {
+            gchar *subdir;
+            if (!g_str_has_prefix (sub, "man") || sub[3] == '\0')
+                continue;
+            subdir = g_build_filename (mandir, sub, NULL);
+            man_index_add_dir (subdir, sub + 3);
+            g_free (subdir);
+        }
+        g_dir_close (dir);
+    }
+    g_ptr_array_unref (path);
+}
+
+static gboolean
+man_index_stale (void)
+{
+    guint i;
+
+    for (i = 0; i < man_dirs->len; i++) {
+        ManDir *mandir = &g_array_index (man_dirs, ManDir, i);
+        if (man_dir_mtime (mandir->path) != mandir->mtime)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static gint
+man_section_rank (const gchar *section)
+{
+    gint i;
+
+    for (i = 0; man_section_order[i]; i++)
+        if (g_str_equal (section, man_section_order[i]))
+            return 2 * i;
+    /* Extensions like 3pm come after their base section */
+    for (i = 0; man_section_order[i]; i++)
+        if (section[0] == man_section_order[i][0])
+            return 2 * i + 1;
+    return G_MAXINT;
+}
+
+/* With a section, an exact match beats one that only extends it, so 3
+ * finds printf.3 over printf.3p. Without one, the section order decides.
+ * Ties go to the earlier directory on the manpath.
+ */
+static gchar *
+man_index_lookup (const gchar *name,
+                  const gchar *section)
+{
+    GArray *pages = g_hash_table_lookup (man_index, name);
+    ManPage *best = NULL;
+    gint best_rank = G_MAXINT;
+    guint i;
+
+    if (pages == NULL)
         return NULL;
+
+    for (i = 0; i < pages->len; i++) {
+        ManPage *page = &g_array_index (pages, ManPage, i);
+        gint rank;
+
+        if (section == NULL)
+            rank = man_section_rank (page->section);
+        else if (g_str_equal (page->section, section))
+            rank = 0;
+        else if (g_str_has_prefix (page->section, section))
+            rank = 1;
+        else
+            continue;
+
+        if (best == NULL || rank < best_rank) {
+            best = page;
+            best_rank = rank;
+        }
     }
+
+    if (best == NULL)
+        return NULL;
+    return g_build_filename (best->dir, best->file, NULL);
+}
+
+/*
+  Resolve a manual file's path from the man index. section may be NULL, otherwise
+  should be the section of the manual (ie should have dealt with empty
+  strings before calling this!) Returns NULL if the file can't be found.
+*/
+static gchar*
+find_man_path (gchar* name, gchar* section)
+{
+    gint64 now = g_get_monotonic_time ();
+    gchar *path;
+
+    G_LOCK (man_index);
+    if (man_index == NULL) {
+        man_index_build ();
+        man_index_checked = now;
+    }
+    else if (now - man_index_checked > MAN_INDEX_CHECK_INTERVAL) {
+        if (man_index_stale ())
+            man_index_build ();
+        man_index_checked = now;
+    }
+    path = man_index_lookup (name, section);
+    G_UNLOCK (man_index);
+
+    return path;
 }
 
 static void
@@ -1292,11 +1807,12 @@ resolve_xref_uri (YelpUri *uri)
     }
 
     if (priv->page_id &&
-        g_str_has_prefix (priv->docuri, "info:")) {
+        g_str_has_prefix (priv->docuri, "info:") &&
+        !g_str_has_prefix (priv->page_id, "search=")) {
         /*
           Special characters get url-encoded when they get clicked on
           as links. Info files, at least, don't want that so decode
-          the url again here.
+          the url again here. Search pages unescape their own text.
          */
         gchar* tmp = priv->page_id;
         priv->page_id = g_uri_unescape_string (tmp, NULL);
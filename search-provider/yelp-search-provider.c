@@ -29,21 +29,78 @@
 
 #include "yelp-settings.h"
 #include "yelp-document.h"
+#include "yelp-fuzzy.h"
+#include "yelp-help-list.h"
+#include "yelp-storage.h"
 #include "yelp-uri.h"
 
 #define SEARCH_PROVIDER_INACTIVITY_TIMEOUT 12000 /* milliseconds */
 
+/* Loading stops this long after gnome-help is in, cancelling whatever is
+ * still outstanding, so the provider can exit on time. Documents left out
+ * keep their pages from the snapshot.
+ */
+#define SEARCH_PROVIDER_LOAD_BUDGET 8000 /* milliseconds */
+
+/* Full-text hits from the search index are added after the title matches,
+ * if they come back in time. Only one query runs at a time; a search made
+ * meanwhile waits for it, and replaces any search already waiting.
+ */
+#define SEARCH_PROVIDER_FULL_TEXT_BUDGET 150 /* milliseconds */
+#define SEARCH_PROVIDER_FULL_TEXT_MAX    10
+
+/* The pages and index from the last preload, saved so the next start can
+ * answer right away. Holds a version, the language, the pages as (id,
+ * document, title, casefolded title, desc, casefolded desc, icon), the
+ * indexed words, the sorted index entries, and the entries for whole
+ * words. Entries are stored as IndexEntry, so they're used in place.
+ */
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_TYPE "(usa(sssssss)asa(uuu)a(uuu))"
+
 struct _PageData
 {
+    const gchar *doc_id;  /* Interned */
+    gchar *id;            /* The result ID, and the key in the pages */
     gchar *title;
     gchar *title_casefold;
     gchar *desc;
     gchar *desc_casefold;
-    GIcon *icon;
+    gchar *icon;          /* As from g_icon_to_string */
+    GVariant *meta;       /* What GetResultMetas returns, once asked for */
+    GVariant *snapshot;   /* Holds the strings when loaded from one */
 };
 
 typedef struct _PageData PageData;
 
+/* Every suffix of every word in the page titles and descriptions, sorted,
+ * so the pages containing a string are the ones with a suffix starting
+ * with it. That gives the same matches as strstr on each page, but takes
+ * a binary search instead of a pass over all the pages.
+ */
+typedef struct
+{
+    guint32 word;
+    guint32 offset;           /* Of the suffix in the word, in bytes */
+    guint32 page;
+} IndexEntry;
+
+typedef struct
+{
+    GStringChunk     *words;
+    GPtrArray        *word_list;
+    GArray           *entry_array;
+    GArray           *token_array;
+    const IndexEntry *entries;   /* In entry_array, or in the snapshot */
+    gsize             n_entries;
+    const IndexEntry *tokens;    /* The entries for whole words */
+    gsize             n_tokens;
+    GPtrArray        *page_ids;
+    GVariant         *snapshot;  /* Holds the words when loaded from one */
+} SearchIndex;
+
+typedef struct _FullTextSearch FullTextSearch;
+
 typedef GApplicationClass YelpSearchProviderAppClass;
 typedef struct _YelpSearchProviderApp YelpSearchProviderApp;
 
@@ -54,8 +111,29 @@ struct _YelpSearchProviderApp {
 
     gboolean released;
 
+    /* Pages from every document, keyed by result ID. The index is rebuilt
+     * from them once a batch of documents has loaded, so it may still
+     * name pages that have since gone away.
+     */
     GHashTable *page_data_hash_map;
+    SearchIndex *index;
+
+    /* Documents from the help list still to load. Every request made
+     * while loading uses cancellable, which is cancelled once it's done.
+     */
+    gboolean listed;
+    GQueue *pending_docs;
+    gchar *loading_doc;
+    GCancellable *cancellable;
+    guint budget_id;
+
+    /* The words of the last search, reused while the user refines it */
+    gchar *last_terms;
+    GPtrArray *last_words;
     GPtrArray *delayed_result_getters;
+
+    gboolean full_text_running;
+    FullTextSearch *full_text_waiting;
 };
 
 GType yelp_search_provider_app_get_type (void);
@@ -67,12 +145,16 @@ GType yelp_search_provider_app_get_type (void);
 G_DEFINE_TYPE (YelpSearchProviderApp, yelp_search_provider_app, G_TYPE_APPLICATION)
 
 static PageData *
-page_data_new_steal (gchar *title,
-                     gchar *desc,
-                     GIcon *icon)
+page_data_new_steal (gchar       *page_id,
+                     const gchar *doc_id,
+                     gchar       *title,
+                     gchar       *desc,
+                     gchar       *icon)
 {
     PageData *data = g_new0 (PageData, 1);
 
+    data->id = page_id;
+    data->doc_id = g_intern_string (doc_id);
     if (title) {
         data->title = title;
         data->title_casefold = g_utf8_casefold (title, -1);
@@ -85,20 +167,92 @@ page_data_new_steal (gchar *title,
     return data;
 }
 
+/* A page from the snapshot, pointing into it for all its strings. Nothing
+ * is copied or casefolded, so loading a snapshot stays cheap.
+ */
+static PageData *
+page_data_new_mapped (GVariant    *snapshot,
+                      const gchar *page_id,
+                      const gchar *doc_id,
+                      const gchar *title,
+                      const gchar *title_casefold,
+                      const gchar *desc,
+                      const gchar *desc_casefold,
+                      const gchar *icon)
+{
+    PageData *data = g_new0 (PageData, 1);
+
+    data->snapshot = g_variant_ref (snapshot);
+    data->id = (gchar *) page_id;
+    data->doc_id = g_intern_string (doc_id);
+    data->title = (gchar *) title;
+    data->title_casefold = (gchar *) title_casefold;
+    data->desc = (gchar *) desc;
+    data->desc_casefold = (gchar *) desc_casefold;
+    data->icon = (gchar *) icon;
+    return data;
+}
+
 static void
 page_data_free (PageData *page_data)
 {
-    g_free (page_data->title);
-    g_free (page_data->title_casefold);
-    g_free (page_data->desc);
-    g_free (page_data->desc_casefold);
-    g_clear_object (&page_data->icon);
+    if (page_data->snapshot) {
+        g_variant_unref (page_data->snapshot);
+    }
+    else {
+        g_free (page_data->id);
+        g_free (page_data->title);
+        g_free (page_data->title_casefold);
+        g_free (page_data->desc);
+        g_free (page_data->desc_casefold);
+        g_free (page_data->icon);
+    }
+    if (page_data->meta)
+        g_variant_unref (page_data->meta);
     g_free (page_data);
 }
 
+/* Adds a page, keyed by its ID */
+static void
+page_data_insert (GHashTable *page_data,
+                  PageData   *data)
+{
+    g_hash_table_replace (page_data, data->id, data);
+}
+
+/* The result meta for a page, built the first time it's asked for */
 static GVariant *
-get_result_metas (gchar      **page_ids,
-                  GHashTable  *page_data)
+page_data_get_meta (PageData *data)
+{
+    GVariantBuilder meta;
+    GIcon *icon = NULL;
+
+    if (data->meta != NULL)
+        return data->meta;
+
+    if (data->icon && data->icon[0] != '\0')
+        icon = g_icon_new_for_string (data->icon, NULL);
+
+    g_variant_builder_init (&meta, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&meta, "{sv}",
+                           "id", g_variant_new_string (data->id));
+    g_variant_builder_add (&meta, "{sv}",
+                           "name", g_variant_new_string (data->title ? data->title : ""));
+    if (icon) {
+        g_variant_builder_add (&meta, "{sv}",
+                               "icon", g_icon_serialize (icon));
+        g_object_unref (icon);
+    }
+    g_variant_builder_add (&meta, "{sv}",
+                           "description", g_variant_new_string (data->desc ? data->desc : ""));
+    data->meta = g_variant_ref_sink (g_variant_builder_end (&meta));
+
+    return data->meta;
+}
+
+static GVariant *
+get_result_metas (gchar                 **page_ids,
+                  YelpSearchProviderApp  *app)
 {
     GVariantBuilder metas;
     gint i;
@@ -106,100 +260,505 @@ get_result_metas (gchar      **page_ids,
     g_variant_builder_init (&metas, G_VARIANT_TYPE ("aa{sv}"));
 
     for (i = 0; page_ids[i] != NULL; i++) {
-        GVariantBuilder meta;
-        PageData *data = g_hash_table_lookup (page_data, page_ids[i]);
-        g_variant_builder_init (&meta, G_VARIANT_TYPE ("a{sv}"));
-        g_variant_builder_add (&meta, "{sv}",
-                               "id", g_variant_new_string (page_ids[i]));
-        g_variant_builder_add (&meta, "{sv}",
-                               "name", g_variant_new_string (data->title));
-        g_variant_builder_add (&meta, "{sv}",
-                               "icon", g_icon_serialize (data->icon));
-        g_variant_builder_add (&meta, "{sv}",
-                               "description", g_variant_new_string (data->desc));
-        g_variant_builder_add_value (&metas, g_variant_builder_end (&meta));
+        PageData *data = g_hash_table_lookup (app->page_data_hash_map, page_ids[i]);
+        if (data != NULL)
+            g_variant_builder_add_value (&metas, page_data_get_meta (data));
     }
 
     return g_variant_new ("(aa{sv})", &metas);
 }
 
-/* FIXME: Search was copied from yelp-search-entry and slightly adapted.
- * When search in yelp gets adjusted we should export it and use it here.
- */
 static gboolean
-match_word (const gchar *search_phrase,
-            const gchar *title_casefold,
-            const gchar *desc_casefold)
-{
-    static GRegex *nonword = NULL;
-    gint stri;
-    gchar **strs;
-    gboolean ret = TRUE;
-
-    if (nonword == NULL)
-        nonword = g_regex_new ("\\W", 0, 0, NULL);
-    g_assert (nonword != NULL);
-
-    strs = g_regex_split (nonword, search_phrase, 0);
-    for (stri = 0; strs[stri]; stri++) {
-        if ((!title_casefold ||
-            !strstr (title_casefold, strs[stri])) &&
-            (!desc_casefold ||
-            !strstr (desc_casefold, strs[stri]))) {
-                ret = FALSE;
-                break;
-            }
+is_word_char (gunichar c)
+{
+    return g_unichar_isalnum (c) || c == '_';
+}
+
+/* Splits casefolded text into words, calling func on each */
+static void
+split_words (const gchar *text,
+             void       (*func) (const gchar *word, gsize len, gpointer data),
+             gpointer     data)
+{
+    const gchar *cur, *start = NULL;
+
+    if (text == NULL)
+        return;
+
+    for (cur = text; ; cur = g_utf8_next_char (cur)) {
+        gunichar c = g_utf8_get_char (cur);
+        if (c != 0 && is_word_char (c)) {
+            if (start == NULL)
+                start = cur;
+            continue;
+        }
+        if (start != NULL)
+            func (start, cur - start, data);
+        start = NULL;
+        if (c == 0)
+            break;
+    }
+}
+
+static SearchIndex *
+search_index_new (void)
+{
+    SearchIndex *index = g_new0 (SearchIndex, 1);
+
+    index->words = g_string_chunk_new (4096);
+    index->word_list = g_ptr_array_new ();
+    index->entry_array = g_array_new (FALSE, FALSE, sizeof (IndexEntry));
+    index->token_array = g_array_new (FALSE, FALSE, sizeof (IndexEntry));
+    index->page_ids = g_ptr_array_new_with_free_func (g_free);
+
+    return index;
+}
+
+static void
+search_index_free (SearchIndex *index)
+{
+    g_string_chunk_free (index->words);
+    g_ptr_array_free (index->word_list, TRUE);
+    g_array_free (index->entry_array, TRUE);
+    g_array_free (index->token_array, TRUE);
+    g_ptr_array_free (index->page_ids, TRUE);
+    if (index->snapshot)
+        g_variant_unref (index->snapshot);
+    g_free (index);
+}
+
+typedef struct
+{
+    SearchIndex *index;
+    guint        page;
+} IndexAddData;
+
+static void
+search_index_add_word (const gchar *word,
+                       gsize        len,
+                       gpointer     user_data)
+{
+    IndexAddData *add = user_data;
+    const gchar *suffix;
+
+    word = g_string_chunk_insert_len (add->index->words, word, len);
+    for (suffix = word; *suffix != '\0'; suffix = g_utf8_next_char (suffix)) {
+        IndexEntry entry = { add->index->word_list->len, suffix - word, add->page };
+        g_array_append_val (add->index->entry_array, entry);
+    }
+    g_ptr_array_add (add->index->word_list, (gpointer) word);
+}
+
+static void
+search_index_add (SearchIndex *index,
+                  const gchar *page_id,
+                  PageData    *data)
+{
+    IndexAddData add = { index, index->page_ids->len };
+
+    g_ptr_array_add (index->page_ids, g_strdup (page_id));
+    split_words (data->title_casefold, search_index_add_word, &add);
+    split_words (data->desc_casefold, search_index_add_word, &add);
+}
+
+static const gchar *
+search_index_suffix (SearchIndex      *index,
+                     const IndexEntry *entry)
+{
+    return (const gchar *) g_ptr_array_index (index->word_list, entry->word) + entry->offset;
+}
+
+static gint
+index_entry_compare (gconstpointer a,
+                     gconstpointer b,
+                     gpointer      user_data)
+{
+    SearchIndex *index = user_data;
+    const IndexEntry *entry_a = a, *entry_b = b;
+    gint cmp = strcmp (search_index_suffix (index, entry_a),
+                       search_index_suffix (index, entry_b));
+
+    if (cmp != 0)
+        return cmp;
+    return (entry_a->page > entry_b->page) - (entry_a->page < entry_b->page);
+}
+
+/* Sorts the entries, and picks out the whole words for fuzzy lookups */
+static void
+search_index_finish (SearchIndex *index)
+{
+    guint i;
+
+    g_array_sort_with_data (index->entry_array, index_entry_compare, index);
+    for (i = 0; i < index->entry_array->len; i++) {
+        IndexEntry *entry = &g_array_index (index->entry_array, IndexEntry, i);
+        if (entry->offset == 0)
+            g_array_append_val (index->token_array, *entry);
+    }
+
+    index->entries = (const IndexEntry *) index->entry_array->data;
+    index->n_entries = index->entry_array->len;
+    index->tokens = (const IndexEntry *) index->token_array->data;
+    index->n_tokens = index->token_array->len;
+}
+
+static gint
+guint_compare (gconstpointer a,
+               gconstpointer b)
+{
+    guint ua = *(const guint *) a, ub = *(const guint *) b;
+    return (ua > ub) - (ua < ub);
+}
+
+static void
+sort_unique_pages (GArray *pages)
+{
+    guint i, n;
+
+    g_array_sort (pages, guint_compare);
+    for (i = 0, n = 0; i < pages->len; i++) {
+        if (n == 0 || g_array_index (pages, guint, i) != g_array_index (pages, guint, n - 1))
+            g_array_index (pages, guint, n++) = g_array_index (pages, guint, i);
+    }
+    g_array_set_size (pages, n);
+}
+
+/* Returns the pages with a word containing term, sorted and unique */
+static GArray *
+search_index_lookup (SearchIndex *index,
+                     const gchar *term,
+                     gsize        len)
+{
+    GArray *pages = g_array_new (FALSE, FALSE, sizeof (guint));
+    gsize lo = 0, hi = index->n_entries, i;
+
+    while (lo < hi) {
+        gsize mid = lo + (hi - lo) / 2;
+        if (strncmp (search_index_suffix (index, &index->entries[mid]), term, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (i = lo; i < index->n_entries; i++) {
+        const IndexEntry *entry = &index->entries[i];
+        if (strncmp (search_index_suffix (index, entry), term, len) != 0)
+            break;
+        g_array_append_val (pages, entry->page);
+    }
+
+    sort_unique_pages (pages);
+    return pages;
+}
+
+/* Returns the pages with a word within max_edits typos of term, sorted
+ * and unique. The tokens are sorted, so each distinct word is only
+ * measured once.
+ */
+static GArray *
+search_index_lookup_fuzzy (SearchIndex *index,
+                           const gchar *term,
+                           gsize        len,
+                           gint         max_edits)
+{
+    GArray *pages = g_array_new (FALSE, FALSE, sizeof (guint));
+    const gchar *last = NULL;
+    gint distance = max_edits + 1;
+    gsize i;
+
+    for (i = 0; i < index->n_tokens; i++) {
+        const IndexEntry *entry = &index->tokens[i];
+        const gchar *word = search_index_suffix (index, entry);
+        if (last == NULL || strcmp (word, last) != 0) {
+            last = word;
+            distance = yelp_fuzzy_distance (term, len, last, -1, max_edits);
+        }
+        if (distance <= max_edits)
+            g_array_append_val (pages, entry->page);
+    }
+
+    sort_unique_pages (pages);
+    return pages;
+}
+
+typedef struct
+{
+    SearchIndex *index;
+    GArray      *pages;
+} IndexMatchData;
+
+/* Keeps only the pages that also contain word, or a word close to it
+ * when no page contains it exactly.
+ */
+static void
+search_index_match_word (const gchar *word,
+                         gsize        len,
+                         gpointer     user_data)
+{
+    IndexMatchData *match = user_data;
+    GArray *found;
+    guint i = 0, j = 0, n = 0;
+    gint max_edits;
+
+    found = search_index_lookup (match->index, word, len);
+    max_edits = yelp_fuzzy_max_edits (word, len);
+    if (found->len == 0 && max_edits > 0) {
+        g_array_free (found, TRUE);
+        found = search_index_lookup_fuzzy (match->index, word, len, max_edits);
+    }
+    if (match->pages == NULL) {
+        match->pages = found;
+        return;
+    }
+
+    while (i < match->pages->len && j < found->len) {
+        guint a = g_array_index (match->pages, guint, i);
+        guint b = g_array_index (found, guint, j);
+        if (a < b)
+            i++;
+        else if (b < a)
+            j++;
+        else {
+            g_array_index (match->pages, guint, n++) = a;
+            i++;
+            j++;
         }
+    }
+    g_array_set_size (match->pages, n);
+    g_array_free (found, TRUE);
+}
+
+static void
+add_search_word (const gchar *word,
+                 gsize        len,
+                 gpointer     user_data)
+{
+    g_ptr_array_add ((GPtrArray *) user_data, g_strndup (word, len));
+}
+
+/* Returns the casefolded words in terms. The shell sends the same terms
+ * again for the result metas and while refining, so the words of the
+ * last call are kept.
+ */
+static GPtrArray *
+get_search_words (gchar                 **terms,
+                  YelpSearchProviderApp  *app)
+{
+    gchar *term = g_strjoinv (" ", terms);
+    gchar *term_casefold;
 
-    g_strfreev (strs);
+    if (app->last_terms != NULL && g_str_equal (term, app->last_terms)) {
+        g_free (term);
+        return app->last_words;
+    }
+
+    term_casefold = g_utf8_casefold (term, -1);
+    g_free (app->last_terms);
+    if (app->last_words != NULL)
+        g_ptr_array_unref (app->last_words);
+    app->last_terms = term;
+    app->last_words = g_ptr_array_new_with_free_func (g_free);
+    split_words (term_casefold, add_search_word, app->last_words);
+    g_free (term_casefold);
+
+    return app->last_words;
+}
 
+/* 2 for a match at the start of a word, 1 for one inside a word */
+static gint
+text_score (const gchar *text,
+            const gchar *word)
+{
+    const gchar *found;
+    gint ret = 0;
+
+    if (text == NULL)
+        return 0;
+
+    for (found = strstr (text, word); found != NULL; found = strstr (found + 1, word)) {
+        if (found == text || !is_word_char (g_utf8_get_char (g_utf8_prev_char (found))))
+            return 2;
+        ret = 1;
+    }
     return ret;
 }
 
+/* Matches in the title count for more than matches in the description.
+ * A word only found with typos adds its edits instead, and counts for the
+ * field of its closest match.
+ */
+static gint
+page_data_score (PageData  *data,
+                 GPtrArray *words,
+                 gint      *edits)
+{
+    gint score = 0;
+    guint i;
+
+    for (i = 0; i < words->len; i++) {
+        const gchar *word = g_ptr_array_index (words, i);
+        gint title = text_score (data->title_casefold, word);
+        gint desc = text_score (data->desc_casefold, word);
+        gint max_edits, title_edits, desc_edits;
+
+        if (title != 0 || desc != 0) {
+            score += 3 * title + desc;
+            continue;
+        }
+
+        max_edits = yelp_fuzzy_max_edits (word, -1);
+        title_edits = yelp_fuzzy_text_distance (data->title_casefold, word, max_edits);
+        desc_edits = yelp_fuzzy_text_distance (data->desc_casefold, word, max_edits);
+        *edits += MIN (title_edits, desc_edits);
+        score += title_edits <= desc_edits ? 3 : 1;
+    }
+    return score;
+}
+
+/* Whether the page has word, exactly or with a few typos */
+static gboolean
+page_data_matches (PageData    *data,
+                   const gchar *word)
+{
+    gint max_edits;
+
+    if ((data->title_casefold && strstr (data->title_casefold, word)) ||
+        (data->desc_casefold && strstr (data->desc_casefold, word)))
+        return TRUE;
+
+    max_edits = yelp_fuzzy_max_edits (word, -1);
+    return (max_edits > 0 &&
+            (yelp_fuzzy_text_distance (data->title_casefold, word, max_edits) <= max_edits ||
+             yelp_fuzzy_text_distance (data->desc_casefold, word, max_edits) <= max_edits));
+}
+
+typedef struct
+{
+    guint page;
+    gint  edits;
+    gint  score;
+} ScoredPage;
+
+/* Fewest typos first, then best matched */
+static gint
+scored_page_compare (gconstpointer a,
+                     gconstpointer b)
+{
+    const ScoredPage *page_a = a, *page_b = b;
+
+    if (page_a->edits != page_b->edits)
+        return page_a->edits - page_b->edits;
+    if (page_a->score != page_b->score)
+        return page_b->score - page_a->score;
+    return (page_a->page > page_b->page) - (page_a->page < page_b->page);
+}
+
 static GVariant *
-get_search_results (gchar      **terms,
-                    GHashTable  *page_data)
+get_search_results (gchar                 **terms,
+                    YelpSearchProviderApp  *app)
 {
     GVariantBuilder results;
-    gchar *term = g_strjoinv (" ", terms);
-    GHashTableIter iter;
-    const gchar *page_id;
-    PageData *data;
+    GPtrArray *words = get_search_words (terms, app);
+    IndexMatchData match = { app->index, NULL };
+    GArray *scored;
+    guint i;
 
-    g_hash_table_iter_init (&iter, page_data);
     g_variant_builder_init (&results, G_VARIANT_TYPE ("as"));
 
-    while (g_hash_table_iter_next (&iter, (gpointer *) &page_id, (gpointer *) &data)) {
-        if (match_word (term, data->title_casefold, data->desc_casefold))
-            g_variant_builder_add (&results, "s", page_id);
+    for (i = 0; i < words->len; i++) {
+        const gchar *word = g_ptr_array_index (words, i);
+        search_index_match_word (word, strlen (word), &match);
+    }
+
+    if (match.pages == NULL) {
+        /* No words at all, which matches every page */
+        for (i = 0; i < app->index->page_ids->len; i++)
+            g_variant_builder_add (&results, "s", g_ptr_array_index (app->index->page_ids, i));
+        return g_variant_new ("(as)", &results);
+    }
+
+    /* Pages from every document come back in one list, best first */
+    scored = g_array_sized_new (FALSE, FALSE, sizeof (ScoredPage), match.pages->len);
+    for (i = 0; i < match.pages->len; i++) {
+        ScoredPage page;
+        PageData *data;
+
+        page.page = g_array_index (match.pages, guint, i);
+        data = g_hash_table_lookup (app->page_data_hash_map,
+                                    g_ptr_array_index (app->index->page_ids, page.page));
+        if (data == NULL)
+            continue;
+        page.edits = 0;
+        page.score = page_data_score (data, words, &page.edits);
+        g_array_append_val (scored, page);
+    }
+    g_array_sort (scored, scored_page_compare);
+
+    for (i = 0; i < scored->len; i++) {
+        guint page = g_array_index (scored, ScoredPage, i).page;
+        g_variant_builder_add (&results, "s", g_ptr_array_index (app->index->page_ids, page));
     }
 
-    g_free (term);
+    g_array_free (scored, TRUE);
+    g_array_free (match.pages, TRUE);
+
+    return g_variant_new ("(as)", &results);
+}
+
+/* Refining a search can only drop results, so only the previous ones
+ * need to be checked against the new words.
+ */
+static GVariant *
+get_subsearch_results (gchar                 **previous_results,
+                       gchar                 **terms,
+                       YelpSearchProviderApp  *app)
+{
+    GVariantBuilder results;
+    GPtrArray *words = get_search_words (terms, app);
+    gint i;
+
+    g_variant_builder_init (&results, G_VARIANT_TYPE ("as"));
+
+    for (i = 0; previous_results[i] != NULL; i++) {
+        PageData *data = g_hash_table_lookup (app->page_data_hash_map, previous_results[i]);
+        gboolean matches = (data != NULL);
+        guint j;
+
+        for (j = 0; matches && j < words->len; j++) {
+            const gchar *word = g_ptr_array_index (words, j);
+            matches = page_data_matches (data, word);
+        }
+        if (matches)
+            g_variant_builder_add (&results, "s", previous_results[i]);
+    }
 
     return g_variant_new ("(as)", &results);
 }
 
-typedef GVariant * (*ResultGetter) (gchar      **terms,
-                                    GHashTable  *page_data);
+typedef GVariant * (*ResultGetter) (gchar                 **terms,
+                                    YelpSearchProviderApp  *app);
 
 typedef struct
 {
     GDBusMethodInvocation  *invocation;
     gchar                 **terms;
     ResultGetter            result_getter;
+    gboolean                full_text;      /* Add hits from the search index */
 } DelayedResultGetter;
 
 
 static DelayedResultGetter *
 delayed_result_getter_new (GDBusMethodInvocation  *invocation,
                            gchar                 **terms,
-                           ResultGetter            result_getter)
+                           ResultGetter            result_getter,
+                           gboolean                full_text)
 {
     DelayedResultGetter *delayed = g_new0 (DelayedResultGetter, 1);
 
     delayed->invocation = g_object_ref (invocation);
     delayed->terms = g_strdupv (terms);
     delayed->result_getter = result_getter;
+    delayed->full_text = full_text;
 
     return delayed;
 }
@@ -212,6 +771,243 @@ delayed_result_getter_free (DelayedResultGetter *delayed)
     g_free (delayed);
 }
 
+/* Result ID for a page found in the search index */
+static gchar *
+full_text_result_id (const gchar *doc_uri,
+                     const gchar *full_uri)
+{
+    gsize len = strlen (doc_uri);
+
+    if (g_str_equal (doc_uri, YELP_GNOME_HELP_URI) &&
+        strncmp (full_uri, doc_uri, len) == 0 && full_uri[len] != '\0')
+        return g_strdup (full_uri + len + 1);
+    return g_strdup (full_uri);
+}
+
+/* A search waiting on the search index. Whichever comes first, the hits
+ * or the timeout, sends the reply; the other just drops its reference.
+ */
+struct _FullTextSearch
+{
+    gint                    ref_count;
+    YelpSearchProviderApp  *app;
+    GDBusMethodInvocation  *invocation;
+    GVariant               *results;
+    gchar                  *query;
+    guint                   timeout_id;
+};
+
+static void
+full_text_search_unref (FullTextSearch *search)
+{
+    if (--search->ref_count > 0)
+        return;
+    g_object_unref (search->app);
+    g_clear_object (&search->invocation);
+    g_variant_unref (search->results);
+    g_free (search->query);
+    g_free (search);
+}
+
+static void
+full_text_search_thread (GTask          *task,
+                         gpointer        source_object,
+                         FullTextSearch *search,
+                         GCancellable   *cancellable)
+{
+    GVariant *hits = yelp_storage_search_all (yelp_storage_get_default (),
+                                              search->query, 0,
+                                              SEARCH_PROVIDER_FULL_TEXT_MAX);
+    g_task_return_pointer (task,
+                           hits ? g_variant_ref_sink (hits) : NULL,
+                           (GDestroyNotify) g_variant_unref);
+}
+
+static void full_text_search_done (YelpSearchProviderApp *app,
+                                   GAsyncResult          *result,
+                                   FullTextSearch        *search);
+
+static void
+full_text_search_run (YelpSearchProviderApp *app,
+                      FullTextSearch        *search)
+{
+    GTask *task;
+
+    app->full_text_running = TRUE;
+    task = g_task_new (app, NULL, (GAsyncReadyCallback) full_text_search_done, search);
+    g_task_set_task_data (task, search, NULL);
+    g_task_run_in_thread (task, (GTaskThreadFunc) full_text_search_thread);
+    g_object_unref (task);
+}
+
+/* Runs the search waiting for the last one to finish, unless its reply
+ * has already gone out without it.
+ */
+static void
+full_text_search_next (YelpSearchProviderApp *app)
+{
+    FullTextSearch *search = app->full_text_waiting;
+
+    app->full_text_running = FALSE;
+    app->full_text_waiting = NULL;
+    if (search == NULL)
+        return;
+    if (search->invocation == NULL) {
+        full_text_search_unref (search);
+        return;
+    }
+    full_text_search_run (app, search);
+}
+
+static gboolean
+full_text_search_timeout (FullTextSearch *search)
+{
+    search->timeout_id = 0;
+    g_dbus_method_invocation_return_value (search->invocation, search->results);
+    g_clear_object (&search->invocation);
+    full_text_search_unref (search);
+    return FALSE;
+}
+
+/* Title matches stay first, in order. Hits only found in page bodies go
+ * after them, in the order the index ranked them.
+ */
+static void
+full_text_search_done (YelpSearchProviderApp *app,
+                       GAsyncResult          *result,
+                       FullTextSearch        *search)
+{
+    GVariant *hits, *pages, *ids;
+    GVariantBuilder builder;
+    GVariantIter iter, groups;
+    GHashTable *seen;
+    const gchar *id, *doc_uri, *full_uri, *title, *desc, *icon;
+    gint added = 0;
+
+    hits = g_task_propagate_pointer (G_TASK (result), NULL);
+    full_text_search_next (app);
+    if (search->invocation == NULL) {
+        if (hits)
+            g_variant_unref (hits);
+        full_text_search_unref (search);
+        return;
+    }
+
+    g_source_remove (search->timeout_id);
+    search->timeout_id = 0;
+    /* The timeout won't run now, so drop its reference too */
+    search->ref_count--;
+
+    if (hits == NULL) {
+        g_dbus_method_invocation_return_value (search->invocation, search->results);
+        g_clear_object (&search->invocation);
+        full_text_search_unref (search);
+        return;
+    }
+
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+    ids = g_variant_get_child_value (search->results, 0);
+    g_variant_iter_init (&iter, ids);
+    while (g_variant_iter_next (&iter, "&s", &id)) {
+        g_hash_table_add (seen, (gpointer) id);
+        g_variant_builder_add (&builder, "s", id);
+    }
+
+    g_variant_iter_init (&groups, hits);
+    while (g_variant_iter_next (&groups, "(&s&s@a(sssss))", &doc_uri, NULL, &pages)) {
+        GVariantIter page_iter;
+
+        g_variant_iter_init (&page_iter, pages);
+        while (added < SEARCH_PROVIDER_FULL_TEXT_MAX &&
+               g_variant_iter_next (&page_iter, "(&s&s&s&s&s)",
+                                    &full_uri, &title, &desc, &icon, NULL)) {
+            gchar *page_id = full_text_result_id (doc_uri, full_uri);
+
+            if (g_hash_table_contains (seen, page_id)) {
+                g_free (page_id);
+                continue;
+            }
+            /* Pages from documents the provider hasn't loaded still need
+             * something for GetResultMetas to show.
+             */
+            if (!g_hash_table_contains (app->page_data_hash_map, page_id)) {
+                PageData *data = page_data_new_steal (g_strdup (page_id), doc_uri,
+                                                      g_strdup (title), g_strdup (desc),
+                                                      g_strdup (icon[0] ? icon : "help-browser"));
+                page_data_insert (app->page_data_hash_map, data);
+            }
+            g_variant_builder_add (&builder, "s", page_id);
+            g_free (page_id);
+            added++;
+        }
+        g_variant_unref (pages);
+    }
+    g_hash_table_destroy (seen);
+    g_variant_unref (ids);
+    g_variant_unref (hits);
+
+    g_dbus_method_invocation_return_value (search->invocation,
+                                           g_variant_new ("(as)", &builder));
+    g_clear_object (&search->invocation);
+    full_text_search_unref (search);
+}
+
+/* Replies with results, a (as) of title matches, plus whatever the search
+ * index finds for terms within the time budget.
+ */
+static void
+return_with_full_text (GDBusMethodInvocation  *invocation,
+                       GVariant               *results,
+                       gchar                 **terms,
+                       YelpSearchProviderApp  *app)
+{
+    GPtrArray *words = get_search_words (terms, app);
+    FullTextSearch *search, *waiting;
+    GString *query;
+    guint i;
+
+    if (words->len == 0) {
+        g_dbus_method_invocation_return_value (invocation, results);
+        return;
+    }
+
+    /* Quoted, so nothing the user types is taken as query syntax */
+    query = g_string_new (NULL);
+    for (i = 0; i < words->len; i++)
+        g_string_append_printf (query, "%s\"%s%s\"", i > 0 ? " " : "",
+                                (gchar *) g_ptr_array_index (words, i),
+                                i + 1 == words->len ? "*" : "");
+
+    search = g_new0 (FullTextSearch, 1);
+    search->ref_count = 2;
+    search->app = g_object_ref (app);
+    search->invocation = g_object_ref (invocation);
+    search->results = g_variant_ref_sink (results);
+    search->query = g_string_free (query, FALSE);
+    search->timeout_id = g_timeout_add (SEARCH_PROVIDER_FULL_TEXT_BUDGET,
+                                        (GSourceFunc) full_text_search_timeout,
+                                        search);
+
+    if (!app->full_text_running) {
+        full_text_search_run (app, search);
+        return;
+    }
+
+    /* The user has typed on since the waiting search was made, so it
+     * goes out now with just its title matches.
+     */
+    waiting = app->full_text_waiting;
+    app->full_text_waiting = search;
+    if (waiting != NULL) {
+        if (waiting->invocation != NULL) {
+            g_source_remove (waiting->timeout_id);
+            full_text_search_timeout (waiting);
+        }
+        full_text_search_unref (waiting);
+    }
+}
+
 static void
 handle_results (GDBusMethodInvocation  *invocation,
                 gchar                 **terms,
@@ -225,15 +1021,14 @@ handle_results (GDBusMethodInvocation  *invocation,
     }
 
     if (g_hash_table_size (app->page_data_hash_map) > 0) {
-        g_dbus_method_invocation_return_value (invocation,
-                                               get_search_results (terms,
-                                                                   app->page_data_hash_map));
+        return_with_full_text (invocation, get_search_results (terms, app), terms, app);
         return;
     }
 
     delayed = delayed_result_getter_new (invocation,
                                          terms,
-                                         get_search_results);
+                                         get_search_results,
+                                         TRUE);
 
     g_ptr_array_add (app->delayed_result_getters, delayed);
 }
@@ -260,6 +1055,16 @@ handle_get_subsearch_result_set (YelpShellSearchProvider2  *skeleton,
 {
     YelpSearchProviderApp *app = YELP_SEARCH_PROVIDER_APP (user_data);
 
+    /* Searches too short to run come back empty, so an empty previous
+     * result set may just mean the terms are now long enough.
+     */
+    if (previous_results[0] != NULL && g_hash_table_size (app->page_data_hash_map) > 0) {
+        return_with_full_text (invocation,
+                               get_subsearch_results (previous_results, terms, app),
+                               terms, app);
+        return TRUE;
+    }
+
     handle_results (invocation, terms, app);
 
     return TRUE;
@@ -277,14 +1082,14 @@ handle_get_result_metas (YelpShellSearchProvider2  *skeleton,
 
     if (g_hash_table_size (app->page_data_hash_map) > 0) {
         g_dbus_method_invocation_return_value (invocation,
-                                               get_result_metas (results,
-                                                                 app->page_data_hash_map));
+                                               get_result_metas (results, app));
         return TRUE;
     }
 
     delayed = delayed_result_getter_new (invocation,
                                          results,
-                                         get_result_metas);
+                                         get_result_metas,
+                                         FALSE);
     g_ptr_array_add (app->delayed_result_getters, delayed);
     return TRUE;
 }
@@ -375,28 +1180,291 @@ search_provider_app_dispose (GObject *obj)
     YelpSearchProviderApp *self = YELP_SEARCH_PROVIDER_APP (obj);
 
     g_clear_object (&self->skeleton);
+    g_clear_pointer (&self->index, search_index_free);
+    g_clear_pointer (&self->last_terms, g_free);
+    g_clear_pointer (&self->last_words, g_ptr_array_unref);
     g_clear_pointer (&self->page_data_hash_map, g_hash_table_unref);
     g_clear_pointer (&self->delayed_result_getters, g_ptr_array_unref);
+    if (self->pending_docs) {
+        g_queue_free_full (self->pending_docs, g_free);
+        self->pending_docs = NULL;
+    }
+    g_clear_pointer (&self->loading_doc, g_free);
+    if (self->budget_id != 0) {
+        g_source_remove (self->budget_id);
+        self->budget_id = 0;
+    }
+    g_clear_object (&self->cancellable);
 
     G_OBJECT_CLASS (yelp_search_provider_app_parent_class)->dispose (obj);
 }
 
+static gchar *
+snapshot_get_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "yelp",
+                             "search-provider.snapshot", NULL);
+}
+
+/* Fills in the pages and the index from the snapshot, if there is one for
+ * this language. The pages and the index point into the mapped file for
+ * their strings and entries, so only the pages are walked here.
+ */
+static gboolean
+snapshot_load (YelpSearchProviderApp *self)
+{
+    GMappedFile *file;
+    GBytes *bytes;
+    GVariant *snapshot, *pages, *words, *entries, *tokens;
+    const gchar *lang, *id, *doc_id, *title, *title_casefold, *desc, *desc_casefold, *icon;
+    gsize n_words, i;
+    guint version;
+    GVariantIter iter;
+    SearchIndex *index;
+    gchar *filename;
+
+    filename = snapshot_get_filename ();
+    file = g_mapped_file_new (filename, FALSE, NULL);
+    g_free (filename);
+    if (file == NULL)
+        return FALSE;
+
+    bytes = g_mapped_file_get_bytes (file);
+    g_mapped_file_unref (file);
+    snapshot = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (SNAPSHOT_TYPE),
+                                                             bytes, FALSE));
+    g_bytes_unref (bytes);
+
+    g_variant_get_child (snapshot, 0, "u", &version);
+    g_variant_get_child (snapshot, 1, "&s", &lang);
+    if (version != SNAPSHOT_VERSION || !g_str_equal (lang, g_get_language_names ()[0])) {
+        g_variant_unref (snapshot);
+        return FALSE;
+    }
+
+    index = search_index_new ();
+    index->snapshot = snapshot;
+    /* The page IDs are the ones in the snapshot */
+    g_ptr_array_set_free_func (index->page_ids, NULL);
+
+    words = g_variant_get_child_value (snapshot, 3);
+    n_words = g_variant_n_children (words);
+    for (i = 0; i < n_words; i++) {
+        const gchar *word;
+        g_variant_get_child (words, i, "&s", &word);
+        g_ptr_array_add (index->word_list, (gpointer) word);
+    }
+    g_variant_unref (words);
+
+    pages = g_variant_get_child_value (snapshot, 2);
+    g_variant_iter_init (&iter, pages);
+    while (g_variant_iter_next (&iter, "(&s&s&s&s&s&s&s)", &id, &doc_id,
+                                &title, &title_casefold, &desc, &desc_casefold, &icon)) {
+        /* Entries refer to pages by position, so even a repeat is listed */
+        if (!g_hash_table_contains (self->page_data_hash_map, id)) {
+            PageData *data = page_data_new_mapped (snapshot, id, doc_id,
+                                                   title, title_casefold,
+                                                   desc, desc_casefold, icon);
+            page_data_insert (self->page_data_hash_map, data);
+        }
+        g_ptr_array_add (index->page_ids, (gpointer) id);
+    }
+    g_variant_unref (pages);
+
+    /* Both stay referenced by the snapshot, which the index holds */
+    entries = g_variant_get_child_value (snapshot, 4);
+    index->entries = g_variant_get_fixed_array (entries, &index->n_entries, sizeof (IndexEntry));
+    g_variant_unref (entries);
+    tokens = g_variant_get_child_value (snapshot, 5);
+    index->tokens = g_variant_get_fixed_array (tokens, &index->n_tokens, sizeof (IndexEntry));
+    g_variant_unref (tokens);
+
+    /* The snapshot is only ever written by snapshot_save, but check that
+     * the entries stay inside it rather than trusting the file.
+     */
+    for (i = 0; i < index->n_entries + index->n_tokens; i++) {
+        const IndexEntry *entry = (i < index->n_entries ?
+                                   &index->entries[i] :
+                                   &index->tokens[i - index->n_entries]);
+        if (entry->word >= n_words || entry->page >= index->page_ids->len ||
+            entry->offset >= strlen (g_ptr_array_index (index->word_list, entry->word))) {
+            search_index_free (index);
+            return FALSE;
+        }
+    }
+
+    search_index_free (self->index);
+    self->index = index;
+
+    return TRUE;
+}
+
+static void
+snapshot_saved_cb (GFile        *file,
+                   GAsyncResult *result,
+                   GVariant     *snapshot)
+{
+    GError *error = NULL;
+
+    if (!g_file_replace_contents_finish (file, result, NULL, &error)) {
+        g_warning ("could not save search data: %s", error->message);
+        g_error_free (error);
+    }
+    g_variant_unref (snapshot);
+}
+
+static void
+snapshot_save (YelpSearchProviderApp *self)
+{
+    GVariantBuilder builder;
+    GVariant *snapshot;
+    GFile *file;
+    gchar *dir, *filename;
+    guint i;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE (SNAPSHOT_TYPE));
+    g_variant_builder_add (&builder, "u", SNAPSHOT_VERSION);
+    g_variant_builder_add (&builder, "s", g_get_language_names ()[0]);
+
+    g_variant_builder_open (&builder, G_VARIANT_TYPE ("a(sssssss)"));
+    for (i = 0; i < self->index->page_ids->len; i++) {
+        const gchar *page_id = g_ptr_array_index (self->index->page_ids, i);
+        PageData *data = g_hash_table_lookup (self->page_data_hash_map, page_id);
+
+        g_variant_builder_add (&builder, "(sssssss)", page_id, data->doc_id,
+                               data->title ? data->title : "",
+                               data->title_casefold ? data->title_casefold : "",
+                               data->desc ? data->desc : "",
+                               data->desc_casefold ? data->desc_casefold : "",
+                               data->icon ? data->icon : "");
+    }
+    g_variant_builder_close (&builder);
+
+    g_variant_builder_open (&builder, G_VARIANT_TYPE ("as"));
+    for (i = 0; i < self->index->word_list->len; i++)
+        g_variant_builder_add (&builder, "s", g_ptr_array_index (self->index->word_list, i));
+    g_variant_builder_close (&builder);
+
+    g_variant_builder_add_value (&builder,
+                                 g_variant_new_fixed_array (G_VARIANT_TYPE ("(uuu)"),
+                                                            self->index->entries,
+                                                            self->index->n_entries,
+                                                            sizeof (IndexEntry)));
+    g_variant_builder_add_value (&builder,
+                                 g_variant_new_fixed_array (G_VARIANT_TYPE ("(uuu)"),
+                                                            self->index->tokens,
+                                                            self->index->n_tokens,
+                                                            sizeof (IndexEntry)));
+
+    snapshot = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+    dir = g_build_filename (g_get_user_cache_dir (), "yelp", NULL);
+    if (g_mkdir_with_parents (dir, 0755) != 0) {
+        g_free (dir);
+        g_variant_unref (snapshot);
+        return;
+    }
+    g_free (dir);
+
+    filename = snapshot_get_filename ();
+    file = g_file_new_for_path (filename);
+    g_file_replace_contents_async (file,
+                                   g_variant_get_data (snapshot),
+                                   g_variant_get_size (snapshot),
+                                   NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                                   (GAsyncReadyCallback) snapshot_saved_cb,
+                                   snapshot);
+    g_object_unref (file);
+    g_free (filename);
+}
+
+/* Result IDs for gnome-help are page IDs, which show-page opens in
+ * gnome-help. Other documents get full URIs.
+ */
+static gchar *
+page_result_id (const gchar *doc_id,
+                const gchar *page_id)
+{
+    if (g_str_equal (doc_id, YELP_GNOME_HELP_URI))
+        return g_strdup (page_id);
+    if (g_str_has_prefix (doc_id, "ghelp:"))
+        return g_strconcat (doc_id, "?", page_id, NULL);
+    return g_strconcat (doc_id, "/", page_id, NULL);
+}
+
+static gboolean
+page_data_in_doc (gpointer     key,
+                  PageData    *data,
+                  const gchar *doc_id)
+{
+    return g_str_equal (data->doc_id, doc_id);
+}
+
+static gboolean
+page_data_in_docs (gpointer    key,
+                   PageData   *data,
+                   GHashTable *doc_ids)
+{
+    return g_hash_table_contains (doc_ids, data->doc_id);
+}
+
+static gboolean
+page_data_in_no_doc (gpointer    key,
+                     PageData   *data,
+                     GHashTable *doc_ids)
+{
+    return (!g_str_equal (data->doc_id, YELP_GNOME_HELP_URI) &&
+            !g_hash_table_contains (doc_ids, data->doc_id));
+}
+
+static void
+search_index_rebuild (YelpSearchProviderApp *self)
+{
+    GHashTableIter iter;
+    const gchar *page_id;
+    PageData *data;
+
+    search_index_free (self->index);
+    self->index = search_index_new ();
+
+    g_hash_table_iter_init (&iter, self->page_data_hash_map);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &page_id, (gpointer *) &data))
+        search_index_add (self->index, page_id, data);
+    search_index_finish (self->index);
+}
+
+static void
+answer_delayed (YelpSearchProviderApp *self)
+{
+    guint i;
+
+    for (i = 0; i < self->delayed_result_getters->len; i++) {
+        DelayedResultGetter *delayed = g_ptr_array_index (self->delayed_result_getters, i);
+        GVariant *results = delayed->result_getter (delayed->terms, self);
+
+        if (delayed->full_text)
+            return_with_full_text (delayed->invocation, results, delayed->terms, self);
+        else
+            g_dbus_method_invocation_return_value (delayed->invocation, results);
+    }
+
+    g_ptr_array_set_size (self->delayed_result_getters, 0);
+}
+
+static void load_next_document (YelpSearchProviderApp *self);
+
 static void
 preload_data_cb (YelpDocument          *document,
                  YelpDocumentSignal     signal,
                  YelpSearchProviderApp *self,
                  GError                *error)
 {
-    gchar **page_ids = yelp_document_list_page_ids (document);
+    gchar **page_ids;
     gchar **iter;
-    gint i;
 
     if (signal == YELP_DOCUMENT_SIGNAL_ERROR) {
         g_warning ("error during preloading data: %s", (error != NULL) ? error->message : "unknown error");
-        if (!self->released) {
-            g_application_release (G_APPLICATION (self));
-            self->released = TRUE;
-        }
+        load_next_document (self);
         return;
     }
 
@@ -404,37 +1472,38 @@ preload_data_cb (YelpDocument          *document,
         return;
 
     if (signal == YELP_DOCUMENT_SIGNAL_CONTENTS) {
+        /* Whatever the snapshot had for this document is replaced */
+        g_hash_table_foreach_remove (self->page_data_hash_map,
+                                     (GHRFunc) page_data_in_doc,
+                                     self->loading_doc);
+
+        page_ids = yelp_document_list_page_ids (document);
         for (iter = page_ids; *iter; iter++) {
-            gchar *page_id = *iter;
+            gchar *page_id = page_result_id (self->loading_doc, *iter);
             PageData *data;
-            gchar *icon_string = yelp_document_get_page_icon (document, page_id);
-            GIcon *icon = g_themed_icon_new (icon_string);
-            g_free (icon_string);
-
-            data = page_data_new_steal (yelp_document_get_page_title (document, page_id), 
-                                        yelp_document_get_page_desc (document, page_id), 
-                                        icon);
-            g_hash_table_insert (self->page_data_hash_map, page_id, data);
-        }
-
-        if (!self->released) {
-            g_application_release (G_APPLICATION (self));
-            self->released = TRUE;
-        }
 
-        for (i = 0; i < self->delayed_result_getters->len; i++) {
-            DelayedResultGetter *delayed = g_ptr_array_index (self->delayed_result_getters, i);
+            if (g_hash_table_contains (self->page_data_hash_map, page_id)) {
+                g_free (page_id);
+                continue;
+            }
 
-            g_dbus_method_invocation_return_value (delayed->invocation,
-                                                   delayed->result_getter (delayed->terms,
-                                                                           self->page_data_hash_map));
+            data = page_data_new_steal (page_id, self->loading_doc,
+                                        yelp_document_get_page_title (document, *iter),
+                                        yelp_document_get_page_desc (document, *iter),
+                                        yelp_document_get_page_icon (document, *iter));
+            page_data_insert (self->page_data_hash_map, data);
         }
+        g_strfreev (page_ids);
 
-        g_ptr_array_set_size (self->delayed_result_getters, 0);
-        /* We only steal the contents of the page_ids array,
-         * so we free only the array.
+        /* gnome-help is what most searches are for, so it's searchable as
+         * soon as it's in. Everything else waits for the end of the batch.
          */
-        g_free (page_ids);
+        if (g_str_equal (self->loading_doc, YELP_GNOME_HELP_URI)) {
+            search_index_rebuild (self);
+            answer_delayed (self);
+        }
+
+        load_next_document (self);
     }
 }
 
@@ -445,13 +1514,19 @@ uri_resolved_cb (YelpUri               *uri,
     YelpDocument *doc;
     gchar *page_id;
 
-    doc = yelp_document_get_for_uri (uri);
     g_signal_handler_disconnect (uri, app->uri_resolve_id);
     app->uri_resolve_id = 0;
+    if (g_cancellable_is_cancelled (app->cancellable))
+        return;
+    doc = yelp_document_get_for_uri (uri);
+    if (doc == NULL) {
+        load_next_document (app);
+        return;
+    }
     page_id = yelp_uri_get_page_id (uri);
     yelp_document_request_page (doc,
                                 page_id,
-                                NULL,
+                                app->cancellable,
                                 (YelpDocumentCallback) preload_data_cb,
                                 app,
                                 NULL);
@@ -460,34 +1535,276 @@ uri_resolved_cb (YelpUri               *uri,
     g_free (page_id);
 }
 
+static void
+load_document (YelpSearchProviderApp *self,
+               const gchar           *doc_id)
+{
+    YelpUri *uri;
+
+    g_free (self->loading_doc);
+    self->loading_doc = g_strdup (doc_id);
+
+    uri = yelp_uri_new (doc_id);
+    self->uri_resolve_id = g_signal_connect_object (uri,
+                                                    "resolved",
+                                                    G_CALLBACK (uri_resolved_cb),
+                                                    self,
+                                                    0);
+    yelp_uri_resolve (uri);
+    g_object_unref (uri);
+}
+
+static void
+stored_pages_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+    GVariant *pages = yelp_storage_list_pages (yelp_storage_get_default ());
+    g_task_return_pointer (task,
+                           pages ? g_variant_ref_sink (pages) : NULL,
+                           (GDestroyNotify) g_variant_unref);
+}
+
+/* Documents in the search index get their pages from it. Only the rest are
+ * loaded, and the ones that were never loaded go first. The others already
+ * have pages from the snapshot, so the budget runs out on them instead.
+ */
+static void
+stored_pages_cb (YelpSearchProviderApp *self,
+                 GAsyncResult          *result,
+                 gpointer               user_data)
+{
+    gchar **doc_ids = g_task_get_task_data (G_TASK (result));
+    const gchar *doc_uri, *full_uri, *title, *desc, *icon;
+    GHashTable *listed, *stored, *known;
+    GHashTableIter hash_iter;
+    GVariantIter iter;
+    GVariant *pages;
+    PageData *data;
+    GQueue *loaded;
+    gint i;
+
+    pages = g_task_propagate_pointer (G_TASK (result), NULL);
+    if (g_cancellable_is_cancelled (self->cancellable)) {
+        if (pages)
+            g_variant_unref (pages);
+        return;
+    }
+
+    listed = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; doc_ids[i] != NULL; i++) {
+        if (g_str_equal (doc_ids[i], YELP_GNOME_HELP_URI) ||
+            g_str_equal (doc_ids[i], "ghelp:gnome-help"))
+            continue;
+        g_hash_table_add (listed, (gpointer) g_intern_string (doc_ids[i]));
+    }
+
+    /* Forget documents that aren't installed anymore */
+    g_hash_table_foreach_remove (self->page_data_hash_map,
+                                 (GHRFunc) page_data_in_no_doc,
+                                 listed);
+
+    stored = g_hash_table_new (g_str_hash, g_str_equal);
+    if (pages != NULL) {
+        g_variant_iter_init (&iter, pages);
+        while (g_variant_iter_next (&iter, "(&s&s&s&s&s)", &doc_uri, NULL, NULL, NULL, NULL)) {
+            if (g_hash_table_contains (listed, doc_uri))
+                g_hash_table_add (stored, (gpointer) g_intern_string (doc_uri));
+        }
+
+        /* Whatever the snapshot had for these documents is replaced */
+        g_hash_table_foreach_remove (self->page_data_hash_map,
+                                     (GHRFunc) page_data_in_docs,
+                                     stored);
+
+        g_variant_iter_init (&iter, pages);
+        while (g_variant_iter_next (&iter, "(&s&s&s&s&s)",
+                                    &doc_uri, &full_uri, &title, &desc, &icon)) {
+            gchar *page_id;
+
+            if (!g_hash_table_contains (stored, doc_uri))
+                continue;
+            page_id = full_text_result_id (doc_uri, full_uri);
+            if (g_hash_table_contains (self->page_data_hash_map, page_id)) {
+                g_free (page_id);
+                continue;
+            }
+            data = page_data_new_steal (page_id, doc_uri, g_strdup (title), g_strdup (desc),
+                                        g_strdup (icon[0] ? icon : "help-browser"));
+            page_data_insert (self->page_data_hash_map, data);
+        }
+        g_variant_unref (pages);
+    }
+
+    known = g_hash_table_new (g_str_hash, g_str_equal);
+    g_hash_table_iter_init (&hash_iter, self->page_data_hash_map);
+    while (g_hash_table_iter_next (&hash_iter, NULL, (gpointer *) &data))
+        g_hash_table_add (known, (gpointer) data->doc_id);
+
+    loaded = g_queue_new ();
+    for (i = 0; doc_ids[i] != NULL; i++) {
+        if (!g_hash_table_contains (listed, doc_ids[i]) ||
+            g_hash_table_contains (stored, doc_ids[i]))
+            continue;
+        g_queue_push_tail (g_hash_table_contains (known, doc_ids[i]) ? loaded : self->pending_docs,
+                           g_strdup (doc_ids[i]));
+    }
+    while (!g_queue_is_empty (loaded))
+        g_queue_push_tail (self->pending_docs, g_queue_pop_head (loaded));
+    g_queue_free (loaded);
+
+    g_hash_table_destroy (known);
+    g_hash_table_destroy (stored);
+    g_hash_table_destroy (listed);
+
+    load_next_document (self);
+}
+
+static void
+help_list_cb (YelpDocument          *document,
+              YelpDocumentSignal     signal,
+              YelpSearchProviderApp *self,
+              GError                *error)
+{
+    gchar **doc_ids;
+    GTask *task;
+
+    if (signal == YELP_DOCUMENT_SIGNAL_INFO)
+        return;
+
+    doc_ids = NULL;
+    if (signal == YELP_DOCUMENT_SIGNAL_CONTENTS)
+        doc_ids = yelp_help_list_get_document_ids (YELP_HELP_LIST (document));
+    if (doc_ids == NULL) {
+        load_next_document (self);
+        return;
+    }
+
+    /* Reading the pages from the search index is much cheaper than
+     * loading the documents, but it still takes a pass over the index.
+     */
+    task = g_task_new (self, self->cancellable, (GAsyncReadyCallback) stored_pages_cb, NULL);
+    g_task_set_task_data (task, doc_ids, (GDestroyNotify) g_strfreev);
+    g_task_run_in_thread (task, stored_pages_thread);
+    g_object_unref (task);
+}
+
+static void
+help_list_resolved_cb (YelpUri               *uri,
+                       YelpSearchProviderApp *self)
+{
+    YelpDocument *doc;
+
+    g_signal_handler_disconnect (uri, self->uri_resolve_id);
+    self->uri_resolve_id = 0;
+    if (g_cancellable_is_cancelled (self->cancellable))
+        return;
+    doc = yelp_document_get_for_uri (uri);
+    if (doc == NULL) {
+        load_next_document (self);
+        return;
+    }
+    yelp_document_request_page (doc, "index", self->cancellable,
+                                (YelpDocumentCallback) help_list_cb,
+                                self, NULL);
+    g_object_unref (doc);
+}
+
+/* Rebuilds the index, saves it, and lets the provider exit. Nothing still
+ * loading gets to call back after this.
+ */
+static void
+load_finish (YelpSearchProviderApp *self)
+{
+    if (self->budget_id != 0) {
+        g_source_remove (self->budget_id);
+        self->budget_id = 0;
+    }
+    g_cancellable_cancel (self->cancellable);
+
+    search_index_rebuild (self);
+    answer_delayed (self);
+    snapshot_save (self);
+
+    if (!self->released) {
+        g_application_release (G_APPLICATION (self));
+        self->released = TRUE;
+    }
+}
+
+static gboolean
+load_budget_expired (YelpSearchProviderApp *self)
+{
+    self->budget_id = 0;
+    load_finish (self);
+    return FALSE;
+}
+
+/* Loads gnome-help, then the help list, then the pages of the documents on
+ * it, until they're done or the time is up.
+ */
+static void
+load_next_document (YelpSearchProviderApp *self)
+{
+    gchar *doc_id;
+
+    if (g_cancellable_is_cancelled (self->cancellable))
+        return;
+
+    if (!self->listed) {
+        YelpUri *uri;
+
+        self->listed = TRUE;
+        self->budget_id = g_timeout_add (SEARCH_PROVIDER_LOAD_BUDGET,
+                                         (GSourceFunc) load_budget_expired,
+                                         self);
+        uri = yelp_uri_new ("help-list:");
+        self->uri_resolve_id = g_signal_connect_object (uri,
+                                                        "resolved",
+                                                        G_CALLBACK (help_list_resolved_cb),
+                                                        self,
+                                                        0);
+        yelp_uri_resolve (uri);
+        g_object_unref (uri);
+        return;
+    }
+
+    if (!g_queue_is_empty (self->pending_docs)) {
+        doc_id = g_queue_pop_head (self->pending_docs);
+        load_document (self, doc_id);
+        g_free (doc_id);
+        return;
+    }
+
+    load_finish (self);
+}
+
 static void
 search_provider_app_startup (GApplication *app)
 {
     YelpSearchProviderApp *self = YELP_SEARCH_PROVIDER_APP (app);
-    YelpUri *base_uri;
 
     G_APPLICATION_CLASS (yelp_search_provider_app_parent_class)->startup (app);
 
     if (g_getenv ("YELP_SEARCH_PROVIDER_PERSIST") != NULL)
         g_application_hold (app);
 
-    base_uri = yelp_uri_new (YELP_GNOME_HELP_URI);
-    self->uri_resolve_id = g_signal_connect_object (base_uri,
-                                                    "resolved",
-                                                    G_CALLBACK (uri_resolved_cb),
-                                                    self,
-                                                    0);
-
+    /* Keyed by the IDs in the pages themselves */
     self->page_data_hash_map = g_hash_table_new_full (g_str_hash,
                                                       g_str_equal,
-                                                      g_free,
+                                                      NULL,
                                                       (GDestroyNotify) page_data_free);
+    self->index = search_index_new ();
     self->delayed_result_getters = g_ptr_array_new_with_free_func ((GDestroyNotify) delayed_result_getter_free);
+    self->pending_docs = g_queue_new ();
+    self->cancellable = g_cancellable_new ();
 
-    yelp_uri_resolve (base_uri);
-    g_application_hold (app);
+    /* Answer from the last run's data until the preload catches up */
+    snapshot_load (self);
 
-    g_object_unref (base_uri);
+    load_document (self, YELP_GNOME_HELP_URI);
+    g_application_hold (app);
 }
 
 static gboolean
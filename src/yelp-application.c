@@ -128,9 +128,21 @@ activate_show_page (GSimpleAction *action,
                     gpointer       user_data)
 {
     YelpApplication *app = YELP_APPLICATION (user_data);
-    YelpUri *uri = yelp_uri_new (YELP_GNOME_HELP_URI);
-    gchar *xref = g_strconcat ("xref:", g_variant_get_string (parameter, NULL), NULL);
-    YelpUri *page_uri = yelp_uri_new_relative (uri, xref);
+    const gchar *page = g_variant_get_string (parameter, NULL);
+    YelpUri *uri, *page_uri;
+    gchar *xref;
+
+    /* Page IDs are in gnome-help; pages in other documents come as URIs */
+    if (strchr (page, ':') != NULL) {
+        page_uri = yelp_uri_new (page);
+        open_uri (app, page_uri, TRUE, FALSE);
+        g_object_unref (page_uri);
+        return;
+    }
+
+    uri = yelp_uri_new (YELP_GNOME_HELP_URI);
+    xref = g_strconcat ("xref:", page, NULL);
+    page_uri = yelp_uri_new_relative (uri, xref);
 
     open_uri (app, page_uri, TRUE, FALSE);
 
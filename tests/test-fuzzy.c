@@ -0,0 +1,174 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Yelp authors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: The Yelp authors
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "yelp-fuzzy.h"
+
+/* The same distance, worked out over the whole table with no early exit,
+ * for ASCII words of at most YELP_FUZZY_MAX_CHARS characters.
+ */
+static gint
+reference_distance (const gchar *word,
+                    const gchar *text,
+                    gint         max_edits)
+{
+    gint n = strlen (word), m = strlen (text);
+    gint d[YELP_FUZZY_MAX_CHARS + 1][64];
+    gint i, j, best;
+
+    g_assert (n <= YELP_FUZZY_MAX_CHARS && m < 64);
+
+    for (i = 0; i <= n; i++)
+        d[i][0] = i;
+    for (j = 0; j <= m; j++)
+        d[0][j] = j;
+    for (i = 1; i <= n; i++) {
+        for (j = 1; j <= m; j++) {
+            gint v = d[i - 1][j - 1] + (word[i - 1] != text[j - 1]);
+            v = MIN (v, d[i - 1][j] + 1);
+            v = MIN (v, d[i][j - 1] + 1);
+            if (i > 1 && j > 1 && word[i - 1] == text[j - 2] && word[i - 2] == text[j - 1])
+                v = MIN (v, d[i - 2][j - 2] + 1);
+            d[i][j] = v;
+        }
+    }
+
+    best = d[n][0];
+    for (j = 1; j <= m; j++)
+        best = MIN (best, d[n][j]);
+    return MIN (best, max_edits + 1);
+}
+
+static void
+test_transpose (void)
+{
+    /* Swaps at the end of the word, where the text goes on past it */
+    g_assert_cmpint (yelp_fuzzy_distance ("hepl", -1, "helper", -1, 1), ==, 1);
+    g_assert_cmpint (yelp_fuzzy_distance ("helol", -1, "hello", -1, 1), ==, 1);
+    g_assert_cmpint (yelp_fuzzy_distance ("documnet", -1, "documentation", -1, 1), ==, 1);
+    g_assert_cmpint (yelp_fuzzy_distance ("ab", -1, "ba", -1, 1), ==, 1);
+    /* Only adjacent characters are swapped */
+    g_assert_cmpint (yelp_fuzzy_distance ("abcd", -1, "dbca", -1, 1), ==, 2);
+    /* The text length cuts the prefix off before the swap */
+    g_assert_cmpint (yelp_fuzzy_distance ("hepl", -1, "help", 2, 1), ==, 2);
+}
+
+/* Every word and text over a small alphabet, so the early exit is checked
+ * against the full table, swaps across the rows it skips included.
+ */
+static void
+test_early_exit (void)
+{
+    static const gchar letters[] = "abc";
+    gchar word[6], text[7];
+    gint wlen, tlen, wi, ti, max_edits;
+
+    for (wlen = 0; wlen <= 5; wlen++) {
+        gint nwords = 1;
+        for (wi = 0; wi < wlen; wi++)
+            nwords *= 3;
+        for (wi = 0; wi < nwords; wi++) {
+            gint k, x = wi;
+            for (k = 0; k < wlen; k++, x /= 3)
+                word[k] = letters[x % 3];
+            word[wlen] = '\0';
+
+            for (tlen = 0; tlen <= 6; tlen++) {
+                gint ntexts = 1;
+                for (ti = 0; ti < tlen; ti++)
+                    ntexts *= 3;
+                for (ti = 0; ti < ntexts; ti++) {
+                    x = ti;
+                    for (k = 0; k < tlen; k++, x /= 3)
+                        text[k] = letters[x % 3];
+                    text[tlen] = '\0';
+
+                    for (max_edits = 0; max_edits <= 2; max_edits++) {
+                        gint got = yelp_fuzzy_distance (word, -1, text, -1, max_edits);
+                        gint want = reference_distance (word, text, max_edits);
+                        if (got != want)
+                            g_error ("distance from %s to %s with %d edits: %d, not %d",
+                                     word, text, max_edits, got, want);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void
+test_max_chars (void)
+{
+    gchar *same, *word, *text;
+
+    same = g_strnfill (YELP_FUZZY_MAX_CHARS, 'a');
+    word = g_strconcat (same, "bbbbbbbb", NULL);
+    text = g_strconcat (same, "cccccccc", NULL);
+
+    /* Only the first YELP_FUZZY_MAX_CHARS characters count */
+    g_assert_cmpint (yelp_fuzzy_distance (word, -1, text, -1, 2), ==, 0);
+    g_assert_cmpint (yelp_fuzzy_distance (word, -1, same, -1, 2), ==, 0);
+    /* But a difference before the cut still does */
+    text[YELP_FUZZY_MAX_CHARS - 1] = 'c';
+    g_assert_cmpint (yelp_fuzzy_distance (word, -1, text, -1, 2), ==, 1);
+    /* Out of range edit counts are clamped */
+    g_assert_cmpint (yelp_fuzzy_distance ("abc", -1, "xyz", -1, -1), ==, 1);
+
+    g_assert_cmpint (yelp_fuzzy_max_edits (word, -1), ==, 2);
+
+    g_free (same);
+    g_free (word);
+    g_free (text);
+}
+
+static void
+test_empty (void)
+{
+    /* An empty word is a prefix of everything */
+    g_assert_cmpint (yelp_fuzzy_distance ("", -1, "help", -1, 1), ==, 0);
+    g_assert_cmpint (yelp_fuzzy_distance ("", -1, "", -1, 0), ==, 0);
+    g_assert_cmpint (yelp_fuzzy_distance ("help", 0, "help", -1, 1), ==, 0);
+    /* Nothing but an empty word is close to an empty text */
+    g_assert_cmpint (yelp_fuzzy_distance ("abc", -1, "", -1, 1), ==, 2);
+    g_assert_cmpint (yelp_fuzzy_distance ("ab", -1, "", -1, 2), ==, 2);
+
+    g_assert_cmpint (yelp_fuzzy_max_edits ("", -1), ==, 0);
+    g_assert_cmpint (yelp_fuzzy_text_distance ("", "help", 1), ==, 2);
+    g_assert_cmpint (yelp_fuzzy_text_distance (NULL, "help", 1), ==, 2);
+    g_assert_cmpint (yelp_fuzzy_text_distance ("  ,, ", "help", 1), ==, 2);
+    g_assert_cmpint (yelp_fuzzy_text_distance ("get some hlep now", "help", 1), ==, 1);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/fuzzy/transpose", test_transpose);
+    g_test_add_func ("/fuzzy/early-exit", test_early_exit);
+    g_test_add_func ("/fuzzy/max-chars", test_max_chars);
+    g_test_add_func ("/fuzzy/empty", test_empty);
+
+    return g_test_run ();
+}
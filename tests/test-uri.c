@@ -24,6 +24,7 @@
 
 #include <gio/gio.h>
 #include <gio/gunixoutputstream.h>
+#include <glib/gstdio.h>
 
 #include "yelp-uri.h"
 
@@ -144,6 +145,11 @@ print_uri (gchar *orig, YelpUri *uri, GOutputStream *stream)
     g_output_stream_write (stream, "\0", 1, NULL, NULL);
 }
 
+/* The absolute path of the uri directory, which tests refer to as @URIDIR@ */
+static gchar *uridir = NULL;
+/* A data directory for tests that add documents while running */
+static gchar *tmpdir = NULL;
+
 static void run_test (gconstpointer data)
 {
     GFileInputStream *stream;
@@ -154,14 +160,19 @@ static void run_test (gconstpointer data)
     GFile *file = G_FILE (data);
     YelpUri *uri;
     GOutputStream *outstream;
-    gchar *out;
+    gchar *out, *expected;
 
     stream = g_file_read (file, NULL, NULL);
     g_assert (g_input_stream_read_all (G_INPUT_STREAM (stream),
-                                       contents, 1024, &bytes,
+                                       contents, 1023, &bytes,
                                        NULL, NULL));
-    newline = strchr (contents, '\n');
-    curi = g_strndup (contents, newline - contents);
+    contents[bytes] = '\0';
+    uriv = g_strsplit (contents, "@URIDIR@", 0);
+    expected = g_strjoinv (uridir, uriv);
+    g_strfreev (uriv);
+
+    newline = strchr (expected, '\n');
+    curi = g_strndup (expected, newline - expected);
     uriv = g_strsplit (curi, " ", 2);
     uri = yelp_uri_new (uriv[0]);
     if (uriv[1] != NULL)
@@ -178,7 +189,62 @@ static void run_test (gconstpointer data)
     print_uri (curi, uri, outstream);
     out = (gchar *) g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (outstream));
     g_free (curi);
-    g_assert (!strncmp (out, contents, bytes));
+    g_assert (!strncmp (out, expected, strlen (expected)));
+    g_free (expected);
+    g_object_unref (outstream);
+    g_object_unref (uri);
+}
+
+static YelpUriDocumentType
+resolve_type (const gchar *arg)
+{
+    YelpUri *uri = yelp_uri_new (arg);
+    YelpUriDocumentType type;
+
+    yelp_uri_resolve (uri);
+    while (!yelp_uri_is_resolved (uri))
+        g_main_context_iteration (NULL, TRUE);
+    type = yelp_uri_get_document_type (uri);
+    g_object_unref (uri);
+    return type;
+}
+
+static gboolean
+appear_timeout (gboolean *timed_out)
+{
+    *timed_out = TRUE;
+    return FALSE;
+}
+
+/* A document installed after a first failed lookup has to be found once
+ * the data directory's monitor has seen it.
+ */
+static void
+test_help_appears (void)
+{
+    gchar *docdir, *page;
+    gboolean timed_out = FALSE;
+    guint timeout;
+
+    g_assert_cmpint (resolve_type ("help:yelp-test-appears"), ==,
+                     YELP_URI_DOCUMENT_TYPE_NOT_FOUND);
+
+    docdir = g_build_filename (tmpdir, "help", "C", "yelp-test-appears", NULL);
+    page = g_build_filename (docdir, "index.page", NULL);
+    g_assert (g_mkdir_with_parents (docdir, 0755) == 0);
+    g_assert (g_file_set_contents (page, "<page xmlns=\"http://projectmallard.org/1.0/\" id=\"index\"/>\n",
+                                   -1, NULL));
+
+    timeout = g_timeout_add_seconds (10, (GSourceFunc) appear_timeout, &timed_out);
+    while (resolve_type ("help:yelp-test-appears") != YELP_URI_DOCUMENT_TYPE_MALLARD) {
+        g_assert (!timed_out);
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_source_remove (timeout);
+
+    g_unlink (page);
+    g_free (page);
+    g_free (docdir);
 }
 
 static int
@@ -189,7 +255,7 @@ run_all_tests (int argc, char **argv)
     GFileEnumerator *children;
     GList *list = NULL;
 
-    dir = g_file_new_for_path ("uri");
+    dir = g_file_new_for_path (uridir);
     children = g_file_enumerate_children (dir,
                                           G_FILE_ATTRIBUTE_STANDARD_NAME,
                                           0, NULL, NULL);
@@ -209,6 +275,8 @@ run_all_tests (int argc, char **argv)
         list = g_list_delete_link (list, list);
     }
 
+    g_test_add_func ("/help-appears", test_help_appears);
+
     return g_test_run ();
 }
 
@@ -230,8 +298,46 @@ main (int argc, char **argv)
     g_log_set_always_fatal (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL);
         
     if (argc < 2) {
+        gchar *cwd, *path;
+        gint ret;
+
+        /* The environment has to be set before GLib first reads it. The
+         * test data directories come first: one that is missing, one
+         * without help, and the one with the test documents. The language
+         * has no documents, and the man pages for it come first.
+         */
+        cwd = g_get_current_dir ();
+        uridir = g_build_filename (cwd, "uri", NULL);
+        g_free (cwd);
+        tmpdir = g_dir_make_tmp ("test-uri-XXXXXX", NULL);
+        g_assert (tmpdir != NULL);
+
+        path = g_build_filename (uridir, "missing", NULL);
+        g_setenv ("XDG_DATA_HOME", path, TRUE);
+        g_free (path);
+        path = g_strdup_printf ("%s/missing:%s/nohelp:%s/data:%s:/usr/local/share:/usr/share",
+                                uridir, uridir, uridir, tmpdir);
+        g_setenv ("XDG_DATA_DIRS", path, TRUE);
+        g_free (path);
+        path = g_strdup_printf ("%s/data/man:", uridir);
+        g_setenv ("MANPATH", path, TRUE);
+        g_free (path);
+        g_setenv ("LANGUAGE", "xx", TRUE);
+
         g_test_init (&argc, &argv, NULL);
-        return run_all_tests (argc, argv);
+        ret = run_all_tests (argc, argv);
+
+        path = g_build_filename (tmpdir, "help", "C", "yelp-test-appears", NULL);
+        g_rmdir (path);
+        g_free (path);
+        path = g_build_filename (tmpdir, "help", "C", NULL);
+        g_rmdir (path);
+        g_free (path);
+        path = g_build_filename (tmpdir, "help", NULL);
+        g_rmdir (path);
+        g_free (path);
+        g_rmdir (tmpdir);
+        return ret;
     }
     else {
         if (argc > 2) {